@@ -23,6 +23,9 @@ limitations under the License.
 #include "printer.h"
 #include "global_config.h"
 #include "WebserverAPI.h"
+#include "StaticFileCache.h"
+#include "ServerMetrics.h"
+#include <boost/lexical_cast.hpp>
 #include "RLog.h"
 #if defined(__APPLE__) || defined(__linux)
 #include <sys/types.h>
@@ -63,7 +66,15 @@ struct mg_connection *conn) {
 	const struct mg_request_info *ri = mg_get_request_info(conn);
 
 	if (event == MG_NEW_REQUEST) {
-		if(strncmp(ri->uri,"/printer/",9)!=0) return repetier::HandlePagerequest(conn);
+		if(strcmp(ri->uri,"/metrics")==0) {
+			repetier::HandleMetricsRequest(conn);
+			return (void*)"";
+		}
+		if(strncmp(ri->uri,"/printer/",9)!=0) {
+			if(repetier::HandlePagerequest(conn)!=NULL) return (void*)"";
+			if(StaticFileCache::serve(conn)) return (void*)"";
+			return NULL; // mongoose serves the file
+		}
 		repetier::HandleWebrequest(conn);
 		// Mark as processed
 		return (void*)"";
@@ -81,6 +92,7 @@ case SIGHUP:
 case SIGTERM:
 	mg_stop(ctx);
 	gconfig->stopPrinterThreads();
+	RLog::stopWriter();
 	exit(0); // Terminate server
 	break;		
 	}	
@@ -307,11 +319,21 @@ Cleanup2:
 #endif
 	}
 
+	RLog::startWriter(); // After fork, the writer thread would not survive it
+	repetier::LoadLanguages();
+	StaticFileCache::build(gconfig->getWebsiteRoot());
 	gconfig->readPrinterConfigs();
 	gconfig->startPrinterThreads();
-	const char *options[] = {"document_root", gconfig->getWebsiteRoot().c_str(),"listening_ports", gconfig->getPorts().c_str(), NULL};
+	string threads = boost::lexical_cast<string>(gconfig->getWebThreads());
+	string queueSize = boost::lexical_cast<string>(gconfig->getWebQueueSize());
+	string backlog = boost::lexical_cast<string>(gconfig->getWebListenBacklog());
+	string keepAlive = boost::lexical_cast<string>(gconfig->getWebKeepAliveTimeout());
+	const char *options[] = {"document_root", gconfig->getWebsiteRoot().c_str(),"listening_ports", gconfig->getPorts().c_str(),
+		"enable_keep_alive", "yes", "keep_alive_timeout_ms", keepAlive.c_str(), "num_threads", threads.c_str(),
+		"socket_queue_size", queueSize.c_str(), "listen_backlog", backlog.c_str(), NULL};
 
 	ctx = mg_start(&callback, NULL, options);
+	ServerMetrics::setWebContext(ctx);
 	//getchar();  // Wait until user hits "enter"
 	if(gconfig->daemon) {
 		while(1) {
@@ -324,6 +346,7 @@ Cleanup2:
 	mg_stop(ctx);
 	cout << "Closing server" << endl;
 	gconfig->stopPrinterThreads();
+	RLog::stopWriter();
 	return 0;
 }
 
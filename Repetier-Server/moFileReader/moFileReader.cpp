@@ -33,6 +33,8 @@
 #include "moFileReader.h"
 #include <iostream>
 #include <cstdlib>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 MO_BEGIN_NAMESPACE
 
@@ -46,6 +48,18 @@ unsigned long moFileReader::SwapBytes(unsigned long in)
     return (b0 << 24) | (b1 << 16) | (b2 << 8) | b3;
 }
 
+moFileReader::moFileReader()
+    : m_region(NULL), m_data(NULL), m_size(0), m_numStrings(0),
+      m_offsetOriginal(0), m_offsetTranslation(0),
+      m_sizeHashtable(0), m_offsetHashtable(0)
+{
+}
+
+moFileReader::~moFileReader()
+{
+    ClearTable();
+}
+
 const std::string& moFileReader::GetErrorDescription() const
 {
     return m_error;
@@ -53,61 +67,137 @@ const std::string& moFileReader::GetErrorDescription() const
 
 void moFileReader::ClearTable()
 {
-    m_lookup.clear();
+    delete m_region;
+    m_region = NULL;
+    m_data = NULL;
+    m_size = 0;
+    m_numStrings = 0;
+    m_sizeHashtable = 0;
 }
 
 unsigned int moFileReader::GetNumStrings() const
 {
-    return (int)m_lookup.size();
+    return m_numStrings;
 }
 
-std::string moFileReader::Lookup( const char* id ) const
+// The hash function used by GNU gettext to build the table in the .mo-file.
+static uint32_t moHashString(const char* str, size_t length)
+{
+    uint32_t hval = 0;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        hval <<= 4;
+        hval += (unsigned char)str[i];
+        uint32_t g = hval & ((uint32_t)0xf << 28);
+        if ( g != 0 )
+        {
+            hval ^= g >> 24;
+            hval ^= g;
+        }
+    }
+    return hval;
+}
+
+bool moFileReader::Matches(uint32_t i, const char* id, size_t idLength) const
+{
+    // Plural entries store "singular\0plural", so the singular form
+    // must end at idLength.
+    uint32_t len = OriginalLength(i);
+    if ( len < idLength ) return false;
+    const char* orig = Original(i);
+    return memcmp(orig, id, idLength) == 0 && (len == idLength || orig[idLength] == 0);
+}
+
+bool moFileReader::Find( const char* id, size_t idLength, const char*& translation, size_t& trLength ) const
 {
-    if ( m_lookup.size() <= 0) return id;
-    moLookupList::const_iterator iterator = m_lookup.find(id);    
+    if ( m_numStrings == 0 ) return false;
+    if ( m_sizeHashtable > 2 )
+    {
+        // Open addressing with double hashing, same as gettext.
+        uint32_t hval = moHashString(id, idLength);
+        uint32_t idx = hval % m_sizeHashtable;
+        uint32_t incr = 1 + (hval % (m_sizeHashtable - 2));
+        for ( uint32_t tries = 0; tries < m_sizeHashtable; tries++ )
+        {
+            uint32_t nstr = Word(m_offsetHashtable + 4*idx);
+            if ( nstr == 0 ) return false;
+            nstr--;
+            if ( nstr < m_numStrings && Matches(nstr, id, idLength) )
+            {
+                translation = Translation(nstr);
+                trLength = TranslationLength(nstr);
+                return true;
+            }
+            if ( idx >= m_sizeHashtable - incr )
+                idx -= m_sizeHashtable - incr;
+            else
+                idx += incr;
+        }
+        return false;
+    }
+    // No hash table, originals are sorted.
+    uint32_t lo = 0, hi = m_numStrings;
+    while ( lo < hi )
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t len = OriginalLength(mid);
+        int c = memcmp(Original(mid), id, len < idLength ? len : idLength);
+        if ( c == 0 && len != idLength ) c = len < idLength ? -1 : 1;
+        if ( c == 0 )
+        {
+            translation = Translation(mid);
+            trLength = TranslationLength(mid);
+            return true;
+        }
+        if ( c < 0 ) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
 
-    if ( iterator == m_lookup.end() )
+std::string moFileReader::Lookup( const char* id ) const
+{
+    const char* tr;
+    size_t trLength;
+    if ( !Find(id, strlen(id), tr, trLength) )
     {
         return id;
     }
-    return iterator->second;
+    return std::string(tr, trLength);
 }
 
 moFileReader::eErrorCode moFileReader::ReadFile( const char* filename )
 {    
-    // Creating a file-description.
-    moFileInfo moInfo;
+    ClearTable();
 
-    // Reference to the List inside moInfo.
-    moFileInfo::moTranslationPairList& TransPairInfo = moInfo.m_translationPairInformation;
-
-    // Opening the file.
-    std::ifstream stream( filename, std::ios_base::binary | std::ios_base::in );
-    if ( !stream.is_open() )
+    // Map the whole file read only.
+    try
+    {
+        boost::interprocess::file_mapping file(filename, boost::interprocess::read_only);
+        m_region = new boost::interprocess::mapped_region(file, boost::interprocess::read_only);
+    }
+    catch ( const boost::interprocess::interprocess_exception& )
     {
         m_error = std::string("Cannot open File ") + std::string(filename);
         return moFileReader::EC_FILENOTFOUND;
     }
+    m_data = static_cast<const char*>(m_region->get_address());
+    m_size = m_region->get_size();
 
     // Read in all the 4 bytes of fire-magic, offsets and stuff...
-    stream.read((char*)&moInfo.m_magicNumber, 4);
-    stream.read((char*)&moInfo.m_fileVersion, 4);
-    stream.read((char*)&moInfo.m_numStrings, 4);
-    stream.read((char*)&moInfo.m_offsetOriginal, 4);
-    stream.read((char*)&moInfo.m_offsetTranslation, 4);
-    stream.read((char*)&moInfo.m_sizeHashtable, 4);
-    stream.read((char*)&moInfo.m_offsetHashtable, 4);
-
-    if ( stream.bad() )
+    moFileInfo moInfo;
+    if ( m_size < 28 )
     {
-        stream.close();
-        m_error = "Stream bad during reading. The .mo-file seems to be invalid or has bad descriptions!";
+        ClearTable();
+        m_error = "File too short. The .mo-file seems to be invalid!";
         return moFileReader::EC_FILEINVALID;
     }
+    moInfo.m_magicNumber = Word(0);
 
     // Checking the Magic Number
     if ( MagicNumber != moInfo.m_magicNumber )
     {
+        ClearTable();
         if ( MagicReversed != moInfo.m_magicNumber )
         {
             m_error = "The Magic Number does not match in all cases!";
@@ -120,86 +210,37 @@ moFileReader::eErrorCode moFileReader::ReadFile( const char* filename )
             return moFileReader::EC_MAGICNUMBER_REVERSED;
         }
     }  
-    
-    // Now we search all Length & Offsets of the original strings
-    for ( int i = 0; i < moInfo.m_numStrings; i++ )
-    {
-        moTranslationPairInformation _str;        
-        stream.read((char*)&_str.m_orLength, 4);
-        stream.read((char*)&_str.m_orOffset, 4);
-        if ( stream.bad() )
-        {
-            stream.close();
-            m_error = "Stream bad during reading. The .mo-file seems to be invalid or has bad descriptions!";
-            return moFileReader::EC_FILEINVALID;
-        }
-
-        TransPairInfo.push_back(_str);
-    }
-
-    // Get all Lengths & Offsets of the translated strings
-    // Be aware: The Descriptors already exist in our list, so we just mod. refs from the deque.
-    for ( int i = 0; i < moInfo.m_numStrings; i++ )
+    uint32_t numStrings = Word(8);
+    m_offsetOriginal = Word(12);
+    m_offsetTranslation = Word(16);
+    m_sizeHashtable = Word(20);
+    m_offsetHashtable = Word(24);
+
+    // Check that all tables and strings lie inside the file, so lookups
+    // need no further checks.
+    uint64_t size = m_size;
+    if ( (uint64_t)m_offsetOriginal + 8*(uint64_t)numStrings > size ||
+         (uint64_t)m_offsetTranslation + 8*(uint64_t)numStrings > size ||
+         (m_sizeHashtable > 2 && (uint64_t)m_offsetHashtable + 4*(uint64_t)m_sizeHashtable > size) )
     {
-        moTranslationPairInformation& _str = TransPairInfo[i];
-        stream.read((char*)&_str.m_trLength, 4);
-        stream.read((char*)&_str.m_trOffset, 4);
-        if ( stream.bad() )
-        {
-            stream.close();
-            m_error = "Stream bad during reading. The .mo-file seems to be invalid or has bad descriptions!";
-            return moFileReader::EC_FILEINVALID;
-        }
+        ClearTable();
+        m_error = "Tables exceed file size. The .mo-file seems to be invalid or has bad descriptions!";
+        return moFileReader::EC_FILEINVALID;
     }
-
-    // Normally you would read the hash-table here, but we don't use it. :)
-
-    // Now to the interesting part, we read the strings-pairs now
-    for ( int i = 0; i < moInfo.m_numStrings; i++)
+    m_numStrings = numStrings;
+    for ( uint32_t i = 0; i < numStrings; i++ )
     {
-        // We need a length of +1 to catch the trailing \0.
-        int orLength = TransPairInfo[i].m_orLength+1;
-        int trLength = TransPairInfo[i].m_trLength+1;
-
-        int orOffset = TransPairInfo[i].m_orOffset;
-        int trOffset = TransPairInfo[i].m_trOffset;
-
-        // Original
-        char* original  = new char[orLength];
-        memset(original, 0, sizeof(char)*orLength);
-
-        stream.seekg(orOffset);
-        stream.read(original, orLength);
-
-        if ( stream.bad() )
+        // +1 for the trailing \0
+        if ( (uint64_t)Word(m_offsetOriginal + 8*i + 4) + OriginalLength(i) + 1 > size ||
+             (uint64_t)Word(m_offsetTranslation + 8*i + 4) + TranslationLength(i) + 1 > size )
         {
+            ClearTable();
             m_error = "Stream bad during reading. The .mo-file seems to be invalid or has bad descriptions!";
             return moFileReader::EC_FILEINVALID;
         }
-        
-        // Translation
-        char* translation = new char[trLength];
-        memset(translation, 0, sizeof(char)*trLength);
-
-        stream.seekg(trOffset);
-        stream.read(translation, trLength);
-
-        if ( stream.bad() )
-        {
-            m_error = "Stream bad during reading. The .mo-file seems to be invalid or has bad descriptions!";
-            return moFileReader::EC_FILEINVALID;
-        }
-
-        // Store it in the map.    
-        m_lookup[std::string(original)] = std::string(translation);
-
-        // Cleanup...
-        delete original;
-        delete translation;
     }
 
     // Done :)
-    stream.close();
     return moFileReader::EC_SUCCESS;
 }
 
@@ -214,7 +255,7 @@ moFileReader::eErrorCode moFileReader::ExportAsHTML(std::string infile, std::str
     {
         return r;
     }
-    if ( reader.m_lookup.empty() )
+    if ( reader.m_numStrings == 0 )
     {
         return moFileReader::EC_TABLEEMPTY;
     }    
@@ -274,12 +315,11 @@ moFileReader::eErrorCode moFileReader::ExportAsHTML(std::string infile, std::str
 
         // Now output the content
         stream << "<table border=\"1\"><th colspan=\"2\">Content</th>" << std::endl;        
-        for ( moLookupList::const_iterator it = reader.m_lookup.begin(); 
-             it != reader.m_lookup.end(); it++)
+        for ( uint32_t i = 0; i < reader.m_numStrings; i++ )
         {
-            if ( it->first != "" ) // Skip the empty msgid, its the table we handled above.
+            if ( reader.OriginalLength(i) != 0 ) // Skip the empty msgid, its the table we handled above.
             {
-                stream << "<tr><td>" << it->first << "</td><td>" <<  it->second << "</td></tr>" << std::endl;
+                stream << "<tr><td>" << reader.Original(i) << "</td><td>" <<  reader.Translation(i) << "</td></tr>" << std::endl;
             }
         }
         stream << "</table><br/>" << std::endl;
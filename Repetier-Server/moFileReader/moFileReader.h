@@ -181,6 +181,8 @@
 #include <boost/cstdint.hpp>
 using namespace boost;
 
+namespace boost { namespace interprocess { class mapped_region; } }
+
 
 /** \namespace moFileLib
   * \brief This is the only namespace of this small sourcecode.
@@ -295,14 +297,13 @@ struct moFileInfo
   *
   * The usage is quite simple:\n
   * Tell the class which .mo-file it shall load via 
-  * moFileReader::ReadFile(). The method will attempt to load
-  * the file, all translations will be stored in memory.
+  * moFileReader::ReadFile(). The method maps the file into memory,
+  * translations are not copied.
   * Afterwards you can lookup the strings with moFileReader::Lookup() just
-  * like you would do with gettext.
-  * Additionally, you can call moFileReader::ReadFile() for as much files as you 
-  * like. But please be aware, that if there are duplicated keys (original strings),
-  * that they will replace each other in the lookup-table. There is no check done, if a 
-  * key already exists.
+  * like you would do with gettext. Lookups use the hash table stored in the
+  * .mo-file or, if the file has none, a binary search over the sorted originals.
+  * Calling moFileReader::ReadFile() again replaces the previously loaded file.
+  * After loading, all const methods can be called from several threads at once.
   *
   * \note If you add "Lookup" to the keywords of the gettext-parser (like poEdit),
   * it will recognize the Strings loaded with an instance of this class.
@@ -311,11 +312,12 @@ struct moFileInfo
   */
 class MOEXPORT moFileReader
 {
-protected:
-    /// \brief Type for the map which holds the translation-pairs later.
-    typedef std::map<std::string, std::string> moLookupList;
-
 public:
+    /// \brief Constructor
+    moFileReader();
+
+    /// \brief Destructor, unmaps the file.
+    virtual ~moFileReader();
 
     /// \brief The Magic Number describes the endianess of bytes on the system.   
     static const uint32_t MagicNumber   = 0x950412DE;
@@ -355,9 +357,9 @@ public:
       * \param[in] _filename The path to the file to load.
       * \return SUCCESS on success or one of the other error-codes in eErrorCode on error.
       *
-      * This is the core-feature. This method loads the .mo-file and stores
-      * all translation-pairs in a map. You can access this map via the method
-      * moFileReader::Lookup().
+      * This is the core-feature. This method maps the .mo-file into memory
+      * and checks that all string descriptors point into the file. You can
+      * access the translations via the method moFileReader::Lookup().
       */
     virtual eErrorCode ReadFile(const char* filename);
 
@@ -367,10 +369,19 @@ public:
       */
     virtual std::string Lookup( const char* id ) const;
 
+    /** \brief Searches a translation without copying.
+      * \param[in] id The id to search for, needs no trailing \\0.
+      * \param[in] idLength Length of id in bytes.
+      * \param[out] translation Start of the translation inside the mapped file.
+      * \param[out] trLength Length of the translation in bytes.
+      * \return true if a translation was found.
+      */
+    bool Find( const char* id, size_t idLength, const char*& translation, size_t& trLength ) const;
+
     /// \brief Returns the Error Description.
     virtual const std::string& GetErrorDescription() const;
 
-    /// \brief Empties the Lookup-Table.
+    /// \brief Empties the Lookup-Table and unmaps the file.
     virtual void ClearTable();
     
     /** \brief Returns the Number of Entries in our Lookup-Table.
@@ -399,8 +410,37 @@ protected:
     unsigned long SwapBytes(unsigned long in);    
 
 private:
-    // Holds the lookup-table
-    moLookupList m_lookup;
+    // Mapped .mo-file, NULL if nothing is loaded
+    boost::interprocess::mapped_region* m_region;
+    const char* m_data;
+    size_t m_size;
+    uint32_t m_numStrings;
+    uint32_t m_offsetOriginal;
+    uint32_t m_offsetTranslation;
+    uint32_t m_sizeHashtable;
+    uint32_t m_offsetHashtable;
+
+    // Not copyable, the mapping is owned by one instance.
+    moFileReader(const moFileReader&);
+    moFileReader& operator=(const moFileReader&);
+
+    /// \brief Reads a 4 byte word at the given file offset.
+    inline uint32_t Word(uint32_t offset) const
+    {
+        uint32_t w;
+        memcpy(&w, m_data + offset, 4);
+        return w;
+    }
+    /// \brief Length of original string i.
+    inline uint32_t OriginalLength(uint32_t i) const { return Word(m_offsetOriginal + 8*i); }
+    /// \brief Original string i.
+    inline const char* Original(uint32_t i) const { return m_data + Word(m_offsetOriginal + 8*i + 4); }
+    /// \brief Length of translated string i.
+    inline uint32_t TranslationLength(uint32_t i) const { return Word(m_offsetTranslation + 8*i); }
+    /// \brief Translated string i.
+    inline const char* Translation(uint32_t i) const { return m_data + Word(m_offsetTranslation + 8*i + 4); }
+    /// \brief Returns true if original string i is the given id.
+    bool Matches(uint32_t i, const char* id, size_t idLength) const;
 
     void MakeHtmlConform(std::string& _inout);
     bool GetPoEditorString(const char* _buffer, std::string& _name, std::string& _value);
@@ -184,6 +184,10 @@ typedef struct DIR {
 #include <pwd.h>
 #include <unistd.h>
 #include <dirent.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#endif
 #if !defined(NO_SSL_DL) && !defined(NO_SSL)
 #include <dlfcn.h>
 #endif
@@ -433,7 +437,8 @@ enum {
   ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
-  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES,
+  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, SOCKET_QUEUE_SIZE,
+  LISTEN_BACKLOG, KEEP_ALIVE_TIMEOUT,
   NUM_OPTIONS
 };
 
@@ -461,6 +466,9 @@ static const char *config_options[] = {
   "u", "run_as_user", NULL,
   "w", "url_rewrite_patterns", NULL,
   "x", "hide_files_patterns", NULL,
+  "q", "socket_queue_size", "20",
+  "b", "listen_backlog", NULL,
+  "K", "keep_alive_timeout_ms", "5000",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
@@ -479,11 +487,14 @@ struct mg_context {
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
+  struct socket *queue;      // Accepted sockets
+  int64_t *queue_time;       // Time each queued socket was accepted, usec
+  int sq_size;               // Number of slots in the socket queue
   volatile int sq_head;      // Head of the socket queue
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Signaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+  struct mg_stats stats;     // Queue counters, protected by mutex
 };
 
 struct mg_connection {
@@ -506,6 +517,8 @@ struct mg_connection {
   int throttle;               // Throttling, bytes/sec. <= 0 means no throttle
   time_t last_throttle_time;  // Last time throttled data was sent
   int64_t last_throttle_bytes;// Bytes sent this second
+  int request_count;          // Requests received on this connection
+  int idle_wait;              // 1 while waiting for the next keep-alive request
 };
 
 const char **mg_get_valid_option_names(void) {
@@ -529,6 +542,16 @@ int mg_get_reply_status_code(const struct mg_connection *conn) {
   return conn == NULL ? -1 : conn->status_code;
 }
 
+int mg_get_request_count(const struct mg_connection *conn) {
+  return conn == NULL ? 0 : conn->request_count;
+}
+
+void mg_set_must_close(struct mg_connection *conn) {
+  if (conn != NULL) {
+    conn->must_close = 1;
+  }
+}
+
 void *mg_get_ssl_context(const struct mg_connection *conn) {
   return conn == NULL || conn->ctx == NULL ? NULL : conn->ctx->ssl_ctx;
 }
@@ -617,6 +640,17 @@ static void cry(struct mg_connection *conn, const char *fmt, ...) {
   conn->log_message = NULL;
 }
 
+// Current time in microseconds, used for the queue wait statistics.
+static int64_t now_usec(void) {
+#if defined(_WIN32)
+  return (int64_t) GetTickCount() * 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 // Return fake connection structure. Used for logging, if connection
 // is not applicable at the moment of logging.
 static struct mg_connection *fc(struct mg_context *ctx) {
@@ -1430,17 +1464,27 @@ static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
 // with a timeout, and when returned, check the context for the stop flag.
 // If it is set, we return 0, and this means that we must not continue
 // reading, must give up and close the connection and exit serving thread.
+// An idle keep-alive connection is given up the same way once
+// keep_alive_timeout_ms passed without the next request arriving, so it
+// does not hold its worker thread forever.
 static int wait_until_socket_is_readable(struct mg_connection *conn) {
-  int result;
+  int result, idle_ms = 0, timeout_ms;
   struct timeval tv;
   fd_set set;
 
+  timeout_ms = atoi(conn->ctx->config[KEEP_ALIVE_TIMEOUT]);
   do {
     tv.tv_sec = 0;
     tv.tv_usec = 300 * 1000;
     FD_ZERO(&set);
     FD_SET(conn->client.sock, &set);
     result = select(conn->client.sock + 1, &set, NULL, NULL, &tv);
+    if (result == 0 && conn->idle_wait && conn->data_len == 0) {
+      idle_ms += 300;
+      if (timeout_ms > 0 && idle_ms >= timeout_ms) {
+        return 0;
+      }
+    }
   } while ((result == 0 || (result < 0 && ERRNO == EINTR)) &&
            conn->ctx->stop_flag == 0);
 
@@ -2654,6 +2698,35 @@ static void send_file_data(struct mg_connection *conn, FILE *fp, int64_t len) {
   char buf[MG_BUF_LEN];
   int to_read, num_read, num_written;
 
+#if defined(__linux__)
+  // Let the kernel copy regular files to plain sockets. Pipes (SSI exec)
+  // fail with EINVAL on the first call and use the read loop below.
+  if (conn->ssl == NULL && conn->throttle <= 0) {
+    off_t offset = ftello(fp);
+    ssize_t n;
+    int first = 1;
+    while (len > 0) {
+      n = sendfile(conn->client.sock, fileno(fp), &offset,
+                   len > INT_MAX ? INT_MAX : (size_t) len);
+      if (n < 0 && ERRNO == EINTR) {
+        continue;
+      }
+      if (n < 0 && first && (ERRNO == EINVAL || ERRNO == ENOSYS)) {
+        break;
+      }
+      if (n <= 0) {
+        return;
+      }
+      first = 0;
+      conn->num_bytes_sent += n;
+      len -= n;
+    }
+    if (!first || len <= 0) {
+      return;
+    }
+  }
+#endif
+
   while (len > 0) {
     // Calculate how much to read from the file in the buffer
     to_read = sizeof(buf);
@@ -2753,6 +2826,18 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   (void) fclose(fp);
 }
 
+long long mg_write_file(struct mg_connection *conn, const char *path) {
+  int64_t sent = conn->num_bytes_sent;
+  FILE *fp;
+
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    return -1;
+  }
+  send_file_data(conn, fp, INT64_MAX);
+  (void) fclose(fp);
+  return conn->num_bytes_sent - sent;
+}
+
 void mg_send_file(struct mg_connection *conn, const char *path) {
   struct mgstat st;
   if (mg_stat(path, &st) == 0) {
@@ -3966,11 +4051,18 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
 
 static int set_ports_option(struct mg_context *ctx) {
   const char *list = ctx->config[LISTENING_PORTS];
-  int on = 1, success = 1;
+  int on = 1, success = 1, backlog;
   SOCKET sock;
   struct vec vec;
   struct socket so, *listener;
 
+  // A backlog of 0 or less uses the system default
+  backlog = ctx->config[LISTEN_BACKLOG] == NULL ? 0 :
+    atoi(ctx->config[LISTEN_BACKLOG]);
+  if (backlog <= 0) {
+    backlog = SOMAXCONN;
+  }
+
   while (success && (list = next_option(list, &vec, NULL)) != NULL) {
     if (!parse_port_string(&vec, &so)) {
       cry(fc(ctx), "%s: %.*s: invalid port spec. Expecting list of: %s",
@@ -3996,7 +4088,7 @@ static int set_ports_option(struct mg_context *ctx) {
                setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
                           sizeof(on)) != 0 ||
                bind(sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
-               listen(sock, SOMAXCONN) != 0) {
+               listen(sock, backlog) != 0) {
       closesocket(sock);
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
           (int) vec.len, vec.ptr, strerror(ERRNO));
@@ -4427,8 +4519,10 @@ static void process_new_connection(struct mg_connection *conn) {
 
   do {
     reset_per_request_attributes(conn);
+    conn->idle_wait = conn->request_count > 0;
     conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
                                      &conn->data_len);
+    conn->idle_wait = 0;
     assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
     if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
       send_http_error(conn, 413, "Request Too Large", "%s", "");
@@ -4458,6 +4552,7 @@ static void process_new_connection(struct mg_connection *conn) {
         conn->content_len = 0;
       }
       conn->birth_time = time(NULL);
+      conn->request_count++;
       handle_request(conn);
       call_user(conn, MG_REQUEST_COMPLETE);
       log_access(conn);
@@ -4483,6 +4578,8 @@ static void process_new_connection(struct mg_connection *conn) {
 
 // Worker threads take accepted socket from the queue
 static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  int64_t wait;
+
   (void) pthread_mutex_lock(&ctx->mutex);
   DEBUG_TRACE(("going idle"));
 
@@ -4494,14 +4591,20 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   // If we're stopping, sq_head may be equal to sq_tail.
   if (ctx->sq_head > ctx->sq_tail) {
     // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
+    *sp = ctx->queue[ctx->sq_tail % ctx->sq_size];
+    wait = now_usec() - ctx->queue_time[ctx->sq_tail % ctx->sq_size];
+    ctx->stats.queue_wait_usec += wait;
+    if (wait > ctx->stats.queue_wait_max_usec) {
+      ctx->stats.queue_wait_max_usec = wait;
+    }
+    ctx->stats.busy_threads++;
     ctx->sq_tail++;
     DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
 
     // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+    while (ctx->sq_tail > ctx->sq_size) {
+      ctx->sq_tail -= ctx->sq_size;
+      ctx->sq_head -= ctx->sq_size;
     }
   }
 
@@ -4526,6 +4629,7 @@ static void worker_thread(struct mg_context *ctx) {
     while (consume_socket(ctx, &conn->client)) {
       conn->birth_time = time(NULL);
       conn->ctx = ctx;
+      conn->request_count = 0;
 
       // Fill in IP, port info early so even if SSL setup below fails,
       // error handler would have the corresponding info.
@@ -4544,6 +4648,10 @@ static void worker_thread(struct mg_context *ctx) {
       }
 
       close_connection(conn);
+
+      (void) pthread_mutex_lock(&ctx->mutex);
+      ctx->stats.busy_threads--;
+      (void) pthread_mutex_unlock(&ctx->mutex);
     }
     free(conn);
   }
@@ -4560,19 +4668,33 @@ static void worker_thread(struct mg_context *ctx) {
 
 // Master thread adds accepted socket to a queue
 static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
+  int depth;
+
   (void) pthread_mutex_lock(&ctx->mutex);
 
-  // If the queue is full, wait
+  // If the queue is full, wait. The master stops accepting meanwhile.
+  if (ctx->sq_head - ctx->sq_tail >= ctx->sq_size) {
+    ctx->stats.blocked_accepts++;
+  }
   while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
+         ctx->sq_head - ctx->sq_tail >= ctx->sq_size) {
     (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
   }
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
+  if (ctx->sq_head - ctx->sq_tail < ctx->sq_size) {
     // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
+    ctx->queue[ctx->sq_head % ctx->sq_size] = *sp;
+    ctx->queue_time[ctx->sq_head % ctx->sq_size] = now_usec();
     ctx->sq_head++;
+    ctx->stats.accepted++;
+    depth = ctx->sq_head - ctx->sq_tail;
+    if (depth > ctx->stats.queue_peak) {
+      ctx->stats.queue_peak = depth;
+    }
     DEBUG_TRACE(("queued socket %d", sp->sock));
+  } else {
+    // Stopping, nobody will serve it
+    (void) closesocket(sp->sock);
   }
 
   (void) pthread_cond_signal(&ctx->sq_full);
@@ -4600,11 +4722,31 @@ static void accept_new_connection(const struct socket *listener,
       sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
       cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
       (void) closesocket(accepted.sock);
+      (void) pthread_mutex_lock(&ctx->mutex);
+      ctx->stats.rejected_accepts++;
+      (void) pthread_mutex_unlock(&ctx->mutex);
     }
+  } else {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->stats.failed_accepts++;
+    (void) pthread_mutex_unlock(&ctx->mutex);
   }
 }
 
+void mg_get_stats(struct mg_context *ctx, struct mg_stats *stats) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  *stats = ctx->stats;
+  stats->queue_depth = ctx->sq_head - ctx->sq_tail;
+  stats->queue_size = ctx->sq_size;
+  stats->num_threads = ctx->num_threads;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
 static void master_thread(struct mg_context *ctx) {
+#if defined(__linux__)
+  struct epoll_event ev, events[16];
+  int epfd, i, n;
+#endif
   fd_set read_set;
   struct timeval tv;
   struct socket *sp;
@@ -4621,6 +4763,38 @@ static void master_thread(struct mg_context *ctx) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
+#if defined(__linux__)
+  // Listening sockets are registered once, each wakeup only reports the
+  // ready ones. The timeout lets us notice the stop flag. If epoll is not
+  // usable, the select loop below takes over.
+  if ((epfd = epoll_create(16)) < 0) {
+    cry(fc(ctx), "%s: epoll_create: %s, using select", __func__,
+        strerror(ERRNO));
+  } else {
+    for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = sp;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, sp->sock, &ev) != 0) {
+        cry(fc(ctx), "%s: epoll_ctl: %s, using select", __func__,
+            strerror(ERRNO));
+        (void) close(epfd);
+        epfd = -1;
+        break;
+      }
+    }
+  }
+  while (epfd >= 0 && ctx->stop_flag == 0) {
+    n = epoll_wait(epfd, events, ARRAY_SIZE(events), 200);
+    for (i = 0; i < n && ctx->stop_flag == 0; i++) {
+      accept_new_connection((struct socket *) events[i].data.ptr, ctx);
+    }
+  }
+  if (epfd >= 0) {
+    (void) close(epfd);
+  }
+#endif // __linux__
+
   while (ctx->stop_flag == 0) {
     FD_ZERO(&read_set);
     max_fd = -1;
@@ -4669,6 +4843,11 @@ static void master_thread(struct mg_context *ctx) {
   (void) pthread_cond_destroy(&ctx->sq_empty);
   (void) pthread_cond_destroy(&ctx->sq_full);
 
+  // Close sockets nobody picked up
+  while (ctx->sq_head > ctx->sq_tail) {
+    (void) closesocket(ctx->queue[ctx->sq_tail++ % ctx->sq_size].sock);
+  }
+
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
 #endif
@@ -4683,6 +4862,9 @@ static void master_thread(struct mg_context *ctx) {
 static void free_context(struct mg_context *ctx) {
   int i;
 
+  free(ctx->queue);
+  free(ctx->queue_time);
+
   // Deallocate config parameters
   for (i = 0; i < NUM_OPTIONS; i++) {
     if (ctx->config[i] != NULL)
@@ -4769,6 +4951,19 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
     }
   }
 
+  ctx->sq_size = atoi(ctx->config[SOCKET_QUEUE_SIZE]);
+  if (ctx->sq_size < 1) {
+    ctx->sq_size = 1;
+  }
+  ctx->queue = (struct socket *) calloc(ctx->sq_size, sizeof(*ctx->queue));
+  ctx->queue_time = (int64_t *) calloc(ctx->sq_size,
+                                       sizeof(*ctx->queue_time));
+  if (ctx->queue == NULL || ctx->queue_time == NULL) {
+    cry(fc(ctx), "Cannot allocate socket queue, OOM");
+    free_context(ctx);
+    return NULL;
+  }
+
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
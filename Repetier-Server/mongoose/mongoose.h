@@ -113,6 +113,26 @@ struct mg_context *mg_start(mg_callback_t callback, void *user_data,
                             const char **options);
 
 
+// Counters of the worker pool and its socket queue, see mg_get_stats().
+struct mg_stats {
+  long long accepted;             // Connections put into the queue
+  long long rejected_accepts;     // Connections refused by the access list
+  long long failed_accepts;       // Failed accept() calls
+  long long blocked_accepts;      // Times the master waited for a full queue
+  long long queue_wait_usec;      // Total time connections waited for a worker
+  long long queue_wait_max_usec;  // Longest wait for a worker
+  int queue_peak;                 // Highest queue depth seen
+  int queue_depth;                // Connections waiting right now
+  int queue_size;                 // Slots in the queue
+  int busy_threads;               // Workers serving a connection
+  int num_threads;                // Running workers
+};
+
+
+// Copy the current counters of a running server into stats.
+void mg_get_stats(struct mg_context *, struct mg_stats *stats);
+
+
 // Stop the web server.
 //
 // Must be called last, when an application wants to stop the web server and
@@ -162,6 +182,15 @@ const char *mg_get_log_message(const struct mg_connection *);
 int mg_get_reply_status_code(const struct mg_connection *);
 void *mg_get_ssl_context(const struct mg_connection *);
 
+// Return the number of requests received on this connection, including the
+// current one. A value above 1 means the client reused a keep-alive
+// connection.
+int mg_get_request_count(const struct mg_connection *);
+
+// Close the connection after the current request instead of keeping it
+// alive. Use when the request body was not read completely.
+void mg_set_must_close(struct mg_connection *);
+
 
 // Send data to the client.
 // Return:
@@ -203,6 +232,11 @@ int mg_printf(struct mg_connection *,
 void mg_send_file(struct mg_connection *conn, const char *path);
 
 
+// Send contents of the entire file without headers. Uses sendfile() where
+// available. Return number of bytes sent or -1 if the file can't be opened.
+long long mg_write_file(struct mg_connection *conn, const char *path);
+
+
 // Read data from the remote end, return number of bytes read.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
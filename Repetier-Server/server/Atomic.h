@@ -0,0 +1,38 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__Atomic__
+#define __Repetier_Server__Atomic__
+
+/* Atomic operations on 32 bit integers for flags and counters shared
+ without a lock. All of them are full memory barriers.
+ CAS32(p,o,n) sets *p to n if it is o and returns true in that case.
+ FETCH_ADD32(p,v) adds v and returns the old value, FETCH_ADD32(p,0)
+ reads the current value. */
+#if defined(_WIN32)
+#include <windows.h>
+#define CAS32(p,o,n) (InterlockedCompareExchange((volatile LONG*)(p),(LONG)(n),(LONG)(o))==(LONG)(o))
+#define FETCH_ADD32(p,v) InterlockedExchangeAdd((volatile LONG*)(p),(LONG)(v))
+#define BARRIER() MemoryBarrier()
+#else
+#define CAS32(p,o,n) __sync_bool_compare_and_swap(p,o,n)
+#define FETCH_ADD32(p,v) __sync_fetch_and_add(p,v)
+#define BARRIER() __sync_synchronize()
+#endif
+
+#endif /* defined(__Repetier_Server__Atomic__) */
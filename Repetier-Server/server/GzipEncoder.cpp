@@ -0,0 +1,46 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "GzipEncoder.h"
+#include <string.h>
+
+using namespace std;
+
+GzipEncoder::GzipEncoder(int level) {
+    memset(&strm,0,sizeof(strm));
+    // windowBits 15+16 selects the gzip wrapper instead of zlib
+    ready = deflateInit2(&strm,level,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)==Z_OK;
+}
+GzipEncoder::~GzipEncoder() {
+    if(ready) deflateEnd(&strm);
+}
+bool GzipEncoder::compress(const char *data,size_t len,string &out) {
+    out.clear();
+    if(!ready || deflateReset(&strm)!=Z_OK) return false;
+    out.resize(deflateBound(&strm,(uLong)len));
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = (uInt)len;
+    strm.next_out = (Bytef*)&out[0];
+    strm.avail_out = (uInt)out.size();
+    // deflateBound guarantees that a single call finishes the stream
+    if(deflate(&strm,Z_FINISH)!=Z_STREAM_END) {
+        out.clear();
+        return false;
+    }
+    out.resize(strm.total_out);
+    return true;
+}
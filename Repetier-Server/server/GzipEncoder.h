@@ -0,0 +1,40 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__GzipEncoder__
+#define __Repetier_Server__GzipEncoder__
+
+#include <iostream>
+#include <zlib.h>
+
+/** Compresses buffers into gzip format. The zlib stream is kept between
+ calls, so an encoder that is reused does not allocate after the first
+ call. Not thread safe, use one encoder per thread. */
+class GzipEncoder {
+    z_stream strm;
+    bool ready;
+public:
+    /** @param level zlib compression level, Z_BEST_SPEED to Z_BEST_COMPRESSION. */
+    GzipEncoder(int level);
+    ~GzipEncoder();
+    /** Compresses data and replaces the content of out with the result.
+     @returns false if zlib failed. */
+    bool compress(const char *data,size_t len,std::string &out);
+};
+
+#endif /* defined(__Repetier_Server__GzipEncoder__) */
@@ -0,0 +1,149 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
+#define _CRT_SECURE_NO_DEPRECATE
+#define _SCL_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <string.h>
+#include "JSONWriter.h"
+#include <boost/thread/tss.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+#define snprintf _snprintf
+#endif
+
+using namespace std;
+
+static boost::thread_specific_ptr<string> threadJSONBuffer;
+
+string &JSONWriter::threadBuffer() {
+    string *b = threadJSONBuffer.get();
+    if(b==NULL) {
+        b = new string();
+        b->reserve(4096);
+        threadJSONBuffer.reset(b);
+    }
+    b->clear();
+    return *b;
+}
+
+JSONWriter::JSONWriter(string &buffer):buf(buffer) {
+    buf.clear();
+    needComma = false;
+}
+void JSONWriter::startObject() {
+    separate();
+    buf+='{';
+}
+void JSONWriter::endObject() {
+    buf+='}';
+    needComma = true;
+}
+void JSONWriter::startArray() {
+    separate();
+    buf+='[';
+}
+void JSONWriter::endArray() {
+    buf+=']';
+    needComma = true;
+}
+void JSONWriter::key(const char *name) {
+    separate();
+    buf+='"';
+    appendEscaped(name,strlen(name));
+    buf.append("\":",2);
+}
+void JSONWriter::appendEscaped(const char *s,size_t len) {
+    size_t start = 0;
+    for(size_t i=0;i<len;i++) {
+        unsigned char c = (unsigned char)s[i];
+        if(c>=32 && c!='"' && c!='\\') continue;
+        buf.append(&s[start],i-start); // copy unescaped run at once
+        start = i+1;
+        switch(c) {
+            case '"': buf.append("\\\"",2);break;
+            case '\\': buf.append("\\\\",2);break;
+            case '\b': buf.append("\\b",2);break;
+            case '\f': buf.append("\\f",2);break;
+            case '\n': buf.append("\\n",2);break;
+            case '\r': buf.append("\\r",2);break;
+            case '\t': buf.append("\\t",2);break;
+            default: {
+                char b[8];
+                sprintf(b,"\\u%04x",(int)c);
+                buf.append(b,6);
+            }
+        }
+    }
+    buf.append(&s[start],len-start);
+}
+void JSONWriter::value(const string &v) {
+    separate();
+    buf+='"';
+    appendEscaped(v.c_str(),v.length());
+    buf+='"';
+    needComma = true;
+}
+void JSONWriter::value(const char *v) {
+    separate();
+    buf+='"';
+    appendEscaped(v,strlen(v));
+    buf+='"';
+    needComma = true;
+}
+void JSONWriter::value(int v) {
+    separate();
+    char b[16];
+    int l = sprintf(b,"%d",v);
+    buf.append(b,l);
+    needComma = true;
+}
+void JSONWriter::value(uint32_t v) {
+    separate();
+    char b[16];
+    int l = sprintf(b,"%u",(unsigned int)v);
+    buf.append(b,l);
+    needComma = true;
+}
+void JSONWriter::value(uint64_t v) {
+    separate();
+    char b[24];
+    int l = sprintf(b,"%llu",(unsigned long long)v);
+    buf.append(b,l);
+    needComma = true;
+}
+void JSONWriter::value(double v) {
+    separate();
+    if(!boost::math::isfinite(v)) { // JSON has no nan or inf, e.g. unconnected heaters
+        buf.append("null",4);
+        needComma = true;
+        return;
+    }
+    char b[40];
+    int l = snprintf(b,sizeof(b),"%.10g",v);
+    buf.append(b,l);
+    needComma = true;
+}
+void JSONWriter::value(bool v) {
+    separate();
+    if(v) buf.append("true",4);
+    else buf.append("false",5);
+    needComma = true;
+}
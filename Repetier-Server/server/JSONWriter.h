@@ -0,0 +1,76 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__JSONWriter__
+#define __Repetier_Server__JSONWriter__
+
+#include <iostream>
+#include <string>
+#include <boost/cstdint.hpp>
+
+/** Writes JSON directly into a string buffer without building a
+ json_spirit object tree first. The buffer is cleared but keeps its
+ capacity, so a buffer reused for each request stops allocating after
+ the first few requests.
+
+ Keys and values are written in the order the methods are called. The
+ writer only inserts the commas, it does not validate the structure.
+ */
+class JSONWriter {
+    std::string &buf;
+    bool needComma; ///< Next element needs a separating comma
+    inline void separate() {
+        if(needComma) buf+=',';
+        needComma = false;
+    }
+    void appendEscaped(const char *s,size_t len);
+public:
+    JSONWriter(std::string &buffer);
+
+    void startObject();
+    void endObject();
+    void startArray();
+    void endArray();
+    /** Writes the key of the next object member. */
+    void key(const char *name);
+
+    void value(const std::string &v);
+    void value(const char *v);
+    void value(int v);
+    void value(uint32_t v);
+    void value(uint64_t v);
+    /** Writes null for nan and infinite values, JSON has no literal for them. */
+    void value(double v);
+    void value(bool v);
+
+    /** Writes key and value in one call. */
+    template<typename T> inline void pair(const char *name,const T &v) {
+        key(name);
+        value(v);
+    }
+    inline void pair(const char *name,const char *v) {
+        key(name);
+        value(v);
+    }
+    inline const std::string &str() {return buf;}
+    /** Returns a cleared buffer owned by the calling thread. Web worker threads
+     live as long as the server, so each connection reuses its buffer. */
+    static std::string &threadBuffer();
+};
+
+#endif /* defined(__Repetier_Server__JSONWriter__) */
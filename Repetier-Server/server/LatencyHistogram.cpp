@@ -0,0 +1,96 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "LatencyHistogram.h"
+#include "PrometheusWriter.h"
+#include "JSONWriter.h"
+#include <boost/chrono.hpp>
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+uint64_t LatencyHistogram::now() {
+    return boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+void LatencyHistogram::reset() {
+    memset(counts,0,sizeof(counts));
+    total = sumMicros = maxMicros = 0;
+}
+int LatencyHistogram::bucketOf(uint64_t micros) {
+    if(micros<SUB_COUNT) return (int)micros;
+    int e = 63;
+    while(!(micros>>e)) e--; // position of highest bit, >= SUB_BITS
+    if(e>MAX_EXPONENT) return BUCKETS-1;
+    int sub = (int)(micros>>(e-SUB_BITS)) & (SUB_COUNT-1);
+    return (e-SUB_BITS+1)*SUB_COUNT+sub;
+}
+uint64_t LatencyHistogram::bucketEnd(int idx) {
+    if(idx<SUB_COUNT) return idx+1;
+    int e = idx/SUB_COUNT+SUB_BITS-1;
+    int sub = idx%SUB_COUNT;
+    return (uint64_t)(SUB_COUNT+sub+1)<<(e-SUB_BITS);
+}
+void LatencyHistogram::record(uint64_t micros) {
+    counts[bucketOf(micros)]++;
+    total++;
+    sumMicros += micros;
+    if(micros>maxMicros) maxMicros = micros;
+}
+uint64_t LatencyHistogram::percentile(double q) const {
+    if(total==0) return 0;
+    uint64_t rank = (uint64_t)(q*(double)total);
+    if(rank>=total) rank = total-1;
+    uint64_t seen = 0;
+    for(int i=0;i<BUCKETS;i++) {
+        seen += counts[i];
+        if(seen>rank) {
+            uint64_t end = bucketEnd(i)-1;
+            return end<maxMicros ? end : maxMicros;
+        }
+    }
+    return maxMicros;
+}
+void LatencyHistogram::writePrometheus(PrometheusWriter &w,const char *name,const string &labels) const {
+    string bucketName = string(name)+"_bucket";
+    string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    int idx = 0;
+    char le[32];
+    for(int e=6;e<=26;e++) {
+        uint64_t bound = (uint64_t)1<<e;
+        while(idx<BUCKETS && bucketEnd(idx)<=bound)
+            cumulative += counts[idx++];
+        sprintf(le,"le=\"%g\"",(double)bound/1000000.0);
+        w.sample(bucketName.c_str(),labels+sep+le,(double)cumulative);
+    }
+    w.sample(bucketName.c_str(),labels+sep+"le=\"+Inf\"",(double)total);
+    w.sample((string(name)+"_sum").c_str(),labels,(double)sumMicros/1000000.0);
+    w.sample((string(name)+"_count").c_str(),labels,(double)total);
+}
+void LatencyHistogram::writeJSON(JSONWriter &w) const {
+    w.pair("count",(double)total);
+    w.pair("meanMicros",total ? (double)sumMicros/(double)total : 0.0);
+    w.pair("maxMicros",(double)maxMicros);
+    w.pair("p50Micros",(double)percentile(0.5));
+    w.pair("p90Micros",(double)percentile(0.9));
+    w.pair("p99Micros",(double)percentile(0.99));
+    w.pair("p999Micros",(double)percentile(0.999));
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__LatencyHistogram__
+#define __Repetier_Server__LatencyHistogram__
+
+#include <iostream>
+#include <string>
+#include <boost/cstdint.hpp>
+
+class PrometheusWriter;
+class JSONWriter;
+
+/** Histogram of durations in microseconds with log-linear buckets.
+
+ Each power of two is split into 8 buckets, so every recorded value is
+ known within 12.5% from 8 us up to about 19 hours with a fixed 1 kB
+ of counters. Recording is a few shifts and an increment, so it can be
+ used on the serial path. Not thread safe, the owner has to lock.
+ */
+class LatencyHistogram {
+public:
+    enum {SUB_BITS = 3,SUB_COUNT = 8,MAX_EXPONENT = 35,
+        BUCKETS = (MAX_EXPONENT-SUB_BITS+2)*SUB_COUNT};
+private:
+    uint32_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t sumMicros;
+    uint64_t maxMicros;
+    static int bucketOf(uint64_t micros);
+    /** Smallest value that no longer belongs to bucket idx. */
+    static uint64_t bucketEnd(int idx);
+public:
+    LatencyHistogram();
+    /** Microseconds of a monotonic clock. Only differences are meaningful,
+     but unlike wall clock times they never jump. */
+    static uint64_t now();
+    void reset();
+    void record(uint64_t micros);
+    inline uint64_t count() const {return total;}
+    inline uint64_t sum() const {return sumMicros;}
+    inline uint64_t max() const {return maxMicros;}
+    /** Returns the upper bound of the bucket containing quantile q (0..1). */
+    uint64_t percentile(double q) const;
+    /** Writes _bucket, _sum and _count samples in seconds. Bucket bounds
+     are the powers of two from 64 us to 64 s, so they are exact. The
+     header must have been written with type histogram. */
+    void writePrometheus(PrometheusWriter &w,const char *name,const std::string &labels) const;
+    /** Writes count, mean, max and some percentiles in microseconds as
+     members of the current JSON object. */
+    void writeJSON(JSONWriter &w) const;
+};
+
+#endif /* defined(__Repetier_Server__LatencyHistogram__) */
@@ -0,0 +1,206 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
+#define _CRT_SECURE_NO_DEPRECATE
+#define _SCL_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <map>
+#include "PageTemplate.h"
+#include "mongoose.h"
+#include "WebserverAPI.h"
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+static boost::mutex cacheMutex;
+static map<string,PageTemplatePtr> cache;
+
+PageTemplate::PageTemplate(const string &translated,time_t mtime):text(translated) {
+    modified = mtime;
+    compile(0,text.length(),nodes);
+}
+void PageTemplate::compile(size_t start,size_t end,vector<Node> &out) {
+    size_t pos(start),pos2,posclose;
+    while(pos<end) {
+        pos2 = text.find("{{",pos);
+        if(pos2==string::npos || pos2+3>=end) // Finished, no more vars etc
+            posclose = string::npos;
+        else
+            posclose = text.find("}}",pos2+2);
+        if(posclose==string::npos || posclose>=end) { // Rest is static text
+            pos2 = end;
+            posclose = end;
+        }
+        if(pos2>pos) { // Static text before marker
+            Node n;
+            n.type = Node::TEXT;
+            n.start = pos;
+            n.length = pos2-pos;
+            out.push_back(n);
+        }
+        if(posclose>=end) return;
+        pos2+=2;
+        char tp = text[pos2];
+        if(tp == '#') { // block
+            string name = text.substr(pos2+1,posclose-pos2-1);
+            size_t spacePos = name.find(' ');
+            string cmd = "";
+            if(spacePos!=string::npos) {
+                cmd = name.substr(0,spacePos);
+                name = name.substr(spacePos+1);
+            }
+            string ename = "{{/"+name+"}}";
+            size_t epos = text.find(ename,posclose);
+            if(epos==string::npos || epos>end) epos = end;
+            Node n;
+            n.name = name;
+            if(cmd.length()==0)
+                n.type = Node::LOOP;
+            else if(cmd=="if")
+                n.type = Node::IF;
+            else if(cmd=="ifnot")
+                n.type = Node::IFNOT;
+            else n.type = Node::TEXT; // unknown command, block is dropped
+            if(n.type!=Node::TEXT) {
+                compile(posclose+2,epos,n.children);
+                out.push_back(n);
+            }
+            pos = min(epos+ename.length(),end);
+        } else if(tp=='!') { // Comment, simply ignore it
+            pos = posclose+2;
+        } else { // Variable
+            Node n;
+            n.type = Node::VARIABLE;
+            n.name = text.substr(pos2,posclose-pos2);
+            out.push_back(n);
+            pos = posclose+2;
+        }
+    }
+}
+static const Value* findMember(const Object &obj,const string& name) {
+    for(Object::const_iterator oit = obj.begin(),oend = obj.end();oit!=oend;++oit) {
+        if(oit->name_ == name)
+            return &oit->value_;
+    }
+    return NULL;
+}
+const Value* PageTemplate::findVariable(const Object &root,vector<const Value*> &vars,const string& name) {
+    // Innermost scope is at the end and shadows outer scopes
+    for(size_t i=vars.size();i>0;i--) {
+        const Value &v = *vars[i-1];
+        if(v.type()!=obj_type) continue;
+        const Value *found = findMember(v.get_obj(),name);
+        if(found!=NULL) return found;
+    }
+    return findMember(root,name);
+}
+static void appendValue(const Value &v,string &result) {
+    char b[40];
+    switch(v.type()) {
+        case str_type:
+            result.append(v.get_str());
+            break;
+        case int_type:
+            sprintf(b,"%d",v.get_int());
+            result.append(b);
+            break;
+        case real_type:
+            sprintf(b,"%f",v.get_real());
+            result.append(b);
+            break;
+        case bool_type:
+            result.append(v.get_bool() ? "true" : "false");
+            break;
+        case array_type:
+            result.append("array");
+            break;
+        case obj_type:
+            result.append("object");
+            break;
+        case null_type:
+            result.append("null");
+            break;
+    }
+}
+void PageTemplate::renderNodes(const vector<Node> &list,string &result,const Object &root,vector<const Value*> &vars) const {
+    for(vector<Node>::const_iterator it = list.begin(),iend = list.end();it!=iend;++it) {
+        const Node &n = *it;
+        if(n.type==Node::TEXT) {
+            result.append(text,n.start,n.length);
+            continue;
+        }
+        const Value *v = findVariable(root,vars,n.name);
+        if(v==NULL) continue;
+        switch(n.type) {
+            case Node::VARIABLE:
+                appendValue(*v,result);
+                break;
+            case Node::LOOP:
+                if(v->type()==array_type) {
+                    const Array &a = v->get_array();
+                    for(Array::const_iterator ait = a.begin(),aend = a.end();ait!=aend;++ait) {
+                        vars.push_back(&*ait);
+                        renderNodes(n.children,result,root,vars);
+                        vars.pop_back();
+                    }
+                }
+                break;
+            case Node::IF:
+                if(v->type()==bool_type && v->get_bool())
+                    renderNodes(n.children,result,root,vars);
+                break;
+            case Node::IFNOT:
+                if(v->type()==bool_type && !v->get_bool())
+                    renderNodes(n.children,result,root,vars);
+                break;
+            default:
+                break;
+        }
+    }
+}
+void PageTemplate::render(string &result,const Object &data) const {
+    result.reserve(result.length()+text.length()+text.length()/4);
+    vector<const Value*> vars; // Loop elements, the data itself is never copied
+    renderNodes(nodes,result,data,vars);
+}
+PageTemplatePtr PageTemplate::get(const string &filename,const string &lang) {
+    time_t mtime;
+    try {
+        mtime = boost::filesystem::last_write_time(filename);
+    } catch(const boost::filesystem::filesystem_error &) {
+        return PageTemplatePtr();
+    }
+    string key = lang+":"+filename;
+    {
+        boost::mutex::scoped_lock l(cacheMutex);
+        map<string,PageTemplatePtr>::iterator it = cache.find(key);
+        if(it!=cache.end() && it->second->modified==mtime)
+            return it->second;
+    }
+    // Compile outside the lock. Two threads may compile the same page
+    // concurrently, the last one wins.
+    string translated;
+    repetier::TranslateFile(filename,lang,translated);
+    PageTemplatePtr page(new PageTemplate(translated,mtime));
+    boost::mutex::scoped_lock l(cacheMutex);
+    cache[key] = page;
+    return page;
+}
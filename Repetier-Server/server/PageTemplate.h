@@ -0,0 +1,73 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__PageTemplate__
+#define __Repetier_Server__PageTemplate__
+
+#include <iostream>
+#include <vector>
+#include <ctime>
+#include <boost/shared_ptr.hpp>
+#include "json_spirit_value.h"
+
+/** A translated page compiled into a tree of template nodes.
+
+ Pages use the markers
+ - {{name}} for variables,
+ - {{#name}}..{{/name}} to repeat the block for each element of array name,
+ - {{#if name}}..{{/name}} and {{#ifnot name}}..{{/name}} for booleans and
+ - {{! comment }} for comments.
+
+ Compiling resolves the translations and splits the page into static text
+ and variable slots once, so rendering is a single pass over the nodes.
+ Compiled pages are cached per file and language and recompiled when the
+ file modification time changes. Templates are immutable after compiling
+ and can be rendered from several threads at once.
+ */
+class PageTemplate {
+    struct Node {
+        enum NodeType {TEXT,VARIABLE,LOOP,IF,IFNOT};
+        NodeType type;
+        size_t start,length; ///< Static text range for TEXT nodes
+        std::string name; ///< Variable name for all other nodes
+        std::vector<Node> children; ///< Block content of LOOP, IF and IFNOT
+    };
+    std::string text; ///< Translated page, holds the static text
+    std::vector<Node> nodes;
+    std::time_t modified; ///< Modification time of the compiled file
+
+    void compile(size_t start,size_t end,std::vector<Node> &out);
+    void renderNodes(const std::vector<Node> &list,std::string &result,const json_spirit::Object &root,std::vector<const json_spirit::Value*> &vars) const;
+    /** Looks name up in the loop elements from the innermost outwards, then in root. */
+    static const json_spirit::Value* findVariable(const json_spirit::Object &root,std::vector<const json_spirit::Value*> &vars,const std::string& name);
+public:
+    PageTemplate(const std::string &translated,std::time_t mtime);
+    /** Fills the template with data and appends the output to result. */
+    void render(std::string &result,const json_spirit::Object &data) const;
+    /** Returns the compiled template for a page and language. The page is
+     translated and compiled on first use and whenever the file changed.
+     Thread safe.
+     @param filename Page to load.
+     @param lang Language code for translation.
+     @returns Compiled template or empty pointer if the file does not exist.
+     */
+    static boost::shared_ptr<PageTemplate> get(const std::string &filename,const std::string &lang);
+};
+typedef boost::shared_ptr<PageTemplate> PageTemplatePtr;
+
+#endif /* defined(__Repetier_Server__PageTemplate__) */
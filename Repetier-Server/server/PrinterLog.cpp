@@ -0,0 +1,323 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "PrinterLog.h"
+#include "printer.h"
+#include "TemperatureHistory.h"
+#include "LatencyHistogram.h"
+#include "JSONWriter.h"
+#include "RLog.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+
+#define SEGMENT_BYTES 4194304 // A segment is closed when the next record does not fit
+#define MAX_SEGMENTS 16
+#define INDEX_BYTES 16384 // Distance of the index points
+#define MAX_PENDING 100000 // Responses queued between two flushes
+#define MAX_TEXT 65535
+#define RECORD_HEADER 17
+#define SCAN_BYTES 16777216 // Log read by one query at most
+#define FLUSH_MICROS 1000000
+#define INDEX_MAGIC 0x31584449
+
+static void put(vector<char> &buf,const void *v,size_t n) {
+    buf.insert(buf.end(),(const char*)v,(const char*)v+n);
+}
+/** Decodes a record header. @returns false if it can not be one. */
+static bool parseHeader(const char *h,uint32_t &length,uint32_t &id,uint64_t &time,uint8_t &type) {
+    memcpy(&length,h,4);
+    memcpy(&id,h+4,4);
+    memcpy(&time,h+8,8);
+    type = (uint8_t)h[16];
+    return length>=RECORD_HEADER && length<=RECORD_HEADER+MAX_TEXT;
+}
+
+PrinterLog::PrinterLog(const string &dir) {
+    directory = dir;
+    dropped = 0;
+    nextId = 1;
+    nextFlush = 0;
+    try {
+        fs::path p(directory);
+        if(!fs::exists(p))
+            fs::create_directories(p);
+        vector<fs::path> files;
+        for(fs::directory_iterator it(p);it!=fs::directory_iterator();++it)
+            if(it->path().extension()==".log") files.push_back(it->path());
+        sort(files.begin(),files.end()); // Names are zero padded first ids
+        for(size_t i=0;i<files.size();i++) {
+            Segment s;
+            fs::path base = files[i];
+            s.filename = base.replace_extension().string();
+            s.firstId = s.lastId = 0;
+            s.firstTime = s.lastTime = 0;
+            s.size = 0;
+            if(i+1==files.size() || !loadIndex(s))
+                scanSegment(s);
+            if(s.index.empty()) { // Nothing readable
+                fs::remove(s.filename+".log");
+                fs::remove(s.filename+".idx");
+                continue;
+            }
+            segments.push_back(s);
+        }
+    } catch(std::exception &ex) {
+        RLog::log("error: Could not read printer log @",static_cast<string>(ex.what()));
+    }
+    if(!segments.empty()) {
+        nextId = segments.back().lastId+1;
+        out.open((segments.back().filename+".log").c_str(),ios::out | ios::app | ios::binary);
+    }
+}
+PrinterLog::~PrinterLog() {
+    flush();
+    mutex::scoped_lock l(mutex);
+    if(out.is_open()) {
+        out.close();
+        writeIndex(segments.back());
+    }
+}
+void PrinterLog::addRecord(Segment &s,uint32_t id,uint64_t time,uint32_t length) {
+    if(s.index.empty() || s.size-s.index.back().offset>=INDEX_BYTES) {
+        IndexPoint p;
+        p.id = id;
+        p.time = time;
+        p.offset = s.size;
+        s.index.push_back(p);
+    }
+    if(s.size==0) {
+        s.firstId = id;
+        s.firstTime = time;
+    }
+    s.lastId = id;
+    s.lastTime = time;
+    s.size += length;
+}
+void PrinterLog::scanSegment(Segment &s) {
+    string filename = s.filename+".log";
+    uint64_t fileSize = fs::file_size(filename);
+    ifstream in(filename.c_str(),ios::in | ios::binary);
+    char h[RECORD_HEADER];
+    uint32_t length,id;
+    uint64_t time;
+    uint8_t type;
+    s.index.clear();
+    s.size = 0;
+    while(s.size+RECORD_HEADER<=fileSize && in.read(h,RECORD_HEADER)) {
+        if(!parseHeader(h,length,id,time,type) || s.size+length>fileSize) break;
+        addRecord(s,id,time,length);
+        in.seekg(length-RECORD_HEADER,ios::cur);
+    }
+    if(s.size<fileSize) { // Crashed while writing
+        in.close();
+        fs::resize_file(filename,s.size);
+    }
+}
+bool PrinterLog::loadIndex(Segment &s) {
+    ifstream in((s.filename+".idx").c_str(),ios::in | ios::binary);
+    uint32_t magic = 0,count = 0;
+    in.read((char*)&magic,4);
+    in.read((char*)&s.size,4);
+    in.read((char*)&s.lastId,4);
+    in.read((char*)&s.lastTime,8);
+    in.read((char*)&count,4);
+    if(!in.good() || magic!=INDEX_MAGIC || count==0 || s.size!=fs::file_size(s.filename+".log"))
+        return false;
+    s.index.resize(count);
+    for(uint32_t i=0;i<count;i++) {
+        in.read((char*)&s.index[i].id,4);
+        in.read((char*)&s.index[i].time,8);
+        in.read((char*)&s.index[i].offset,4);
+    }
+    if(!in.good()) {
+        s.index.clear();
+        return false;
+    }
+    s.firstId = s.index[0].id;
+    s.firstTime = s.index[0].time;
+    return true;
+}
+void PrinterLog::writeIndex(Segment &s) {
+    vector<char> b;
+    uint32_t magic = INDEX_MAGIC,count = (uint32_t)s.index.size();
+    put(b,&magic,4);
+    put(b,&s.size,4);
+    put(b,&s.lastId,4);
+    put(b,&s.lastTime,8);
+    put(b,&count,4);
+    for(uint32_t i=0;i<count;i++) {
+        put(b,&s.index[i].id,4);
+        put(b,&s.index[i].time,8);
+        put(b,&s.index[i].offset,4);
+    }
+    ofstream idx((s.filename+".idx").c_str(),ios::out | ios::trunc | ios::binary);
+    idx.write(&b[0],b.size());
+}
+void PrinterLog::rotate() {
+    if(out.is_open()) {
+        out.close();
+        writeIndex(segments.back());
+    }
+    char name[16];
+    snprintf(name,sizeof(name),"%010u",(unsigned int)nextId);
+    Segment s;
+    s.filename = (fs::path(directory)/name).string();
+    s.firstId = s.lastId = nextId;
+    s.firstTime = s.lastTime = 0;
+    s.size = 0;
+    segments.push_back(s);
+    out.clear();
+    out.open((s.filename+".log").c_str(),ios::out | ios::trunc | ios::binary);
+    if(!out.is_open())
+        RLog::log("error: Could not create printer log @",s.filename+".log");
+    while(segments.size()>MAX_SEGMENTS) {
+        boost::system::error_code ec;
+        fs::remove(segments.front().filename+".log",ec);
+        fs::remove(segments.front().filename+".idx",ec);
+        segments.pop_front();
+    }
+}
+void PrinterLog::writeBuffer() {
+    if(buffer.empty()) return;
+    out.write(&buffer[0],buffer.size());
+    buffer.clear();
+}
+void PrinterLog::append(const boost::shared_ptr<PrinterResponse> &response) {
+    Pending p;
+    p.response = response;
+    p.time = TemperatureHistory::nowMillis();
+    mutex::scoped_lock l(pendingMutex);
+    if(pending.size()>=MAX_PENDING) {
+        dropped++;
+        return;
+    }
+    pending.push_back(p);
+}
+void PrinterLog::flush() {
+    mutex::scoped_lock l(mutex);
+    {
+        mutex::scoped_lock pl(pendingMutex);
+        writing.swap(pending);
+    }
+    if(writing.empty()) return;
+    for(size_t i=0;i<writing.size();i++) {
+        PrinterResponse &r = *writing[i].response;
+        uint32_t tlen = (uint32_t)min(r.message.length(),(size_t)MAX_TEXT);
+        uint32_t length = RECORD_HEADER+tlen;
+        if(segments.empty() || (segments.back().size>0 && segments.back().size+length>SEGMENT_BYTES)) {
+            writeBuffer();
+            rotate();
+        }
+        uint32_t id = nextId++;
+        addRecord(segments.back(),id,writing[i].time,length);
+        put(buffer,&length,4);
+        put(buffer,&id,4);
+        put(buffer,&writing[i].time,8);
+        buffer.push_back((char)r.logtype);
+        put(buffer,r.message.c_str(),tlen);
+    }
+    writeBuffer();
+    out.flush();
+    if(!out.good()) {
+        RLog::log("error: Writing printer log @ failed",directory);
+        out.clear();
+    }
+    writing.clear();
+}
+void PrinterLog::flushIfDue() {
+    uint64_t now = LatencyHistogram::now();
+    if(now<nextFlush) return;
+    nextFlush = now+FLUSH_MICROS;
+    flush();
+}
+void PrinterLog::writeJSON(JSONWriter &w,const Query &q) {
+    // Files are read without the lock, the copied sizes end at complete records
+    vector<Segment> segs;
+    uint64_t droppedCopy;
+    {
+        mutex::scoped_lock l(mutex);
+        segs.assign(segments.begin(),segments.end());
+    }
+    {
+        mutex::scoped_lock l(pendingMutex);
+        droppedCopy = dropped;
+    }
+    w.pair("first",segs.empty() ? (uint32_t)0 : segs.front().firstId);
+    w.pair("last",segs.empty() ? (uint32_t)0 : segs.back().lastId);
+    w.pair("dropped",droppedCopy);
+    w.key("lines");
+    w.startArray();
+    int found = 0;
+    uint64_t scanned = 0;
+    bool more = false,done = false;
+    uint32_t next = q.startId;
+    string text;
+    char h[RECORD_HEADER];
+    for(size_t i=0;i<segs.size() && !more && !done;i++) {
+        Segment &s = segs[i];
+        if(s.size==0 || s.lastId<=q.startId || s.lastTime<q.fromTime) continue;
+        if(s.firstId>q.endId || s.firstTime>q.toTime) break;
+        // Start at the last index point before the first wanted record,
+        // everything before an unwanted point is unwanted as well
+        size_t p = 0;
+        while(p<s.index.size() && (s.index[p].id<=q.startId || s.index[p].time<q.fromTime)) p++;
+        uint32_t offset = p>0 ? s.index[p-1].offset : 0;
+        ifstream in((s.filename+".log").c_str(),ios::in | ios::binary);
+        in.seekg(offset);
+        while(offset<s.size && in.read(h,RECORD_HEADER)) {
+            uint32_t length,id;
+            uint64_t time;
+            uint8_t type;
+            if(!parseHeader(h,length,id,time,type)) break;
+            text.resize(length-RECORD_HEADER);
+            if(!text.empty()) in.read(&text[0],text.size());
+            offset += length;
+            scanned += length;
+            if(id>q.endId || time>q.toTime) {
+                done = true; // Nothing later can match
+                break;
+            }
+            next = id;
+            if(id>q.startId && time>=q.fromTime && (type & q.filter)!=0 &&
+               (q.contains.empty() || text.find(q.contains)!=string::npos)) {
+                w.startObject();
+                w.pair("id",id);
+                w.pair("time",time);
+                w.pair("type",(int)type);
+                w.pair("text",text);
+                w.endObject();
+                if(++found>=q.limit) {
+                    more = true;
+                    break;
+                }
+            }
+            if(scanned>=SCAN_BYTES) {
+                more = true;
+                break;
+            }
+        }
+    }
+    w.endArray();
+    w.pair("more",more);
+    w.pair("next",next);
+}
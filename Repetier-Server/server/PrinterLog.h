@@ -0,0 +1,117 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__PrinterLog__
+#define __Repetier_Server__PrinterLog__
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+
+class JSONWriter;
+class PrinterResponse;
+
+/** Persistent log of everything sent to and received from one printer.
+
+ The log is a directory of append only segment files. A segment is named
+ after its first id and closed when it reaches 4 MB, the oldest segments
+ are deleted beyond 16. Each record is
+ length (4 bytes), id (4), time in ms since 1970 (8), logtype (1), text
+ in host byte order. Ids continue over restarts.
+
+ Every segment has a sparse index with the id, time and offset of one
+ record per 16 kB. A closed segment stores it next to it as .idx file,
+ the open segment is scanned on startup. Queries seek to the nearest index
+ point and read from there, so no segment is loaded completely.
+
+ append only queues the response, flush writes the queued responses in one
+ batch. Both are thread safe.
+ */
+class PrinterLog {
+public:
+    /** Selection of a log query. Times are in ms since 1970. */
+    struct Query {
+        uint32_t startId; ///< Only ids greater than this one
+        uint32_t endId; ///< Only ids up to this one
+        uint64_t fromTime; ///< Only records not older
+        uint64_t toTime; ///< Only records not newer
+        uint8_t filter; ///< Logtypes to return as bit mask
+        std::string contains; ///< Only records with this text, if not empty
+        int limit; ///< Maximum number of records returned
+        Query():startId(0),endId(0xffffffff),fromTime(0),toTime(~(uint64_t)0),filter(0xff),limit(500) {}
+    };
+private:
+    struct IndexPoint {
+        uint32_t id;
+        uint64_t time;
+        uint32_t offset;
+    };
+    struct Segment {
+        std::string filename; ///< Path without extension
+        uint32_t firstId,lastId;
+        uint64_t firstTime,lastTime;
+        uint32_t size; ///< Bytes written, including the current batch
+        std::vector<IndexPoint> index;
+    };
+    struct Pending {
+        boost::shared_ptr<PrinterResponse> response;
+        uint64_t time;
+    };
+    boost::mutex pendingMutex; ///< Guards pending and dropped
+    std::vector<Pending> pending;
+    std::vector<Pending> writing; ///< Swapped with pending by flush, keeps its capacity. Guarded by mutex
+    uint64_t dropped; ///< Responses not logged because pending was full
+    boost::mutex mutex; ///< Guards segments, out and nextId
+    std::string directory;
+    std::deque<Segment> segments;
+    std::ofstream out; ///< Open segment, the last of segments
+    uint32_t nextId;
+    std::vector<char> buffer; ///< Encoded batch
+    uint64_t nextFlush; ///< Only used by flushIfDue
+
+    void addRecord(Segment &s,uint32_t id,uint64_t time,uint32_t length);
+    /** Reads the record headers to rebuild the index. Cuts off a record
+     that was only partially written. */
+    void scanSegment(Segment &s);
+    bool loadIndex(Segment &s);
+    void writeIndex(Segment &s);
+    /** Closes the open segment and starts a new one. Expects mutex locked. */
+    void rotate();
+    void writeBuffer();
+public:
+    /** Opens the log in directory and creates the directory if needed. */
+    PrinterLog(const std::string &dir);
+    ~PrinterLog();
+    /** Queues a response for the next flush. Never blocks on file access. */
+    void append(const boost::shared_ptr<PrinterResponse> &response);
+    /** Writes all queued responses. */
+    void flush();
+    /** Calls flush if the last one is more than a second ago. */
+    void flushIfDue();
+    /** Writes the records selected by q as members of the current JSON
+     object. Reading stops after the limit or 16 MB of log, then more is
+     true and next is the id to continue with as startId. */
+    void writeJSON(JSONWriter &w,const Query &q);
+};
+
+#endif /* defined(__Repetier_Server__PrinterLog__) */
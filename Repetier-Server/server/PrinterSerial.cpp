@@ -32,10 +32,18 @@
 #include <linux/serial.h>
 #endif
 #include "RLog.h"
+#include "LatencyHistogram.h"
+#include <string.h>
+#include <algorithm>
 
 using namespace boost;
 using namespace std;
 
+#define RETRY_MIN_MICROS 100000 // First retry after a failed open
+#define RETRY_MAX_MICROS 2000000 // Retries slow down to this delay
+#define DTR_PULSE_MICROS 200000 // Duration of each DTR level of the reset
+#define START_TIMEOUT_MICROS 1000000 // Wait for "start" after the reset
+
 void PrinterSerialPort::set_baudrate(int baud) {
     try {
 #ifdef __APPLE__
@@ -64,7 +72,12 @@ void PrinterSerialPort::set_baudrate(int baud) {
             ::tcsetattr(handle, TCSANOW, &ios);
 
             struct serial_struct ss;
-            ioctl(handle, TIOCGSERIAL, &ss);
+            if(ioctl(handle, TIOCGSERIAL, &ss)!=0) {
+                // No UART behind the device, e.g. a pseudo terminal or native
+                // USB. The speed has no meaning there, so keep 38400.
+                RLog::log("Device has no baud rate divisor, ignoring baud rate @",baud);
+                return;
+            }
             ss.flags = (ss.flags & ~ASYNC_SPD_MASK) | ASYNC_SPD_CUST;
             ss.custom_divisor = (ss.baud_base + (baud / 2)) / baud;
             //cout << "bbase " << ss.baud_base << " div " << ss.custom_divisor;
@@ -123,42 +136,52 @@ void PrinterSerialPort::debugTermios() {
 #endif
 }
 
-PrinterSerial::PrinterSerial(Printer &prt):io(),port(io) {
+PrinterSerial::PrinterSerial(Printer &prt):io(),port(io),timer(io),linkTimer(io) {
     open = error = false;
+    writing = false;
+    linkState = LINK_CLOSED;
+    wantConnect = false;
+    linkLost = 0;
+    retryMicros = RETRY_MIN_MICROS;
     printer = &prt;
     flowControl = boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::none);
     stopBits = boost::asio::serial_port_base::stop_bits(boost::asio::serial_port_base::stop_bits::one);
     parity = asio::serial_port_base::parity(asio::serial_port_base::parity::none);
     characterSize = asio::serial_port_base::character_size(8);
-    readString = "";
 }
 
 PrinterSerial::~PrinterSerial()
 {
-    if(isOpen())
-    {
-        try {
-            close();
-        } catch(...)
-        {
-            //Don't throw from a destructor
-        }
-    }
+    if(!work) return; // Never connected, no thread
+    close();
+    work.reset();
+    backgroundThread.join();
 }
-// Returns true if printer is connected
 bool PrinterSerial::isConnected() {
-    return isOpen();
+    return linkState>=LINK_HANDSHAKE;
+}
+void PrinterSerial::connect() {
+    if(wantConnect) return;
+    wantConnect = true;
+    if(!work) {
+        // The io service runs for the lifetime of the object, timers of
+        // the state machine need it also while the port is closed.
+        work.reset(new asio::io_service::work(io));
+        thread t(boost::bind(&asio::io_service::run, &io));
+        backgroundThread.swap(t);
+    }
+    io.post(boost::bind(&PrinterSerial::doConnect, this));
 }
-// Tries to connect to printer
-bool PrinterSerial::tryConnect() {
+void PrinterSerial::doConnect() {
+    if(!wantConnect || linkState!=LINK_CLOSED) return;
+    if(linkLost==0) linkLost = LatencyHistogram::now();
     try {
         if(port.is_open()) port.close();
-        if(io.stopped()) {
-            io.reset();
-            writeBuffer.reset();
-            writeBufferSize=0;
+        {
+            lock_guard<mutex> l(writeQueueMutex);
             writeQueue.clear();
         }
+        partial.clear();
         setErrorStatus(true);//If an exception is thrown, error_ remains true
         baudrate = asio::serial_port_base::baud_rate(printer->baudrate);
         port.open(printer->device);
@@ -173,38 +196,47 @@ bool PrinterSerial::tryConnect() {
         port.debugTermios();
         port.set_baudrate(printer->baudrate);
         port.debugTermios();
-        //This gives some work to the io_service before it is started
-        io.post(boost::bind(&PrinterSerial::doRead, this));
-        thread t(boost::bind(&asio::io_service::run, &io));
-        backgroundThread.swap(t);
         setErrorStatus(false);//If we get here, no error
         open=true; //Port is now open
-        RLog::log("Connection started:@",printer->name);
-        resetPrinter();
-    } catch (std::exception& e)
-    {
-#ifdef DEBUG
-        //  cerr << "Exception: " << e.what() << "\n";
-#endif
-        return false;
+        retryMicros = RETRY_MIN_MICROS;
+        RLog::logf(RLog::LEVEL_INFO,"Connection started:%s",printer->name.c_str());
+        doRead();
+        doReset();
+    } catch (...) {
+        boost::system::error_code ec;
+        port.close(ec);
+        // Retry with growing delay, a missing device should not cost CPU
+        scheduleLink(retryMicros,&PrinterSerial::doConnect);
+        retryMicros = std::min(retryMicros*2,(uint64_t)RETRY_MAX_MICROS);
     }
-    catch(...) {
-        
-        return false;
-    }
-    return true;
+}
+void PrinterSerial::scheduleLink(uint64_t micros,void (PrinterSerial::*step)()) {
+    linkTimer.expires_from_now(boost::posix_time::microseconds(micros));
+    linkTimer.async_wait(boost::bind(&PrinterSerial::linkTimerEnd,this,asio::placeholders::error,step));
+}
+void PrinterSerial::linkTimerEnd(const boost::system::error_code& error,void (PrinterSerial::*step)()) {
+    if(!error) (this->*step)();
 }
 void PrinterSerial::close() {
-    if(!isOpen()) return;
+    wantConnect = false;
+    if(!work) return;
     io.post(boost::bind(&PrinterSerial::doClose, this));
-    backgroundThread.join();
-    //io.reset();
-    if(errorStatus())
-    {
-        throw(boost::system::system_error(boost::system::error_code(),
-                                          "Error while closing the device"));
+}
+void PrinterSerial::startReceived() {
+    if(linkState==LINK_ONLINE)
+        linkLost = LatencyHistogram::now(); // Firmware restarted on its own
+    if(linkState!=LINK_CLOSED) {
+        boost::system::error_code ec;
+        linkTimer.cancel(ec);
+        linkState = LINK_HANDSHAKE;
     }
 }
+uint64_t PrinterSerial::handshakeDone() {
+    linkState = LINK_ONLINE;
+    uint64_t t = linkLost ? LatencyHistogram::now()-linkLost : 0;
+    linkLost = 0;
+    return t;
+}
 bool PrinterSerial::isOpen() {
     return open;
 }
@@ -220,18 +252,22 @@ void PrinterSerial::setErrorStatus(bool e) {
 }
 void PrinterSerial::writeString(const std::string& s)
 {
-    {
-        lock_guard<mutex> l(writeQueueMutex);
-        writeQueue.insert(writeQueue.end(),s.begin(),s.end());
-    }
-    io.post(boost::bind(&PrinterSerial::doWrite, this));
+    writeBytes((const uint8_t*)s.c_str(),s.length());
 }
 void PrinterSerial::writeBytes(const uint8_t* data,size_t len) {
+    uint8_t *copy = new uint8_t[len];
+    memcpy(copy,data,len);
+    writePacket(GCodeDataPacketPtr(new GCodeDataPacket((int)len,copy)));
+}
+void PrinterSerial::writePacket(const GCodeDataPacketPtr &dp) {
+    bool post;
     {
         lock_guard<mutex> l(writeQueueMutex);
-        writeQueue.insert(writeQueue.end(),data,data+len);
+        writeQueue.push_back(dp);
+        post = !writing; // A running write picks the packet up when it ends
+        writing = true;
     }
-    io.post(boost::bind(&PrinterSerial::doWrite, this));    
+    if(post) io.post(boost::bind(&PrinterSerial::doWrite, this));
 }
 
 void PrinterSerial::doRead() {
@@ -259,86 +295,139 @@ void PrinterSerial::readEnd(const boost::system::error_code& error,
         //In this case it is not a real error, so ignore
         if(isOpen())
         {
-            RLog::log("error: Reading serial conection failed: @. Closing connection.",error.message());
+            RLog::logf(RLog::LEVEL_ERROR,"error: Reading serial conection failed: %s. Closing connection.",error.message().c_str());
             doClose();
             setErrorStatus(true);
         }
     } else {
+        lines.clear();
         size_t lstart = 0;
         for(size_t i=0;i<bytes_transferred;i++) {
             char c = readBuffer[i];
-            if(c=='\n' || c=='\r') {
-                readString.append(&readBuffer[lstart],i-lstart);
-                lstart = i+1;
-                if(readString.length()>0)
-                    printer->analyseResponse(readString);
-                readString = "";
+            if(c!='\n' && c!='\r') continue;
+            const char *text = &readBuffer[lstart];
+            size_t length = i-lstart;
+            if(lstart==0 && !partial.empty()) {
+                // partial is not touched again before the lines are analysed
+                partial.append(text,length);
+                text = partial.c_str();
+                length = partial.length();
             }
+            lstart = i+1;
+            while(length>0 && *text<32) {
+                text++;
+                length--;
+            }
+            if(length>0)
+                lines.push_back(ResponseLine(text,length));
         }
-        readString.append(&readBuffer[lstart],bytes_transferred-lstart);
+        if(!lines.empty())
+            printer->analyseResponses(&lines[0],lines.size());
+        if(lstart>0) partial.clear();
+        partial.append(&readBuffer[lstart],bytes_transferred-lstart);
         doRead(); // Continue reading serial port
     }
 }
+/** Buffer sequence over a range of writeGather. Copying it copies two
+ pointers, where a vector would be copied into each write operation. */
+struct GatherBuffers {
+    typedef asio::const_buffer value_type;
+    typedef const asio::const_buffer *const_iterator;
+    const_iterator first,last;
+    GatherBuffers(const_iterator f,const_iterator l):first(f),last(l) {}
+    inline const_iterator begin() const {return first;}
+    inline const_iterator end() const {return last;}
+};
 void PrinterSerial::doWrite()
 {
-    //If a write operation is already in progress, do nothing
-    if(writeBuffer==0)
     {
         lock_guard<mutex> l(writeQueueMutex);
-        writeBufferSize=writeQueue.size();
-        writeBuffer.reset(new char[writeQueue.size()]);
-        copy(writeQueue.begin(),writeQueue.end(),
-             writeBuffer.get());
-        writeQueue.clear();
-        async_write(port,asio::buffer(writeBuffer.get(),
-                                             writeBufferSize),
-                    boost::bind(&PrinterSerial::writeEnd, this, asio::placeholders::error));
+        if(writeQueue.empty() || !open) {
+            writing = false;
+            writeQueue.clear();
+            return;
+        }
+        writeActive.swap(writeQueue);
     }
+    writeGather.clear();
+    for(size_t i=0;i<writeActive.size();i++)
+        writeGather.push_back(asio::const_buffer(writeActive[i]->data,writeActive[i]->length));
+    async_write(port,GatherBuffers(&writeGather[0],&writeGather[0]+writeGather.size()),
+                boost::bind(&PrinterSerial::writeEnd, this, asio::placeholders::error));
 }
 void PrinterSerial::writeEnd(const boost::system::error_code& error)
 {
+    writeActive.clear(); // Releases the packets, the vector keeps its capacity
     if(!error)
     {
-        lock_guard<mutex> l(writeQueueMutex);
-        if(writeQueue.empty())
+        doWrite(); // Continue with packets queued meanwhile
+    } else {
         {
-            writeBuffer.reset();
-            writeBufferSize=0;
-            return;
+            lock_guard<mutex> l(writeQueueMutex);
+            writing = false;
+            writeQueue.clear();
+        }
+        if(error!=asio::error::operation_aborted) {
+            setErrorStatus(true);
+            doClose();
         }
-        writeBufferSize=writeQueue.size();
-        writeBuffer.reset(new char[writeQueue.size()]);
-        copy(writeQueue.begin(),writeQueue.end(),
-             writeBuffer.get());
-        writeQueue.clear();
-        async_write(port,asio::buffer(writeBuffer.get(),
-                                             writeBufferSize),
-                    boost::bind(&PrinterSerial::writeEnd, this, asio::placeholders::error));
-    } else {
-        setErrorStatus(true);
-        doClose();
     }
 }
 void PrinterSerial::doClose()
 {
+    boost::system::error_code ec;
+    linkTimer.cancel(ec);
     if(!open) return;
     open = false;
-    boost::system::error_code ec;
+    linkState = LINK_CLOSED;
+    timer.cancel(ec);
     port.cancel(ec);
     if(ec) setErrorStatus(true);
     port.close(ec);
     if(ec) setErrorStatus(true);
     printer->connectionClosed();
-    RLog::log("Connection closed: @",printer->name);
+    RLog::logf(RLog::LEVEL_INFO,"Connection closed: %s",printer->name.c_str());
+    if(wantConnect) { // Lost the connection, try again
+        linkLost = LatencyHistogram::now();
+        scheduleLink(retryMicros,&PrinterSerial::doConnect);
+    }
+}
+void PrinterSerial::callAfter(uint64_t micros,const boost::function<void ()> &f) {
+    io.post(boost::bind(&PrinterSerial::doCallAfter,this,micros,f));
+}
+void PrinterSerial::doCallAfter(uint64_t micros,boost::function<void ()> f) {
+    if(!open) return;
+    timer.expires_from_now(boost::posix_time::microseconds(micros));
+    timer.async_wait(boost::bind(&PrinterSerial::timerEnd,this,asio::placeholders::error,f));
+}
+void PrinterSerial::timerEnd(const boost::system::error_code& error,boost::function<void ()> f) {
+    if(!error && open) f();
 }
 
 // Send reset to the printer by toggling DTR line
 void PrinterSerial::resetPrinter() {
-	RLog::log("Reset printer @",printer->name);
+    io.post(boost::bind(&PrinterSerial::doReset, this));
+}
+void PrinterSerial::doReset() {
+    if(!open) return;
+	RLog::logf(RLog::LEVEL_INFO,"Reset printer %s",printer->name.c_str());
+    if(linkState==LINK_ONLINE || linkState==LINK_HANDSHAKE)
+        linkLost = LatencyHistogram::now();
+    linkState = LINK_RESETTING;
     port.setDTR(false);
-    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    scheduleLink(DTR_PULSE_MICROS,&PrinterSerial::resetHigh);
+}
+void PrinterSerial::resetHigh() {
     port.setDTR(true);
-    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    scheduleLink(DTR_PULSE_MICROS,&PrinterSerial::resetLow);
+}
+void PrinterSerial::resetLow() {
     port.setDTR(false);
-    boost::this_thread::sleep(boost::posix_time::milliseconds(1000));    
+    linkState = LINK_WAIT_START;
+    scheduleLink(START_TIMEOUT_MICROS,&PrinterSerial::startTimeout);
+}
+void PrinterSerial::startTimeout() {
+    // No start from a board that does not reset on DTR, talk to it anyway
+    linkState = LINK_HANDSHAKE;
+    printer->beginHandshake();
 }
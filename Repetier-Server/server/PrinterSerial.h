@@ -24,8 +24,10 @@
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/shared_array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/cstdint.hpp>
+#include "GCode.h"
+#include "PrinterState.h"
 using namespace boost;
 
 class Printer;
@@ -40,8 +42,18 @@ public:
     void setDTR(bool on);
 };
 /** Handles the connection with one printer.
+
+ Connecting is a state machine driven by timers on the io service, so no
+ thread waits for the port or the firmware:
+ LINK_CLOSED -> open port -> LINK_RESETTING (DTR pulse) -> LINK_WAIT_START
+ -> "start" or timeout -> LINK_HANDSHAKE (M110/M115) -> first ok -> LINK_ONLINE.
+ A failed open or a lost connection retries with a growing delay while
+ connect() is in effect.
  */
 class PrinterSerial {
+public:
+    enum LinkState {LINK_CLOSED,LINK_RESETTING,LINK_WAIT_START,LINK_HANDSHAKE,LINK_ONLINE};
+private:
     boost::asio::io_service io; ///< Io service object
                                 //boost::asio::serial_port port; ///< Serial port object
     PrinterSerialPort port; ///< Serial port object
@@ -50,19 +62,32 @@ class PrinterSerial {
     boost::asio::serial_port_base::stop_bits stopBits;
     boost::asio::serial_port_base::baud_rate baudrate;
     boost::asio::serial_port_base::character_size characterSize;
+    boost::asio::deadline_timer timer; ///< Wakes the printer after a delay, see callAfter
+    boost::asio::deadline_timer linkTimer; ///< Steps of the connection state machine
+    boost::scoped_ptr<boost::asio::io_service::work> work; ///< Keeps the io service running while closed
     boost::thread backgroundThread; ///< Thread that runs read/write operations
     bool open; ///< True if port open
+    volatile int linkState; ///< LinkState, only changed in the serial thread
+    volatile bool wantConnect; ///< connect() was called and close() not since
+    uint64_t linkLost; ///< LatencyHistogram::now() when the connection was requested or lost
+    uint64_t retryMicros; ///< Delay before the next open attempt
     bool error; ///< Error flag
     mutable boost::mutex errorMutex; ///< Mutex for access to error
-    /// Data are queued here before they go in writeBuffer
-    std::vector<char> writeQueue;
-    boost::shared_array<char> writeBuffer; ///< Data being written
-    size_t writeBufferSize; ///< Size of writeBuffer
-    boost::mutex writeQueueMutex; ///< Mutex for access to writeQueue
+    /** Packets are queued here until the running write ends. The vectors
+     are swapped with writeActive, so both keep their capacity and queueing
+     does not allocate once they had their largest size. */
+    std::vector<GCodeDataPacketPtr> writeQueue;
+    std::vector<GCodeDataPacketPtr> writeActive; ///< Packets being written, keeps them alive
+    std::vector<boost::asio::const_buffer> writeGather; ///< One buffer per packet of writeActive
+    bool writing; ///< A write runs or is posted. Guarded by writeQueueMutex
+    boost::mutex writeQueueMutex; ///< Mutex for access to writeQueue and writing
     char readBuffer[READ_BUFFER_SIZE]; ///< data being read
     /// Read complete callback
     boost::function<void (const char*, size_t)> callback;
-    std::string readString;
+    /** Start of a line that continues in the next read. Only lines split
+     over two reads are copied, all others are analysed in readBuffer. */
+    std::string partial;
+    std::vector<ResponseLine> lines; ///< Lines of the current read, keeps its capacity
     
     
     
@@ -73,26 +98,51 @@ class PrinterSerial {
     void doWrite();
     void writeEnd(const boost::system::error_code& error);
     void doClose();
+    void doConnect();
+    void doReset();
+    void scheduleLink(uint64_t micros,void (PrinterSerial::*step)());
+    void linkTimerEnd(const boost::system::error_code& error,void (PrinterSerial::*step)());
+    void resetHigh();
+    void resetLow();
+    void startTimeout();
+    void doCallAfter(uint64_t micros,boost::function<void ()> f);
+    void timerEnd(const boost::system::error_code& error,boost::function<void ()> f);
 public:
     
     PrinterSerial(Printer &prt);
     ~PrinterSerial();
     
-    // Returns true if printer is connected
+    /** Returns true if the handshake started, so lines may be sent. */
     bool isConnected();
-    // Tries to connect to printer
-    bool tryConnect();
-    // Close connection
+    inline LinkState getLinkState() {return (LinkState)linkState;}
+    /** Starts connecting in the background and keeps reconnecting until
+     close() is called. Returns immediately. Thread safe. */
+    void connect();
+    /** Closes the connection and stops reconnecting. Returns immediately.
+     Thread safe. */
     void close();
+    /** The firmware sent "start". Ends waiting for it. Call from the serial thread. */
+    void startReceived();
+    /** The firmware answered the handshake. Call from the serial thread.
+     @returns Microseconds since the connection was requested or lost. */
+    uint64_t handshakeDone();
     
     bool isOpen();
     bool errorStatus() const;
     void setErrorStatus(bool e);
     /** Send a string to serial output. */
     void writeString(const std::string& s);
-    /** Write some bytes to serial output. */
+    /** Write some bytes to serial output. Copies them. */
     void writeBytes(const uint8_t* data,size_t len);
-    /** Send reset to the printer by toggling DTR line. */
+    /** Queues an encoded packet. The data are written from the packet
+     itself together with all packets queued meanwhile. Thread safe. */
+    void writePacket(const GCodeDataPacketPtr &dp);
+    /** Calls f in the serial thread after micros microseconds, if the
+     connection is still open. Replaces a call that is still pending.
+     Thread safe. */
+    void callAfter(uint64_t micros,const boost::function<void ()> &f);
+    /** Send reset to the printer by toggling DTR line. Returns immediately,
+     the handshake follows when the firmware restarted. Thread safe. */
     void resetPrinter();
 };
 
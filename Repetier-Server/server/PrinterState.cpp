@@ -22,6 +22,9 @@
 #include "PrinterState.h"
 #include "printer.h"
 #include "GCode.h"
+#include "JSONWriter.h"
+#include "Atomic.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 using namespace std;
 using namespace boost;
@@ -32,6 +35,13 @@ using namespace boost;
 PrinterState::PrinterState(Printer *p) {
     printer = p;
     extruder=new PrinterTemp[printer->extruderCount+1]; // Always one more in case 0 extruder
+    for(int i=0;i<=printer->extruderCount;i++) {
+        extruder[i].output = 0;
+        extruder[i].tempSet = extruder[i].tempRead = 0;
+    }
+    snapshotDirty = 0;
+    serialStalls = 0;
+    serialStallMicros = 0;
     reset();
 }
     
@@ -63,13 +73,14 @@ void PrinterState::reset() {
     isMarlin = false;
     speedMultiply = 100;
     flowMultiply = 100;
+    publishSnapshot();
 }
 
 PrinterState::~PrinterState() {
     delete[] extruder;
 }
 const PrinterTemp& PrinterState::getExtruder(int extruderId) const {
-    if(extruder<0) extruderId = activeExtruder;
+    if(extruderId<0) extruderId = activeExtruder;
     if(extruderId>=printer->extruderCount) extruderId = 0;
     return extruder[extruderId];
 }
@@ -78,9 +89,60 @@ PrinterTemp& PrinterState::getExtruder(int extruderId) {
     if(extruderId>=printer->extruderCount) extruderId = 0;
     return extruder[extruderId];
 }
+void PrinterState::lockMeasured(mutex::scoped_lock &l) {
+    if(l.try_lock()) return;
+    posix_time::ptime start = posix_time::microsec_clock::universal_time();
+    l.lock();
+    serialStalls++;
+    serialStallMicros += (posix_time::microsec_clock::universal_time()-start).total_microseconds();
+}
+void PrinterState::publishSnapshot() {
+    mutex::scoped_try_lock l(snapshotMutex);
+    if(!l.owns_lock()) {
+        CAS32(&snapshotDirty,0,1);
+        return;
+    }
+    snapshot.activeExtruder = activeExtruder;
+    snapshot.x = x;
+    snapshot.y = y;
+    snapshot.z = z;
+    snapshot.fanOn = fanOn;
+    snapshot.fanVoltage = fanVoltage;
+    snapshot.powerOn = powerOn;
+    snapshot.debugLevel = debugLevel;
+    snapshot.hasXHome = hasXHome;
+    snapshot.hasYHome = hasYHome;
+    snapshot.hasZHome = hasZHome;
+    snapshot.layer = layer;
+    snapshot.sdcardMounted = sdcardMounted;
+    snapshot.bed = bed;
+    snapshot.speedMultiply = speedMultiply;
+    snapshot.flowMultiply = flowMultiply;
+    snapshot.firmware = firmware; // Same length most times, so no reallocation
+    snapshot.firmwareURL = firmwareURL;
+    snapshot.extruder.assign(extruder,extruder+printer->extruderCount);
+    snapshot.serialStalls = serialStalls;
+    snapshot.serialStallMicros = serialStallMicros;
+    CAS32(&snapshotDirty,1,0);
+}
+void PrinterState::getSnapshot(PrinterStateSnapshot &s) {
+    if(FETCH_ADD32(&snapshotDirty,0)!=0) { // Serial thread could not publish, try it for it
+        mutex::scoped_try_lock sl(mutex);
+        if(sl.owns_lock())
+            publishSnapshot();
+    }
+    mutex::scoped_lock l(snapshotMutex);
+    s = snapshot;
+}
 void PrinterState::analyze(GCode &code)
 {
-    mutex::scoped_lock l(mutex);
+    mutex::scoped_lock l(mutex,boost::defer_lock);
+    lockMeasured(l);
+    analyzeLocked(code);
+    publishSnapshot();
+}
+void PrinterState::analyzeLocked(GCode &code)
+{
     isG1Move = false;
     if (code.hostCommand)
     {
@@ -260,137 +322,187 @@ void PrinterState::analyze(GCode &code)
         activeExtruder = code.getT();
     }
 }
-// Extract the value following a identifier ident until the next space or line end.
-bool PrinterState::extract(const string& source,const string& ident,string &result)
-{
-    size_t pos = 0; //source.find(ident);
-    size_t len = source.length();
-    do
-    {
-        if(pos>0) pos++;
-        pos = source.find(ident, pos);
-        if (pos == string::npos) return false;
-        if(pos==0) break;
-    } while (source[pos-1]!=' ');
-    size_t start = pos + ident.length();
-    while(start<len && source[pos]==' ') start++;
-    size_t end = start;
-    while (end < len && source[end] != ' ') end++;
-    result = source.substr(start,end-start);
-    return true;
-}
+// Compares the key of a token with a keyword literal including the colon.
+#define KEY_IS(lit) (klen==sizeof(lit)-1 && memcmp(key,lit,klen)==0)
 
-void PrinterState::analyseResponse(const string &res,uint8_t &rtype) {
-    mutex::scoped_lock l(mutex);
-    string h;
-    char b[100];
-    if (extract(res,"FIRMWARE_NAME:",h))
-    {
-        firmware = h;
-        isRepetier = h.find("Repetier")!=string::npos;
-        isMarlin = h.find("Marlin")!=string::npos;
-        if (extract(res,"FIRMWARE_URL:",h))
-        {
-            firmwareURL = h;
-        }
-        if (extract(res,"PROTOCOL_VERSION:",h))
-        {
-            protocol = h;
-        }
-        if (extract(res,"MACHINE_TYPE:",h))
-        {
-            machine = h;
-        }
-        if (extract(res,"EXTRUDER_COUNT:",h))
-        {
-            extruderCountSend = atoi(h.c_str());
-        }
-    }
-    if (extract(res,"X:",h))
-    {
-        double v = atof(h.c_str());
-        x = v-xOffset;
-    }
-    if (extract(res,"Y:",h))
-    {
-        double v = atof(h.c_str());
-        y = v-yOffset;
+void PrinterState::analyseResponse(const string &res,uint8_t &rtype,ResponseInfo &info) {
+    mutex::scoped_lock l(mutex,boost::defer_lock);
+    lockMeasured(l);
+    if(analyseResponseLocked(res.c_str(),res.length(),rtype,info)) {
+        recordTemperatures();
+        printer->updateLastTempMutex();
     }
-    if (extract(res,"Z:",h))
+    publishSnapshot();
+}
+size_t PrinterState::analyseResponses(ResponseLine *lines,size_t count) {
+    if(count==0) return 0;
+    bool hasT = false;
+    size_t i = 0;
     {
-        double v = atof(h.c_str());
-        z = v-zOffset;
+        mutex::scoped_lock l(mutex,boost::defer_lock);
+        lockMeasured(l);
+        while(i<count) {
+            ResponseLine &r = lines[i++];
+            hasT |= analyseResponseLocked(r.text,r.length,r.rtype,r.info);
+            if(r.info.start) break;
+        }
+        if(hasT) recordTemperatures();
+        publishSnapshot();
     }
-    if (extract(res,"E:",h))
-    {
-        double v = atof(h.c_str());
-        e = v;
+    if(hasT) printer->updateLastTempMutex();
+    return i;
+}
+void PrinterState::recordTemperatures() {
+    TemperatureHistory *history = printer->getTemperatureHistory();
+    if(history==NULL) return;
+    historySample.resize(history->heaterCount());
+    for(size_t i=0;i<historySample.size();i++) {
+        const PrinterTemp &t = i==0 ? bed : extruder[i-1];
+        historySample[i].set = (float)t.tempSet;
+        historySample[i].read = (float)t.tempRead;
+        historySample[i].output = t.output;
     }
-    if (extract(res,"T0:",h)) {
-        int ecnt = 0;
-        do {
-            sprintf(b,"T%d:",ecnt);
-            if(!extract(res,b,h)) break;
-            double t = atof(h.c_str());
-            PrinterTemp &ex = getExtruder(ecnt);
-            ex.tempRead = t;
-            sprintf(b,"@%d:",ecnt);
-            if(extract(res,b,h)) {
-                int  eo = atoi(h.c_str());
-                if(isMarlin) eo*=2;
-                ex.output = eo;
+    history->add(TemperatureHistory::nowMillis(),&historySample[0]);
+}
+bool PrinterState::analyseResponseLocked(const char *line,size_t len,uint8_t &rtype,ResponseInfo &info) {
+    info.ok = len>=2 && line[0]=='o' && line[1]=='k';
+    info.wait = len==4 && memcmp(line,"wait",4)==0;
+    info.start = len>=5 && memcmp(line,"start",5)==0;
+    info.resend = -1;
+    info.okLine = info.plannerFree = info.bufferFree = -1;
+    if(info.wait) return false; // Nothing to parse
+    uint32_t found = 0; // Only the first occurence of a keyword counts
+    PrinterTemp *lastTemp = NULL; // Target for a following /target token
+    bool hasT = false;
+    int activeOutput = -1;
+    size_t pos = 0;
+    while(pos<len) {
+        // Tokens are separated by spaces. Keywords end with a colon and
+        // are followed directly by their value.
+        while(pos<len && line[pos]==' ') pos++;
+        size_t tstart = pos;
+        while(pos<len && line[pos]!=' ' && line[pos]!=':') pos++;
+        if(pos>=len || line[pos]!=':') {
+            while(pos<len && line[pos]!=' ') pos++;
+            if(line[tstart]=='/' && lastTemp!=NULL) // Marlin/Repetier: "T:20.0 /210.0"
+                lastTemp->tempSet = atof(&line[tstart+1]);
+            else if(info.ok && pos-tstart>1 && line[tstart+1]>='0' && line[tstart+1]<='9') {
+                switch(line[tstart]) { // ADVANCED_OK: "ok N12 P15 B3"
+                    case 'N': info.okLine = atoi(&line[tstart+1]);break;
+                    case 'P': info.plannerFree = atoi(&line[tstart+1]);break;
+                    case 'B': info.bufferFree = atoi(&line[tstart+1]);break;
+                }
             }
-            ecnt++;
-        } while(true);
-    }
-    if (extract(res,"T:",h))
-    {
-        rtype = 2;
-        PrinterTemp &ex = getExtruder(-1);
-        ex.tempRead = atof(h.c_str());
-        if (extract(res,"@:",h))
-        {
-            int eo = atoi(h.c_str());
-            if(isMarlin) eo*=2;
-            ex.output = eo;
+            lastTemp = NULL;
+            continue;
+        }
+        pos++; // include colon in key
+        const char *key = &line[tstart];
+        size_t klen = pos-tstart;
+        size_t vstart = pos;
+        while(pos<len && line[pos]!=' ') pos++;
+        if(vstart==pos) { // "Resend: 12" - value follows after spaces
+            while(pos<len && line[pos]==' ') pos++;
+            vstart = pos;
+            while(pos<len && line[pos]!=' ') pos++;
+        }
+        const char *val = &line[vstart];
+        size_t vlen = pos-vstart;
+        lastTemp = NULL;
+        switch(key[0]) {
+            case 'X':
+                if(klen==2 && !(found & 1)) {found|=1;x = atof(val)-xOffset;}
+                break;
+            case 'Y':
+                if(klen==2 && !(found & 2)) {found|=2;y = atof(val)-yOffset;}
+                break;
+            case 'Z':
+                if(klen==2 && !(found & 4)) {found|=4;z = atof(val)-zOffset;}
+                break;
+            case 'E':
+                if(klen==2 && !(found & 8)) {found|=8;e = atof(val);}
+                else if(KEY_IS("EXTRUDER_COUNT:")) extruderCountSend = atoi(val);
+                break;
+            case 'T':
+                if(klen==2) {
+                    if(found & 16) break;
+                    found|=16;
+                    hasT = true;
+                    rtype = 2;
+                    lastTemp = &getExtruder(-1);
+                    lastTemp->tempRead = atof(val);
+                } else if(klen>2 && key[1]>='0' && key[1]<='9') { // T0:, T1:, ...
+                    int ext = atoi(&key[1]);
+                    if(ext<printer->extruderCount) {
+                        lastTemp = &extruder[ext];
+                        lastTemp->tempRead = atof(val);
+                    }
+                } else if(!isMarlin && klen==13 && memcmp(key,"TargetExtr",10)==0) {
+                    rtype = 2;
+                    int ext = key[10]-'0';
+                    if(ext>=0 && ext<printer->extruderCount)
+                        extruder[ext].tempSet = atof(val);
+                } else if(!isMarlin && KEY_IS("TargetBed:")) {
+                    rtype = 2;
+                    bed.tempSet = atof(val);
+                }
+                break;
+            case 'B':
+                if(klen==2 && !(found & 32)) {
+                    found|=32;
+                    lastTemp = &bed;
+                    bed.tempRead = atof(val);
+                }
+                break;
+            case '@':
+                if(klen==2) {
+                    if(!(found & 64)) {found|=64;activeOutput = atoi(val);}
+                } else if(key[1]>='0' && key[1]<='9') { // @0:, @1:, ...
+                    int ext = atoi(&key[1]);
+                    if(ext<printer->extruderCount)
+                        extruder[ext].output = (isMarlin ? 2 : 1)*atoi(val);
+                }
+                break;
+            case 'R':
+                if(KEY_IS("Resend:")) {
+                    if(info.resend<0) info.resend = atoi(val);
+                } else if(!isMarlin && KEY_IS("REPETIER_PROTOCOL:"))
+                    binaryVersion = atoi(val);
+                break;
+            case 'F':
+                if(KEY_IS("FIRMWARE_NAME:")) {
+                    firmware.assign(val,vlen);
+                    isRepetier = firmware.find("Repetier")!=string::npos;
+                    isMarlin = firmware.find("Marlin")!=string::npos;
+                } else if(KEY_IS("FIRMWARE_URL:")) {
+                    firmwareURL.assign(val,vlen);
+                } else if(!isMarlin && KEY_IS("FlowMultiply:")) {
+                    rtype = 2;
+                    flowMultiply = atoi(val);
+                } else if(!isMarlin && KEY_IS("Fanspeed:")) {
+                    rtype = 2;
+                    fanVoltage = atoi(val);
+                }
+                break;
+            case 'P':
+                if(KEY_IS("PROTOCOL_VERSION:")) protocol.assign(val,vlen);
+                break;
+            case 'M':
+                if(KEY_IS("MACHINE_TYPE:")) machine.assign(val,vlen);
+                break;
+            case 'S':
+                if(!isMarlin && KEY_IS("SpeedMultiply:")) {
+                    rtype = 2;
+                    speedMultiply = atoi(val);
+                }
+                break;
         }
-        printer->updateLastTempMutex();
-    }
-    if (extract(res,"B:",h))
-    {
-        bed.tempRead = atof(h.c_str());
-    }
-    if (extract(res,"SpeedMultiply:",h))  {
-        rtype = 2;
-        speedMultiply = atoi(h.c_str());
-    }
-    if (extract(res,"FlowMultiply:",h))  {
-        rtype = 2;
-        flowMultiply = atoi(h.c_str());
-    }
-    if (extract(res,"TargetExtr0:",h))  {
-        rtype = 2;
-        PrinterTemp &ex = getExtruder(0);
-        ex.tempSet = atof(h.c_str());
-    }
-    if (extract(res,"TargetExtr1:",h))  {
-        rtype = 2;
-        PrinterTemp &ex = getExtruder(0);
-        ex.tempSet = atof(h.c_str());
-    }
-    if (extract(res,"TargetBed:",h))  {
-        rtype = 2;
-        bed.tempSet = atof(h.c_str());
-    }
-    if (extract(res,"Fanspeed:",h))  {
-        rtype = 2;
-        fanVoltage = atoi(h.c_str());
-    }
-    if (extract(res,"REPETIER_PROTOCOL:",h))
-    {
-        binaryVersion = atoi(h.c_str());
     }
+    if(hasT && activeOutput>=0)
+        getExtruder(-1).output = (isMarlin ? 2 : 1)*activeOutput;
+    return hasT;
 }
+#undef KEY_IS
 uint32_t PrinterState::increaseLastline() {
     mutex::scoped_lock l(mutex);
     return ++lastline;
@@ -436,40 +548,44 @@ void PrinterState::setIsathome() {
     yOffset = 0;
     z = printer->homez;
     zOffset = 0;
+    publishSnapshot();
 }
 
-void PrinterState::fillJSONObject(json_spirit::Object &obj) {
-    using namespace json_spirit;
-    mutex::scoped_lock l(mutex);
-    obj.push_back(Pair("activeExtruder",activeExtruder));
-    obj.push_back(Pair("x",x));
-    obj.push_back(Pair("y",y));
-    obj.push_back(Pair("z",z));
-    obj.push_back(Pair("fanOn",fanOn));
-    obj.push_back(Pair("fanVoltage",fanVoltage));
-    obj.push_back(Pair("powerOn",powerOn));
-    obj.push_back(Pair("debugLevel",debugLevel));
-    obj.push_back(Pair("hasXHome",hasXHome));
-    obj.push_back(Pair("hasYHome",hasYHome));
-    obj.push_back(Pair("hasZHome",hasZHome));
-    obj.push_back(Pair("layer",layer));
-    obj.push_back(Pair("sdcardMounted",sdcardMounted));
-    obj.push_back(Pair("bedTempSet",bed.tempSet));
-    obj.push_back(Pair("bedTempRead",bed.tempRead));
-    obj.push_back(Pair("speedMultiply",speedMultiply));
-    obj.push_back(Pair("flowMultiply",flowMultiply));
-    obj.push_back(Pair("numExtruder",printer->extruderCount));
-    obj.push_back(Pair("firmware",firmware));
-    obj.push_back(Pair("firmwareURL",firmwareURL));
-    Array ea;
-    for(int i=0;i<printer->extruderCount;i++) {
-        Object e;
-        e.push_back(Pair("tempSet",extruder[i].tempSet));
-        e.push_back(Pair("tempRead",extruder[i].tempRead));
-        e.push_back(Pair("output",extruder[i].output));
-        ea.push_back(e);
+void PrinterState::writeJSON(JSONWriter &w) {
+    PrinterStateSnapshot s;
+    getSnapshot(s);
+    w.startObject();
+    w.pair("activeExtruder",s.activeExtruder);
+    w.pair("x",s.x);
+    w.pair("y",s.y);
+    w.pair("z",s.z);
+    w.pair("fanOn",s.fanOn);
+    w.pair("fanVoltage",s.fanVoltage);
+    w.pair("powerOn",s.powerOn);
+    w.pair("debugLevel",s.debugLevel);
+    w.pair("hasXHome",s.hasXHome);
+    w.pair("hasYHome",s.hasYHome);
+    w.pair("hasZHome",s.hasZHome);
+    w.pair("layer",s.layer);
+    w.pair("sdcardMounted",s.sdcardMounted);
+    w.pair("bedTempSet",s.bed.tempSet);
+    w.pair("bedTempRead",s.bed.tempRead);
+    w.pair("speedMultiply",s.speedMultiply);
+    w.pair("flowMultiply",s.flowMultiply);
+    w.pair("numExtruder",(int)printer->extruderCount);
+    w.pair("firmware",s.firmware);
+    w.pair("firmwareURL",s.firmwareURL);
+    w.key("extruder");
+    w.startArray();
+    for(size_t i=0;i<s.extruder.size();i++) {
+        w.startObject();
+        w.pair("tempSet",s.extruder[i].tempSet);
+        w.pair("tempRead",s.extruder[i].tempRead);
+        w.pair("output",(int)s.extruder[i].output);
+        w.endObject();
     }
-    obj.push_back(Pair("extruder",ea));
+    w.endArray();
+    w.endObject();
 }
 void PrinterState::storePause() {
     pauseX = x-xOffset;
@@ -20,8 +20,10 @@
 #define __Repetier_Server__PrinterState__
 
 #include <iostream>
+#include <vector>
 #include <boost/thread.hpp>
 #include "json_spirit_value.h"
+#include "TemperatureHistory.h"
 #include <boost/cstdint.hpp>
 using namespace boost;
 
@@ -31,8 +33,52 @@ struct PrinterTemp {
     double tempRead;
     int8_t output;
 };
+/** Copy of all state values the web frontend shows. The serial thread
+ publishes a fresh copy after every change, so web threads read it without
+ ever touching the state mutex. */
+struct PrinterStateSnapshot {
+    int activeExtruder;
+    double x,y,z;
+    bool fanOn;
+    int fanVoltage;
+    bool powerOn;
+    int debugLevel;
+    bool hasXHome,hasYHome,hasZHome;
+    int layer;
+    bool sdcardMounted;
+    PrinterTemp bed;
+    int speedMultiply;
+    int flowMultiply;
+    std::string firmware;
+    std::string firmwareURL;
+    std::vector<PrinterTemp> extruder;
+    uint32_t serialStalls; ///< Times the serial thread had to wait for the state lock.
+    uint64_t serialStallMicros; ///< Total time the serial thread waited for the state lock.
+};
+/** Communication relevant facts about a response line. They are
+ collected in the same pass that updates the state. */
+struct ResponseInfo {
+    bool ok; ///< Line starts with ok
+    bool wait; ///< Line is a wait
+    bool start; ///< Line starts with start
+    int32_t resend; ///< Line number requested with Resend: or -1
+    // Marlin with ADVANCED_OK answers "ok N<line> P<planner> B<buffer>"
+    int32_t okLine; ///< Line acknowledged by the ok or -1
+    int32_t plannerFree; ///< Free planner slots or -1
+    int32_t bufferFree; ///< Free command buffer slots or -1
+};
+/** A response line pointing into the receive buffer of PrinterSerial.
+ Only valid until the dispatch of its read returns. */
+struct ResponseLine {
+    const char *text;
+    size_t length;
+    uint8_t rtype; ///< Log type, set by the analysis
+    ResponseInfo info;
+    ResponseLine(const char *t,size_t l):text(t),length(l),rtype(4) {}
+};
 class Printer;
 class GCode;
+class JSONWriter;
 /**
  The PrinterState stores variable values which are
  changed by sending commands or measured by external sensors
@@ -42,6 +88,11 @@ class GCode;
 class PrinterState {
     Printer *printer;
     boost::mutex mutex; // Used for thread safety
+    boost::mutex snapshotMutex; ///< Protects snapshot. Only held for copying.
+    PrinterStateSnapshot snapshot; ///< Last published state for readers.
+    volatile uint32_t snapshotDirty; ///< 1 if the last change could not be published yet. Only accessed with the Atomic.h operations.
+    uint32_t serialStalls; ///< Guarded by mutex, copied into snapshot on publish
+    uint64_t serialStallMicros; ///< Guarded by mutex, copied into snapshot on publish
     int activeExtruder;
     //float extruderTemp;
     bool uploading;
@@ -79,6 +130,22 @@ class PrinterState {
     int speedMultiply;
     int flowMultiply;
     PrinterTemp& getExtruder(int extruderId);
+    /** Copies the current values into snapshot. Must be called with mutex
+     locked. Never blocks - if a reader is copying the snapshot right now,
+     the update is marked dirty and published with the next change or by
+     the next reader. */
+    void publishSnapshot();
+    /** Locks mutex for the serial thread and records how long it had to wait. */
+    void lockMeasured(boost::mutex::scoped_lock &l);
+    /** Body of analyze. Expects mutex to be locked. */
+    void analyzeLocked(GCode &code);
+    /** Body of analyseResponse. Expects mutex to be locked.
+     @returns true if the line reported temperatures. */
+    bool analyseResponseLocked(const char *line,size_t len,uint8_t &rtype,ResponseInfo &info);
+    std::vector<TemperatureHistory::Heater> historySample; ///< Reused by recordTemperatures
+    /** Adds the current temperatures to the history of the printer. Expects
+     mutex to be locked. */
+    void recordTemperatures();
     
     double pauseX,pauseY,pauseZ,pauseE,pauseF;
     bool pauseRelative;
@@ -94,16 +161,28 @@ public:
     const PrinterTemp& getExtruder(int extruderId) const;
     /** Analyses the gcode and changes the status variables accordingly. */
     void analyze(GCode &code);
-    /** Analyse the response */
-    void analyseResponse(const std::string &res,uint8_t &rtype);
-    bool extract(const std::string& source,const std::string& ident,std::string &result);
+    /** Analyse the response in a single pass. Each token is dispatched on its
+     keyword, so the line is never rescanned per keyword.
+     @param res Response line without leading control characters.
+     @param rtype Response type, set to 2 for ack like responses.
+     @param info Communication flags found in the line.
+     */
+    void analyseResponse(const std::string &res,uint8_t &rtype,ResponseInfo &info);
+    /** Analyses lines in order with one lock and one snapshot publish.
+     Stops after a start line, because the caller resets the state then
+     and the following lines belong to the new session.
+     @returns Number of lines analysed, at least 1 if count>0. */
+    size_t analyseResponses(ResponseLine *lines,size_t count);
     /** Increases the line counter.
      @returns Increased line number. */
     uint32_t increaseLastline();
     uint32_t decreaseLastline();
     void setIsathome();
     uint32_t getLastline() {boost::mutex::scoped_lock l(mutex);return lastline;}
-    void fillJSONObject(json_spirit::Object &obj);
+    /** Returns a consistent copy of the state without waiting for the serial thread. */
+    void getSnapshot(PrinterStateSnapshot &s);
+    /** Writes the state snapshot as JSON object. */
+    void writeJSON(JSONWriter &w);
     std::string getMoveXCmd(double dx,double f);
     std::string getMoveYCmd(double dy,double f);
     std::string getMoveZCmd(double dz,double f);
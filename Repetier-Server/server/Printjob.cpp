@@ -26,6 +26,7 @@
 #include "printer.h"
 #include "global_config.h"
 #include "RLog.h"
+#include "JSONWriter.h"
 
 using namespace std;
 using namespace boost;
@@ -154,50 +155,56 @@ int PrintjobManager::decodeIdPart(std::string file) {
     else return -1;
     return atoi(name.c_str());
 }
-void PrintjobManager::fillSJONObject(std::string name,json_spirit::Object &o) {
+void PrintjobManager::writeJSON(const char *name,JSONWriter &w) {
     mutex::scoped_lock l(filesMutex);
-    using namespace json_spirit;
-    Array a;
+    w.key(name);
+    w.startArray();
     list<shared_ptr<Printjob> >::iterator it = files.begin(),ie = files.end();
     for(;it!=ie;it++) {
-        Object j;
         Printjob *job = (*it).get();
-        j.push_back(Pair("id",job->getId()));
-        j.push_back(Pair("name",job->getName()));
-        j.push_back(Pair("length",(int)job->getLength()));
+        w.startObject();
+        w.pair("id",job->getId());
+        w.pair("name",job->getName());
+        w.pair("length",(int)job->getLength());
         switch(job->getState()) {
             case Printjob::startUpload:
-                j.push_back(Pair("state","uploading"));
+                w.pair("state","uploading");
                 break;
             case Printjob::stored:
-                j.push_back(Pair("state","stored"));
+                w.pair("state","stored");
                 break;
             case Printjob::running:
-                j.push_back(Pair("state","running"));
-                j.push_back(Pair("done",job->percentDone()));
+                w.pair("state","running");
+                w.pair("done",job->percentDone());
                 break;
             case Printjob::finished:
-                j.push_back(Pair("state","finsihed"));
+                w.pair("state","finsihed");
                 break;
             case Printjob::doesNotExist:
-                j.push_back(Pair("state","error"));
+                w.pair("state","error");
                 break;
         }
-        a.push_back(j);
+        w.endObject();
     }
-    o.push_back(Pair(name,a));
+    w.endArray();
 }
-void PrintjobManager::getJobStatus(json_spirit::Object &obj) {
+void PrintjobManager::writeJobStatus(JSONWriter &w) {
     mutex::scoped_lock l(filesMutex);
-    using namespace json_spirit;
     Printjob *job = runningJob.get();
     if(job==NULL) {
-        obj.push_back(Pair("job","none"));
+        w.pair("job","none");
     } else {
-        obj.push_back(Pair("job",job->getName()));
-        obj.push_back(Pair("done",job->percentDone()));
+        w.pair("job",job->getName());
+        w.pair("done",job->percentDone());
     }
 }
+bool PrintjobManager::getJobProgress(double &percent) {
+    mutex::scoped_lock l(filesMutex);
+    Printjob *job = runningJob.get();
+    if(job==NULL) return false;
+    percent = job->percentDone();
+    return true;
+}
 PrintjobPtr PrintjobManager::findByIdInternal(int id) {
     pjlist::iterator it = files.begin(),ie=files.end();
     for(;it!=ie;it++) {
@@ -347,7 +354,7 @@ void PrintjobManager::pushCompleteJob(std::string name,bool beginning) {
     mutex::scoped_lock l(filesMutex);
     ifstream in;
     mutex::scoped_lock l2(printer->sendMutex);
-    std::deque<std::string> &list = ((*pj).getName()=="Pause" ? printer->manualCommands : printer->jobCommands);
+    std::deque<QueuedCommand> &list = ((*pj).getName()=="Pause" ? printer->manualCommands : printer->jobCommands);
     try {
         in.open(pj->getFilename().c_str(),ifstream::in);
         char buf[200];
@@ -362,9 +369,9 @@ void PrintjobManager::pushCompleteJob(std::string name,bool beginning) {
             if(!printer->shouldInjectCommand(cmd)) continue;
             line++;
             if(beginning) {
-                list.push_front(cmd);
+                list.push_front(QueuedCommand(cmd,LatencyHistogram::now()));
             } else {
-                list.push_back(cmd);
+                list.push_back(QueuedCommand(cmd,LatencyHistogram::now()));
             }
         }
         if(beginning) { // Reverse lines at beginning
@@ -378,7 +385,7 @@ void PrintjobManager::pushCompleteJobNoBlock(std::string name,bool beginning) {
     if(!pj.get()) return;
     mutex::scoped_lock l(filesMutex);
     ifstream in;
-    std::deque<std::string> &list = ((*pj).getName()=="Pause" ? printer->manualCommands : printer->jobCommands);
+    std::deque<QueuedCommand> &list = ((*pj).getName()=="Pause" ? printer->manualCommands : printer->jobCommands);
     try {
         in.open(pj->getFilename().c_str(),ifstream::in);
         char buf[200];
@@ -393,9 +400,9 @@ void PrintjobManager::pushCompleteJobNoBlock(std::string name,bool beginning) {
             if(!printer->shouldInjectCommand(cmd)) continue;
             line++;
             if(beginning) {
-                list.push_front(cmd);
+                list.push_front(QueuedCommand(cmd,LatencyHistogram::now()));
             } else {
-                list.push_back(cmd);
+                list.push_back(QueuedCommand(cmd,LatencyHistogram::now()));
             }
         }
         if(beginning) { // Reverse lines at beginning
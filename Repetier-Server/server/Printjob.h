@@ -30,6 +30,7 @@
 using namespace boost;
 
 class Printer;
+class JSONWriter;
 class Printjob {
 public:
     enum PrintjobState {startUpload,stored,running,finished,doesNotExist};
@@ -87,7 +88,8 @@ public:
     std::string encodeName(int id,std::string name,std::string postfix,bool withDir);
     static std::string decodeNamePart(std::string file);
     static int decodeIdPart(std::string file);
-    void fillSJONObject(std::string name,json_spirit::Object &o);
+    /** Writes the job list as array member name of the current JSON object. */
+    void writeJSON(const char *name,JSONWriter &w);
     PrintjobPtr findById(int id);
     PrintjobPtr findByName(std::string name);
     PrintjobPtr createNewPrintjob(std::string name);
@@ -104,7 +106,10 @@ public:
      undisrupted print. It will always queue up to 100 commands but no more
      then 10 commands for a call. */
     void manageJobs();
-    void getJobStatus(json_spirit::Object &obj);
+    /** Writes job and progress of the running job into the current JSON object. */
+    void writeJobStatus(JSONWriter &w);
+    /** Returns true if a job is running and stores its progress in percent. */
+    bool getJobProgress(double &percent);
     /** Pushes the complete content of a job to the job queue
      @param name Name of the printjob
      @param p Printer for output
@@ -0,0 +1,73 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
+#define _CRT_SECURE_NO_DEPRECATE
+#define _SCL_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <math.h>
+#include "PrometheusWriter.h"
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+#define snprintf _snprintf
+#endif
+
+using namespace std;
+
+PrometheusWriter::PrometheusWriter(string &buffer):buf(buffer) {
+    buf.clear();
+}
+void PrometheusWriter::header(const char *name,const char *type,const char *help) {
+    buf.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    buf.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+void PrometheusWriter::sample(const char *name,const string &labels,double value) {
+    buf.append(name);
+    if(!labels.empty()) {
+        buf+='{';
+        buf.append(labels);
+        buf+='}';
+    }
+    char b[40];
+    int l;
+    if(value==floor(value) && fabs(value)<9e15) // counters stay exact
+        l = snprintf(b,sizeof(b)," %.0f\n",value);
+    else
+        l = snprintf(b,sizeof(b)," %.10g\n",value);
+    buf.append(b,l);
+}
+void PrometheusWriter::metric(const char *name,const char *type,const char *help,double value) {
+    header(name,type,help);
+    sample(name,string(),value);
+}
+string PrometheusWriter::label(const char *name,const string &value) {
+    string l(name);
+    l.append("=\"");
+    for(size_t i=0;i<value.length();i++) {
+        char c = value[i];
+        if(c=='\\' || c=='"') {
+            l+='\\';
+            l+=c;
+        } else if(c=='\n')
+            l.append("\\n");
+        else
+            l+=c;
+    }
+    l+='"';
+    return l;
+}
@@ -0,0 +1,45 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__PrometheusWriter__
+#define __Repetier_Server__PrometheusWriter__
+
+#include <iostream>
+#include <string>
+
+/** Writes metrics in the Prometheus text exposition format into a string
+ buffer. All samples of a metric must follow its header, so callers with
+ several label sets write the header once and then all samples. */
+class PrometheusWriter {
+    std::string &buf;
+public:
+    PrometheusWriter(std::string &buffer);
+    /** Writes the HELP and TYPE lines of a metric.
+     @param type counter, gauge or histogram. */
+    void header(const char *name,const char *type,const char *help);
+    /** Writes one sample.
+     @param labels Label list without braces as built by label(), may be empty. */
+    void sample(const char *name,const std::string &labels,double value);
+    /** Writes header and a sample without labels. */
+    void metric(const char *name,const char *type,const char *help,double value);
+    /** Returns name="value" with the value escaped. */
+    static std::string label(const char *name,const std::string &value);
+    inline const std::string &str() {return buf;}
+};
+
+#endif /* defined(__Repetier_Server__PrometheusWriter__) */
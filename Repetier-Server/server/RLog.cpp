@@ -11,11 +11,36 @@
 #endif
 #include "RLog.h"
 #include "global_config.h"
-#if defined(_WIN32) && !defined(__SYMBIAN32__)
-#include <windows.h>
-#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <boost/thread.hpp>
+#include "Atomic.h"
 using namespace std;
 
+#define QUEUE_SLOTS 1024 // Must be a power of 2
+#define MESSAGE_BYTES 512
+#define WRITER_IDLE_MILLIS 2 // First writer sleep after the queue got empty
+#define WRITER_MAX_IDLE_MILLIS 64 // Sleep doubles up to this while nothing is logged
+
+/** One queued message. sequence tells producers and the writer who owns
+ the slot, see the bounded queue of Dmitry Vyukov. */
+struct LogSlot {
+    volatile uint32_t sequence;
+    bool err;
+    uint16_t length;
+    char text[MESSAGE_BYTES];
+};
+static LogSlot slots[QUEUE_SLOTS];
+static volatile uint32_t enqueuePos = 0;
+static uint32_t dequeuePos = 0; ///< Only used by the writer
+static volatile uint32_t queued = 0;
+static volatile uint32_t dropped = 0;
+static volatile bool writerRunning = false;
+static volatile bool writerStop = false;
+static boost::thread writer;
+
+volatile int RLog::maxLevel = RLog::LEVEL_INFO;
 RLog rlog;
 
 RLog::RLog() {
@@ -28,44 +53,182 @@ RLog::~RLog() {
    closelog ();
 #endif
 }
-void RLog::log(const std::string &line,bool err) {
+static void writeLine(const char *text,size_t length,bool err) {
     if(gconfig->daemon == false) {
-        cout << line << endl;
+        cout.write(text,length) << '\n';
         return;
     }
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
 	//if(err)
-		//WriteEventLogEntry(line.c_str(), EVENTLOG_ERROR_TYPE);
+		//WriteEventLogEntry(text, EVENTLOG_ERROR_TYPE);
 	//else
-		//WriteEventLogEntry(line.c_str(),  EVENTLOG_INFORMATION_TYPE);
+		//WriteEventLogEntry(text,  EVENTLOG_INFORMATION_TYPE);
 #endif
 #ifdef __unix
     if(err)
-        syslog (LOG_ERR, "%s",line.c_str());
+        syslog (LOG_ERR, "%.*s",(int)length,text);
     else
-        syslog (LOG_INFO,"%s", line.c_str());
+        syslog (LOG_INFO,"%.*s",(int)length,text);
 #endif
 }
-void RLog::log(const std::string &line,int val,bool err) {
-    string res;
+/** Claims the slot for the next message.
+ @returns NULL if the queue is full. */
+static LogSlot *claimSlot(uint32_t &pos) {
+    pos = enqueuePos;
+    for(;;) {
+        LogSlot *s = &slots[pos & (QUEUE_SLOTS-1)];
+        int32_t diff = (int32_t)(s->sequence-pos);
+        if(diff==0) {
+            if(CAS32(&enqueuePos,pos,pos+1)) return s;
+            pos = enqueuePos;
+        } else if(diff<0) { // Writer has not emptied the slot yet
+            FETCH_ADD32(&dropped,1);
+            return NULL;
+        } else
+            pos = enqueuePos; // Another thread claimed it first
+    }
+}
+/** Message being formatted, either in a queue slot or, while no writer
+ runs, in a stack buffer that is written at once. */
+class MessageBuffer {
+    LogSlot *slot;
+    uint32_t pos;
+    char local[MESSAGE_BYTES];
+    bool err;
+public:
+    char *text; ///< NULL if the message was dropped
+    size_t length;
+    MessageBuffer(bool e):slot(NULL),err(e),length(0) {
+        if(writerRunning) {
+            slot = claimSlot(pos);
+            text = slot!=NULL ? slot->text : NULL;
+        } else
+            text = local;
+    }
+    ~MessageBuffer() {
+        if(text==NULL) return;
+        if(slot==NULL) {
+            writeLine(text,length,err);
+            return;
+        }
+        slot->err = err;
+        slot->length = (uint16_t)length;
+        BARRIER(); // Text must be visible before the writer sees the slot
+        slot->sequence = pos+1;
+        FETCH_ADD32(&queued,1);
+    }
+    void append(const char *s,size_t n) {
+        n = min(n,MESSAGE_BYTES-1-length);
+        memcpy(text+length,s,n);
+        length += n;
+    }
+    void format(const char *f,va_list ap) {
+        int n = vsnprintf(text,MESSAGE_BYTES,f,ap);
+        length = n<0 ? 0 : min((size_t)n,(size_t)MESSAGE_BYTES-1);
+    }
+};
+/** Writes line with the first @ replaced by val. */
+static void logAt(const std::string &line,const char *val,size_t vlen,bool err) {
+    MessageBuffer m(err);
+    if(m.text==NULL) return;
     size_t p = line.find('@');
     if(p==string::npos) p = line.length();
-    res = line.substr(0,p)+intToString(val)+line.substr(min(p+1,line.length()));
-    log(res,err);
+    m.append(line.c_str(),p);
+    m.append(val,vlen);
+    if(p<line.length())
+        m.append(line.c_str()+p+1,line.length()-p-1);
+}
+static void writerLoop() {
+    uint32_t reportedDrops = dropped;
+    int idle = 0;
+    int sleepMillis = WRITER_IDLE_MILLIS;
+    for(;;) {
+        bool any = false;
+        for(;;) {
+            LogSlot *s = &slots[dequeuePos & (QUEUE_SLOTS-1)];
+            if((int32_t)(s->sequence-(dequeuePos+1))!=0) break; // Empty or not published yet
+            BARRIER();
+            writeLine(s->text,s->length,s->err);
+            BARRIER(); // Done reading before producers may reuse the slot
+            s->sequence = dequeuePos+QUEUE_SLOTS;
+            dequeuePos++;
+            any = true;
+        }
+        uint32_t d = dropped;
+        if(d!=reportedDrops) {
+            char b[80];
+            int n = sprintf(b,"error: Log queue full, %u messages dropped",(unsigned int)(d-reportedDrops));
+            writeLine(b,n,true);
+            reportedDrops = d;
+            any = true;
+        }
+        if(any) {
+            if(gconfig->daemon == false) cout.flush();
+            idle = 0;
+            sleepMillis = WRITER_IDLE_MILLIS;
+            continue;
+        }
+        // A producer may still fill a claimed slot, give it some time
+        if(writerStop && (dequeuePos==enqueuePos || ++idle>50)) break;
+        boost::this_thread::sleep(boost::posix_time::milliseconds(writerStop ? WRITER_IDLE_MILLIS : sleepMillis));
+        sleepMillis = min(2*sleepMillis,WRITER_MAX_IDLE_MILLIS);
+    }
+}
+void RLog::startWriter() {
+    if(writerRunning) return;
+    for(uint32_t i=0;i<QUEUE_SLOTS;i++)
+        slots[i].sequence = enqueuePos+i;
+    dequeuePos = enqueuePos;
+    writerStop = false;
+    boost::thread t(writerLoop);
+    writer.swap(t);
+    BARRIER();
+    writerRunning = true;
+}
+void RLog::stopWriter() {
+    if(!writerRunning) return;
+    writerRunning = false;
+    writerStop = true;
+    writer.join();
+}
+void RLog::setLevel(int level) {
+    maxLevel = level;
+}
+uint64_t RLog::queuedMessages() {
+    return queued;
+}
+uint64_t RLog::droppedMessages() {
+    return dropped;
+}
+void RLog::log(const std::string &line,bool err) {
+    if(!enabled(err ? LEVEL_ERROR : LEVEL_INFO)) return;
+    if(!writerRunning) {
+        writeLine(line.c_str(),line.length(),err);
+        return;
+    }
+    MessageBuffer m(err);
+    if(m.text!=NULL) m.append(line.c_str(),line.length());
+}
+void RLog::log(const std::string &line,int val,bool err) {
+    if(!enabled(err ? LEVEL_ERROR : LEVEL_INFO)) return;
+    char buf[16];
+    logAt(line,buf,sprintf(buf,"%d",val),err);
 }
 void RLog::log(const std::string &line,double val,bool err) {
-    string res;
-    size_t p = line.find('@');
+    if(!enabled(err ? LEVEL_ERROR : LEVEL_INFO)) return;
     char buf[40];
-    sprintf(buf,"%f",val);
-    if(p==string::npos) p = line.length();
-    res = line.substr(0,p)+static_cast<string>(buf)+line.substr(min(p+1,line.length()));
-    log(res,err);
+    logAt(line,buf,snprintf(buf,sizeof(buf),"%f",val),err);
 }
 void RLog::log(const std::string &line,const std::string& val,bool err) {
-    string res;
-    size_t p = line.find('@');
-    if(p==string::npos) p = line.length();
-    res = line.substr(0,p)+val+line.substr(min(p+1,line.length()));
-    log(res,err);
-}
\ No newline at end of file
+    if(!enabled(err ? LEVEL_ERROR : LEVEL_INFO)) return;
+    logAt(line,val.c_str(),val.length(),err);
+}
+void RLog::logf(int level,const char *format,...) {
+    if(!enabled(level)) return;
+    MessageBuffer m(level==LEVEL_ERROR);
+    if(m.text==NULL) return;
+    va_list ap;
+    va_start(ap,format);
+    m.format(format,ap);
+    va_end(ap);
+}
@@ -10,15 +10,53 @@
 #define __Repetier_Server__RLog__
 
 #include <iostream>
+#include <string>
+#include <boost/cstdint.hpp>
 
+#ifdef __GNUC__
+#define RLOG_PRINTF(f,a) __attribute__((format(printf,f,a)))
+#else
+#define RLOG_PRINTF(f,a)
+#endif
+
+/** Server log. Messages go to cout or, when running as daemon, to syslog.
+
+ Until startWriter is called, messages are written directly. After that
+ log only copies the message into a slot of a bounded lock free queue and
+ a background thread writes it, so a printer or web thread never waits for
+ the console or syslog. If the queue is full, the message is dropped and
+ counted. The writer reports the dropped messages with its next line.
+
+ The level is checked before formatting, so disabled messages cost no
+ formatting. Messages are formatted into the queue slot and cut at 511
+ characters. "@" in the line of the value overloads is replaced by the
+ value.
+ */
 class RLog {
+    static volatile int maxLevel;
 public:
+    enum {LEVEL_ERROR = 0,LEVEL_INFO = 1,LEVEL_DEBUG = 2};
     RLog();
     ~RLog();
     static void log(const std::string &line,bool err=false);
     static void log(const std::string &line,int val,bool err=false);
     static void log(const std::string &line,double val,bool err=false);
     static void log(const std::string &line,const std::string& val,bool err=false);
+    /** Logs a printf style message. */
+    static void logf(int level,const char *format,...) RLOG_PRINTF(2,3);
+    static inline bool enabled(int level) {return level<=maxLevel;}
+    /** Messages with a higher level are dropped. Default is LEVEL_INFO. */
+    static void setLevel(int level);
+    /** Starts the background writer. Call after forking into a daemon,
+     threads do not survive a fork. */
+    static void startWriter();
+    /** Writes all queued messages and stops the writer. Later messages
+     are written directly again. */
+    static void stopWriter();
+    /** Messages queued for the writer since start. */
+    static uint64_t queuedMessages();
+    /** Messages dropped because the queue was full. */
+    static uint64_t droppedMessages();
 };
 extern RLog rlog;
 
@@ -0,0 +1,99 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "SendWindow.h"
+#include "JSONWriter.h"
+#include <algorithm>
+
+using namespace std;
+
+#define RATE_LINES 64.0 // Lines averaged by the resend rate
+#define ACK_FAST 8.0 // Samples of the short ack latency average
+#define ACK_SLOW 256.0 // Samples of the long ack latency average
+#define ACK_RISING 1.5 // Short average above this times the long one pauses growing
+
+SendWindow::SendWindow(int size,int minSize) {
+    maximum = size;
+    minimum = min(minSize,size);
+    window = size;
+    resendRate = 0;
+    ackFast = ackSlow = 0;
+    lastResend = 0;
+    cleanLines = 0;
+    shrinks = grows = 0;
+}
+bool SendWindow::adjust(int to,const char *reason,uint64_t now) {
+    if(to==window) return false;
+    Adjustment a;
+    a.time = now;
+    a.from = window;
+    a.to = to;
+    a.reason = reason;
+    adjustments.push_back(a);
+    if(adjustments.size()>MAX_ADJUSTMENTS)
+        adjustments.pop_front();
+    window = to;
+    return true;
+}
+void SendWindow::acknowledged(uint64_t ackMicros,uint64_t now) {
+    resendRate -= resendRate/RATE_LINES;
+    if(ackSlow==0)
+        ackFast = ackSlow = (double)ackMicros;
+    else {
+        ackFast += ((double)ackMicros-ackFast)/ACK_FAST;
+        ackSlow += ((double)ackMicros-ackSlow)/ACK_SLOW;
+    }
+    if(window>=maximum || lastResend==0) return;
+    cleanLines++;
+    if(cleanLines<GROW_LINES || now-lastResend<GROW_MICROS || ackFast>ACK_RISING*ackSlow)
+        return;
+    if(adjust(min(maximum,window+max(1,maximum/8)),"grow",now))
+        grows++;
+    // The next step needs another clean period at the new size
+    lastResend = now;
+    cleanLines = 0;
+}
+void SendWindow::resend(uint64_t now) {
+    resendRate += 1.0/RATE_LINES;
+    // One resend in a clean link costs an eighth, a resend every few lines halves the window
+    double fraction = min(0.5,max(0.125,resendRate*4.0));
+    if(adjust(max(minimum,window-(int)(window*fraction)),"resend",now))
+        shrinks++;
+    lastResend = now;
+    cleanLines = 0;
+}
+void SendWindow::writeJSON(JSONWriter &w,uint64_t now) const {
+    w.pair("size",window);
+    w.pair("configured",maximum);
+    w.pair("minimum",minimum);
+    w.pair("resendRate",resendRate);
+    w.pair("ackFastMicros",ackFast);
+    w.pair("ackSlowMicros",ackSlow);
+    w.pair("shrinks",(double)shrinks);
+    w.pair("grows",(double)grows);
+    w.key("adjustments");
+    w.startArray();
+    for(deque<Adjustment>::const_iterator it=adjustments.begin();it!=adjustments.end();++it) {
+        w.startObject();
+        w.pair("secondsAgo",(double)(now-it->time)/1000000.0);
+        w.pair("from",it->from);
+        w.pair("to",it->to);
+        w.pair("reason",it->reason);
+        w.endObject();
+    }
+    w.endArray();
+}
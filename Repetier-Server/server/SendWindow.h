@@ -0,0 +1,83 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__SendWindow__
+#define __Repetier_Server__SendWindow__
+
+#include <iostream>
+#include <deque>
+#include <boost/cstdint.hpp>
+
+class JSONWriter;
+
+/** Number of bytes that may be sent to the firmware without an ok, if
+ the printer does not use pingpong mode.
+
+ The window starts at the configured readCacheSize. Each resend shrinks
+ it in proportion to the recent resend rate, never below minimum. After
+ a clean period without resends it grows back in steps of an eighth of
+ the configured size. Growing pauses while the recent ack latency rises
+ clearly above its long term average, because then the firmware buffer
+ is already the bottleneck and more bytes in flight only add delay.
+ Not thread safe, the owner has to lock.
+ */
+class SendWindow {
+public:
+    /** One change of the window size. */
+    struct Adjustment {
+        uint64_t time; ///< LatencyHistogram::now() of the change
+        int from;
+        int to;
+        const char *reason; ///< "resend" or "grow"
+    };
+    enum {MAX_ADJUSTMENTS = 32, ///< Adjustments kept for the API
+        GROW_LINES = 256, ///< Acknowledged lines without resend before growing
+        GROW_MICROS = 10000000 ///< Time without resend before growing
+    };
+private:
+    int maximum; ///< Configured readCacheSize
+    int minimum;
+    int window;
+    double resendRate; ///< Moving average of resends per acknowledged line
+    double ackFast; ///< Short moving average of the ack latency in us
+    double ackSlow; ///< Long moving average of the ack latency in us
+    uint64_t lastResend; ///< Time of the last resend or adjustment, 0 if none
+    int cleanLines; ///< Lines acknowledged since lastResend
+    uint64_t shrinks;
+    uint64_t grows;
+    std::deque<Adjustment> adjustments;
+    /** @returns false if the window already had size to. */
+    bool adjust(int to,const char *reason,uint64_t now);
+public:
+    /** @param size Configured receive buffer of the firmware.
+     @param minSize Lower limit for the window, capped at size. */
+    SendWindow(int size,int minSize);
+    inline int size() const {return window;}
+    inline int configured() const {return maximum;}
+    /** Call for each ok of a sent line. Grows the window after a clean
+     period.
+     @param ackMicros Time from writing the line to its ok. */
+    void acknowledged(uint64_t ackMicros,uint64_t now);
+    /** Call for each resend request. Shrinks the window. */
+    void resend(uint64_t now);
+    /** Writes size, limits, rates and the recent adjustments as members of
+     the current JSON object. */
+    void writeJSON(JSONWriter &w,uint64_t now) const;
+};
+
+#endif /* defined(__Repetier_Server__SendWindow__) */
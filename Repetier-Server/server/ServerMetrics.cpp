@@ -0,0 +1,162 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ServerMetrics.h"
+#include "JSONWriter.h"
+#include "PrometheusWriter.h"
+#include "LatencyHistogram.h"
+#include "RLog.h"
+#include "mongoose.h"
+#include <map>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static boost::mutex metricsMutex;
+static uint32_t requests = 0; ///< Dynamic requests handled
+static uint32_t connections = 0; ///< Connections with at least one dynamic request first
+static uint32_t reusedRequests = 0; ///< Requests arriving on an already used connection
+static uint32_t keepAliveResponses = 0;
+static uint32_t closeResponses = 0;
+static uint32_t staticNotModified = 0;
+static uint32_t staticGzip = 0;
+static uint32_t staticPlain = 0;
+static uint32_t gzipResponses = 0;
+static uint64_t gzipRawBytes = 0;
+static uint64_t gzipBytes = 0;
+static uint64_t gzipMicros = 0;
+static struct mg_context *webContext = NULL;
+/** Groups come from the request, so the number of series is capped. */
+#define MAX_CMDGROUPS 32
+static map<string,LatencyHistogram> cmdgroupTimes;
+
+void ServerMetrics::countRequest(int requestOnConnection) {
+    boost::mutex::scoped_lock l(metricsMutex);
+    requests++;
+    if(requestOnConnection>1)
+        reusedRequests++;
+    else
+        connections++;
+}
+void ServerMetrics::countKeepAliveResponse() {
+    boost::mutex::scoped_lock l(metricsMutex);
+    keepAliveResponses++;
+}
+void ServerMetrics::countCloseResponse() {
+    boost::mutex::scoped_lock l(metricsMutex);
+    closeResponses++;
+}
+void ServerMetrics::countStaticResponse(bool notModified,bool gzip) {
+    boost::mutex::scoped_lock l(metricsMutex);
+    if(notModified)
+        staticNotModified++;
+    else if(gzip)
+        staticGzip++;
+    else
+        staticPlain++;
+}
+void ServerMetrics::countGzipResponse(size_t rawBytes,size_t zippedBytes,boost::int64_t micros) {
+    boost::mutex::scoped_lock l(metricsMutex);
+    gzipResponses++;
+    gzipRawBytes += rawBytes;
+    gzipBytes += zippedBytes;
+    gzipMicros += micros;
+}
+void ServerMetrics::countCmdgroup(const string &group,boost::int64_t micros) {
+    boost::mutex::scoped_lock l(metricsMutex);
+    map<string,LatencyHistogram>::iterator it = cmdgroupTimes.find(group);
+    if(it==cmdgroupTimes.end()) {
+        if(cmdgroupTimes.size()<MAX_CMDGROUPS)
+            it = cmdgroupTimes.insert(make_pair(group,LatencyHistogram())).first;
+        else
+            it = cmdgroupTimes.insert(make_pair(string("other"),LatencyHistogram())).first;
+    }
+    it->second.record(micros<0 ? 0 : (uint64_t)micros);
+}
+void ServerMetrics::setWebContext(struct mg_context *ctx) {
+    webContext = ctx;
+}
+void ServerMetrics::writeJSON(JSONWriter &w) {
+    if(webContext!=NULL) {
+        struct mg_stats s;
+        mg_get_stats(webContext,&s);
+        w.pair("webThreads",s.num_threads);
+        w.pair("webBusyThreads",s.busy_threads);
+        w.pair("webQueueSize",s.queue_size);
+        w.pair("webQueueDepth",s.queue_depth);
+        w.pair("webQueuePeak",s.queue_peak);
+        w.pair("webAccepted",(double)s.accepted);
+        w.pair("webRejectedAccepts",(double)s.rejected_accepts);
+        w.pair("webFailedAccepts",(double)s.failed_accepts);
+        w.pair("webBlockedAccepts",(double)s.blocked_accepts);
+        w.pair("webQueueWaitMicros",(double)s.queue_wait_usec);
+        w.pair("webQueueWaitMaxMicros",(double)s.queue_wait_max_usec);
+    }
+    boost::mutex::scoped_lock l(metricsMutex);
+    w.pair("httpRequests",requests);
+    w.pair("httpConnections",connections);
+    w.pair("httpKeepAliveReused",reusedRequests);
+    w.pair("httpKeepAliveResponses",keepAliveResponses);
+    w.pair("httpCloseResponses",closeResponses);
+    w.pair("staticNotModified",staticNotModified);
+    w.pair("staticGzip",staticGzip);
+    w.pair("staticPlain",staticPlain);
+    w.pair("gzipResponses",gzipResponses);
+    w.pair("gzipRawBytes",(double)gzipRawBytes);
+    w.pair("gzipBytes",(double)gzipBytes);
+    w.pair("gzipMicros",(double)gzipMicros);
+    w.pair("gzipRatio",gzipRawBytes>0 ? (double)gzipBytes/(double)gzipRawBytes : 1.0);
+    w.pair("logQueued",RLog::queuedMessages());
+    w.pair("logDropped",RLog::droppedMessages());
+}
+void ServerMetrics::writePrometheus(PrometheusWriter &w) {
+    if(webContext!=NULL) {
+        struct mg_stats s;
+        mg_get_stats(webContext,&s);
+        w.metric("repetier_web_threads","gauge","Worker threads of the web server.",s.num_threads);
+        w.metric("repetier_web_busy_threads","gauge","Worker threads handling a connection.",s.busy_threads);
+        w.metric("repetier_web_queue_size","gauge","Capacity of the accepted socket queue.",s.queue_size);
+        w.metric("repetier_web_queue_depth","gauge","Accepted sockets waiting for a worker.",s.queue_depth);
+        w.metric("repetier_web_queue_peak","gauge","Highest queue depth seen.",s.queue_peak);
+        w.metric("repetier_web_accepted_total","counter","Accepted connections.",(double)s.accepted);
+        w.metric("repetier_web_rejected_accepts_total","counter","Connections rejected by the access list.",(double)s.rejected_accepts);
+        w.metric("repetier_web_failed_accepts_total","counter","Failed accept calls.",(double)s.failed_accepts);
+        w.metric("repetier_web_blocked_accepts_total","counter","Accepts that had to wait for a free queue slot.",(double)s.blocked_accepts);
+        w.metric("repetier_web_queue_wait_seconds_total","counter","Time accepted sockets spent in the queue.",(double)s.queue_wait_usec/1000000.0);
+        w.metric("repetier_web_queue_wait_max_seconds","gauge","Longest time a socket spent in the queue.",(double)s.queue_wait_max_usec/1000000.0);
+    }
+    boost::mutex::scoped_lock l(metricsMutex);
+    w.metric("repetier_http_requests_total","counter","Dynamic requests handled.",requests);
+    w.metric("repetier_http_connections_total","counter","Connections whose first request was dynamic.",connections);
+    w.metric("repetier_http_keepalive_reused_total","counter","Dynamic requests on an already used connection.",reusedRequests);
+    w.header("repetier_http_responses_total","counter","Dynamic responses by connection handling.");
+    w.sample("repetier_http_responses_total",PrometheusWriter::label("connection","keep-alive"),keepAliveResponses);
+    w.sample("repetier_http_responses_total",PrometheusWriter::label("connection","close"),closeResponses);
+    w.header("repetier_static_responses_total","counter","Responses from the static file cache.");
+    w.sample("repetier_static_responses_total",PrometheusWriter::label("kind","not_modified"),staticNotModified);
+    w.sample("repetier_static_responses_total",PrometheusWriter::label("kind","gzip"),staticGzip);
+    w.sample("repetier_static_responses_total",PrometheusWriter::label("kind","plain"),staticPlain);
+    w.metric("repetier_gzip_responses_total","counter","Compressed dynamic responses.",gzipResponses);
+    w.metric("repetier_gzip_raw_bytes_total","counter","Dynamic response bytes before compression.",(double)gzipRawBytes);
+    w.metric("repetier_gzip_bytes_total","counter","Dynamic response bytes after compression.",(double)gzipBytes);
+    w.metric("repetier_gzip_seconds_total","counter","Time spent compressing dynamic responses.",(double)gzipMicros/1000000.0);
+    w.metric("repetier_log_queued_total","counter","Log messages queued for the log writer.",(double)RLog::queuedMessages());
+    w.metric("repetier_log_dropped_total","counter","Log messages dropped because the log queue was full.",(double)RLog::droppedMessages());
+    w.header("repetier_http_request_duration_seconds","histogram","Duration of dynamic requests by command group.");
+    for(map<string,LatencyHistogram>::iterator it=cmdgroupTimes.begin();it!=cmdgroupTimes.end();++it)
+        it->second.writePrometheus(w,"repetier_http_request_duration_seconds",PrometheusWriter::label("cmdgroup",it->first));
+}
@@ -0,0 +1,63 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__ServerMetrics__
+#define __Repetier_Server__ServerMetrics__
+
+#include <iostream>
+#include <string>
+#include <boost/cstdint.hpp>
+
+class JSONWriter;
+class PrometheusWriter;
+struct mg_context;
+
+/** Collects counters about the web server. All methods are thread safe.
+ The counters only grow, clients compute rates from the difference of
+ two reads. */
+class ServerMetrics {
+public:
+    /** Count a dynamic request.
+     @param requestOnConnection Number of the request on its connection, 1 for the first. */
+    static void countRequest(int requestOnConnection);
+    /** Count a dynamic response that allows the client to keep the connection open. */
+    static void countKeepAliveResponse();
+    /** Count a dynamic response that forces the client to close the connection. */
+    static void countCloseResponse();
+    /** Count a response from the static file cache.
+     @param notModified Answered with 304.
+     @param gzip Sent the compressed variant. */
+    static void countStaticResponse(bool notModified,bool gzip);
+    /** Count a compressed dynamic response.
+     @param rawBytes Size before compression.
+     @param gzipBytes Size after compression.
+     @param micros Time spent compressing. */
+    static void countGzipResponse(size_t rawBytes,size_t gzipBytes,boost::int64_t micros);
+    /** Records the duration of a dynamic request.
+     @param group Command group of the request, "page" for rendered pages.
+     @param micros Time from routing the request to the sent response. */
+    static void countCmdgroup(const std::string &group,boost::int64_t micros);
+    /** Sets the web server whose worker pool counters are reported. */
+    static void setWebContext(struct mg_context *ctx);
+    /** Writes all counters as members of the current JSON object. */
+    static void writeJSON(JSONWriter &w);
+    /** Writes all counters and request durations in text exposition format. */
+    static void writePrometheus(PrometheusWriter &w);
+};
+
+#endif /* defined(__Repetier_Server__ServerMetrics__) */
@@ -0,0 +1,164 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
+#define _CRT_SECURE_NO_DEPRECATE
+#define _SCL_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <fstream>
+#include "StaticFileCache.h"
+#include "GzipEncoder.h"
+#include "mongoose.h"
+#include "WebserverAPI.h"
+#include "ServerMetrics.h"
+#include "RLog.h"
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace boost::filesystem;
+
+#define STATIC_MAX_AGE 604800 // Seconds browsers may use a file without asking
+#define STATIC_MAX_FILE_SIZE 8388608 // Larger files are left to mongoose
+
+struct StaticFile {
+    string path; ///< Full file name
+    const char *mime;
+    string etag; ///< Strong ETag including quotes
+    string etagGzip; ///< Strong ETag of the compressed variant
+    string lastModified;
+    time_t mtime;
+    uintmax_t size;
+    string gzip; ///< Compressed content, empty if compression does not pay
+};
+/** Files by uri. Filled by build before the web server starts and only
+ read afterwards, so lookups need no lock. */
+static map<string,StaticFile> files;
+
+static bool isCompressible(const char *mime) {
+    return strncmp(mime,"text/",5)==0 || strstr(mime,"javascript")!=NULL ||
+        strstr(mime,"json")!=NULL || strstr(mime,"xml")!=NULL;
+}
+static string contentETag(const string &content) {
+    // 64 bit FNV-1a over the content
+    boost::uint64_t h = 14695981039346656037ULL;
+    for(size_t i=0;i<content.length();i++) {
+        h ^= (unsigned char)content[i];
+        h *= 1099511628211ULL;
+    }
+    char b[48];
+    sprintf(b,"\"%08x%08x-%x\"",(unsigned int)(h>>32),(unsigned int)h,(unsigned int)content.length());
+    return string(b);
+}
+void StaticFileCache::build(const string &root) {
+    files.clear();
+    if(!exists(root)) return;
+    GzipEncoder encoder(Z_BEST_COMPRESSION);
+    string content;
+    size_t rawBytes = 0,gzipBytes = 0;
+    for(recursive_directory_iterator itr(root),end_itr;itr!=end_itr;++itr) {
+        const path &p = itr->path();
+        if(!is_regular_file(itr->status()) || p.extension()==".php") continue;
+        StaticFile f;
+        f.path = p.string();
+        string uri = f.path.substr(root.length());
+        for(size_t i=0;i<uri.length();i++)
+            if(uri[i]=='\\') uri[i] = '/';
+        if(uri.length()==0 || uri[0]!='/') uri = "/"+uri;
+        if(uri.find("/.")!=string::npos) continue; // hidden files and directories
+        f.size = file_size(p);
+        if(f.size>STATIC_MAX_FILE_SIZE) continue;
+        struct stat st;
+        if(stat(f.path.c_str(),&st)!=0) continue;
+        f.mtime = st.st_mtime;
+        std::ifstream in(f.path.c_str(),ios::in | ios::binary);
+        if(!in.good()) continue;
+        content.resize((size_t)f.size);
+        if(f.size>0) in.read(&content[0],content.size());
+        if((uintmax_t)in.gcount()!=f.size) continue;
+        f.etag = contentETag(content);
+        char b[64];
+        strftime(b,sizeof(b),"%a, %d %b %Y %H:%M:%S GMT",gmtime(&f.mtime));
+        f.lastModified = b;
+        f.mime = mg_get_builtin_mime_type(f.path.c_str());
+        if(isCompressible(f.mime) && encoder.compress(content.c_str(),content.length(),f.gzip)) {
+            if(f.gzip.length()>content.length()-content.length()/10)
+                f.gzip.clear();
+            else {
+                f.etagGzip = f.etag.substr(0,f.etag.length()-1)+"-gz\"";
+                rawBytes+=content.length();
+                gzipBytes+=f.gzip.length();
+            }
+        }
+        files[uri] = f;
+    }
+    RLog::log("Static files cached: @",(int)files.size());
+    RLog::log("Static files compressed to kB: @",(int)(gzipBytes/1024));
+    RLog::log("Static files uncompressed kB: @",(int)(rawBytes/1024));
+}
+bool StaticFileCache::serve(struct mg_connection *conn) {
+    const struct mg_request_info *ri = mg_get_request_info(conn);
+    bool head = strcmp(ri->request_method,"HEAD")==0;
+    if(!head && strcmp(ri->request_method,"GET")!=0) return false;
+    if(mg_get_header(conn,"Range")!=NULL) return false; // Leave partial content to mongoose
+    map<string,StaticFile>::const_iterator it = files.find(ri->uri);
+    if(it==files.end()) return false;
+    const StaticFile &f = it->second;
+    bool keepAlive = repetier::clientKeepsAlive(conn);
+    const char *vary = f.gzip.empty() ? "" : "Vary: Accept-Encoding\r\n";
+    bool gzip = !f.gzip.empty() && repetier::clientAcceptsGzip(conn);
+    const string &etag = gzip ? f.etagGzip : f.etag;
+    // A file replaced after startup is served by mongoose. Checked before the
+    // 304, else browsers would keep the old content for STATIC_MAX_AGE.
+    struct stat st;
+    if(stat(f.path.c_str(),&st)!=0 || st.st_mtime!=f.mtime || (uintmax_t)st.st_size!=f.size)
+        return false;
+    const char *inm = mg_get_header(conn,"If-None-Match");
+    if(inm!=NULL && (strstr(inm,etag.c_str())!=NULL || strcmp(inm,"*")==0)) {
+        mg_printf(conn,"HTTP/1.1 304 Not Modified\r\n"
+                  "Server: Repetier-Server\r\n"
+                  "ETag: %s\r\n"
+                  "Cache-Control: public, max-age=%d\r\n"
+                  "%s"
+                  "Connection: %s\r\n\r\n",etag.c_str(),STATIC_MAX_AGE,vary,keepAlive ? "keep-alive" : "close");
+        ServerMetrics::countStaticResponse(true,false);
+        return true;
+    }
+    mg_printf(conn,"HTTP/1.1 200 OK\r\n"
+              "Server: Repetier-Server\r\n"
+              "Content-Type: %s\r\n"
+              "Content-Length: %lu\r\n"
+              "ETag: %s\r\n"
+              "Last-Modified: %s\r\n"
+              "Cache-Control: public, max-age=%d\r\n"
+              "%s%s"
+              "Connection: %s\r\n\r\n",f.mime,(unsigned long)(gzip ? f.gzip.length() : f.size),
+              etag.c_str(),f.lastModified.c_str(),STATIC_MAX_AGE,vary,
+              gzip ? "Content-Encoding: gzip\r\n" : "",keepAlive ? "keep-alive" : "close");
+    if(!head) {
+        if(gzip)
+            mg_write(conn,f.gzip.c_str(),f.gzip.length());
+        else
+            mg_write_file(conn,f.path.c_str());
+    }
+    ServerMetrics::countStaticResponse(false,gzip);
+    return true;
+}
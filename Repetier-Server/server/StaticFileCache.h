@@ -0,0 +1,50 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__StaticFileCache__
+#define __Repetier_Server__StaticFileCache__
+
+#include <iostream>
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+struct mg_connection;
+
+/** Serves the static files of the web directory.
+
+ At startup every file except pages is read once to compute a strong ETag
+ from its content. Text files that compress well also keep a gzip copy in
+ memory. Requests with a matching If-None-Match are answered with 304
+ without reading the file. Other requests get the gzip copy if the client
+ accepts it, else the file is sent with sendfile.
+
+ The cache is built once before the web server starts and is read only
+ afterwards. Every request stats the file first, files that changed on disk
+ since are passed to mongoose.
+ */
+class StaticFileCache {
+public:
+    /** Scans the web directory and builds the cache. Must be called before
+     the web server starts. */
+    static void build(const std::string &root);
+    /** Answers a GET or HEAD request for a cached file.
+     @returns true if the request was answered. */
+    static bool serve(struct mg_connection *conn);
+};
+
+#endif /* defined(__Repetier_Server__StaticFileCache__) */
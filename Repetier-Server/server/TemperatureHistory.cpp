@@ -0,0 +1,332 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "TemperatureHistory.h"
+#include "LatencyHistogram.h"
+#include "JSONWriter.h"
+#include "RLog.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace std;
+using namespace boost;
+
+#define HISTORY_MAGIC "RTH1"
+#define HISTORY_VERSION 1
+#define HEADER_SIZE (16+16*TIER_COUNT)
+#define FLUSH_MICROS 30000000 // Time between two flushes of flushIfDue
+
+static const uint32_t tierResolution[] = {1000,10000,60000};
+static const uint32_t tierSlots[] = {600,8640,43200}; // 10 minutes, 24 hours, 30 days
+static const char *tierNames[] = {"raw","10s","1min"};
+
+static void appendInt(vector<char> &buf,uint32_t v) {
+    buf.insert(buf.end(),(char*)&v,(char*)&v+4);
+}
+static uint32_t readInt(const char *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+}
+
+TemperatureHistory::TemperatureHistory(const string &file,int heaterCount) {
+    filename = file;
+    heaters = heaterCount;
+    recordSize = 8+heaters*sizeof(Heater);
+    for(int t=0;t<TIER_COUNT;t++) {
+        Ring &r = rings[t];
+        r.resolution = tierResolution[t];
+        r.slots = tierSlots[t];
+        r.head = r.count = 0;
+        r.data.resize(r.slots*recordSize);
+        r.dirtyFirst = r.dirtyCount = 0;
+        r.bucket = 0;
+        r.sums.resize(heaters*3);
+        r.samples = 0;
+    }
+    average.resize(heaters);
+    nextFlush = 0;
+    if(!load())
+        create();
+}
+TemperatureHistory::~TemperatureHistory() {
+    flush();
+}
+uint64_t TemperatureHistory::nowMillis() {
+    static const posix_time::ptime epoch(gregorian::date(1970,1,1));
+    return (uint64_t)(posix_time::microsec_clock::universal_time()-epoch).total_milliseconds();
+}
+uint64_t TemperatureHistory::recordTime(Ring &r,uint32_t slot) {
+    uint64_t t;
+    memcpy(&t,record(r,slot),8);
+    return t;
+}
+size_t TemperatureHistory::fileOffset(int tier,uint32_t slot) {
+    size_t offset = HEADER_SIZE;
+    for(int t=0;t<tier;t++)
+        offset += (size_t)rings[t].slots*recordSize;
+    return offset+(size_t)slot*recordSize;
+}
+void TemperatureHistory::writeHeader(vector<char> &buf) {
+    buf.insert(buf.end(),HISTORY_MAGIC,HISTORY_MAGIC+4);
+    appendInt(buf,HISTORY_VERSION);
+    appendInt(buf,heaters);
+    appendInt(buf,TIER_COUNT);
+    for(int t=0;t<TIER_COUNT;t++) {
+        appendInt(buf,rings[t].resolution);
+        appendInt(buf,rings[t].slots);
+        appendInt(buf,rings[t].head);
+        appendInt(buf,rings[t].count);
+    }
+}
+bool TemperatureHistory::load() {
+    file.open(filename.c_str(),ios::in | ios::out | ios::binary);
+    if(!file.is_open()) return false;
+    char h[HEADER_SIZE];
+    file.read(h,HEADER_SIZE);
+    if(file.gcount()!=HEADER_SIZE || memcmp(h,HISTORY_MAGIC,4)!=0 || readInt(h+4)!=HISTORY_VERSION ||
+       readInt(h+8)!=(uint32_t)heaters || readInt(h+12)!=TIER_COUNT) {
+        file.close();
+        return false;
+    }
+    for(int t=0;t<TIER_COUNT;t++) {
+        Ring &r = rings[t];
+        const char *p = h+16+16*t;
+        uint32_t head = readInt(p+8),count = readInt(p+12);
+        if(readInt(p)!=r.resolution || readInt(p+4)!=r.slots || head>=r.slots || count>r.slots) {
+            file.close();
+            return false;
+        }
+        r.head = head;
+        r.count = count;
+    }
+    for(int t=0;t<TIER_COUNT;t++) {
+        file.read(&rings[t].data[0],rings[t].data.size());
+        if((size_t)file.gcount()!=rings[t].data.size()) {
+            file.close();
+            for(int i=0;i<TIER_COUNT;i++)
+                rings[i].head = rings[i].count = 0;
+            return false;
+        }
+    }
+    return true;
+}
+void TemperatureHistory::create() {
+    {
+        ofstream out(filename.c_str(),ios::out | ios::trunc | ios::binary);
+        vector<char> h;
+        writeHeader(h);
+        out.write(&h[0],h.size());
+        for(int t=0;t<TIER_COUNT;t++)
+            out.write(&rings[t].data[0],rings[t].data.size());
+        if(!out.good()) {
+            RLog::log("error: Could not create temperature history @",filename);
+            return;
+        }
+    }
+    file.open(filename.c_str(),ios::in | ios::out | ios::binary);
+}
+void TemperatureHistory::markDirty(Ring &r,uint32_t slot) {
+    if(r.dirtyCount==0) {
+        r.dirtyFirst = slot;
+        r.dirtyCount = 1;
+    } else if((slot+r.slots-r.dirtyFirst)%r.slots>=r.dirtyCount) // Slots are written in ring order
+        r.dirtyCount = min(r.slots,r.dirtyCount+1);
+}
+void TemperatureHistory::store(Ring &r,uint64_t time,const Heater *values) {
+    uint32_t slot = r.head;
+    if(r.count>0) {
+        uint32_t last = (r.head+r.slots-1)%r.slots;
+        // Faster samples or a clock set back update the last record and keep its time
+        if(time<recordTime(r,last)+r.resolution) {
+            memcpy(record(r,last)+8,values,heaters*sizeof(Heater));
+            markDirty(r,last);
+            return;
+        }
+    }
+    memcpy(record(r,slot),&time,8);
+    memcpy(record(r,slot)+8,values,heaters*sizeof(Heater));
+    markDirty(r,slot);
+    r.head = (r.head+1)%r.slots;
+    if(r.count<r.slots) r.count++;
+}
+void TemperatureHistory::storeAverage(Ring &r) {
+    for(int h=0;h<heaters;h++) {
+        average[h].set = (float)(r.sums[3*h]/r.samples);
+        average[h].read = (float)(r.sums[3*h+1]/r.samples);
+        average[h].output = (float)(r.sums[3*h+2]/r.samples);
+    }
+    store(r,r.bucket,&average[0]);
+    r.samples = 0;
+}
+void TemperatureHistory::add(uint64_t time,const Heater *values) {
+    mutex::scoped_lock l(mutex);
+    store(rings[TIER_RAW],time,values);
+    for(int t=TIER_RAW+1;t<TIER_COUNT;t++) {
+        Ring &r = rings[t];
+        uint64_t bucket = time-time%r.resolution;
+        if(r.samples>0 && bucket!=r.bucket)
+            storeAverage(r);
+        if(r.samples==0) {
+            r.bucket = bucket;
+            fill(r.sums.begin(),r.sums.end(),0.0);
+        }
+        for(int h=0;h<heaters;h++) {
+            r.sums[3*h] += values[h].set;
+            r.sums[3*h+1] += values[h].read;
+            r.sums[3*h+2] += values[h].output;
+        }
+        r.samples++;
+    }
+}
+void TemperatureHistory::flush() {
+    mutex::scoped_lock fl(fileMutex);
+    flushBuffer.clear();
+    flushRanges.clear();
+    {
+        mutex::scoped_lock l(mutex);
+        bool dirty = false;
+        for(int t=0;t<TIER_COUNT;t++)
+            dirty |= rings[t].dirtyCount>0;
+        if(!dirty) return;
+        writeHeader(flushBuffer);
+        flushRanges.push_back(pair<size_t,size_t>(0,flushBuffer.size()));
+        for(int t=0;t<TIER_COUNT;t++) {
+            Ring &r = rings[t];
+            uint32_t first = r.dirtyFirst,count = r.dirtyCount;
+            while(count>0) { // At most two parts if the range wraps
+                uint32_t n = min(count,r.slots-first);
+                flushRanges.push_back(pair<size_t,size_t>(fileOffset(t,first),n*recordSize));
+                flushBuffer.insert(flushBuffer.end(),record(r,first),record(r,first)+n*recordSize);
+                first = (first+n)%r.slots;
+                count -= n;
+            }
+            r.dirtyCount = 0;
+        }
+    }
+    if(!file.is_open()) return;
+    size_t pos = 0;
+    for(size_t i=0;i<flushRanges.size();i++) {
+        file.seekp(flushRanges[i].first);
+        file.write(&flushBuffer[pos],flushRanges[i].second);
+        pos += flushRanges[i].second;
+    }
+    file.flush();
+    if(!file.good()) {
+        RLog::log("error: Writing temperature history @ failed",filename);
+        file.clear();
+    }
+}
+void TemperatureHistory::flushIfDue() {
+    uint64_t now = LatencyHistogram::now();
+    if(now<nextFlush) return;
+    nextFlush = now+FLUSH_MICROS;
+    flush();
+}
+void TemperatureHistory::close() {
+    {
+        mutex::scoped_lock l(mutex);
+        for(int t=TIER_RAW+1;t<TIER_COUNT;t++)
+            if(rings[t].samples>0)
+                storeAverage(rings[t]);
+    }
+    flush();
+}
+uint32_t TemperatureHistory::lowerBound(Ring &r,uint64_t t) {
+    uint32_t lo = 0,hi = r.count;
+    while(lo<hi) {
+        uint32_t mid = (lo+hi)/2;
+        if(recordTime(r,slotOf(r,mid))<t) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+void TemperatureHistory::writeJSON(JSONWriter &w,uint64_t from,uint64_t to,int maxPoints,int tier) {
+    if(maxPoints<1) maxPoints = 1;
+    if(tier<0 || tier>=TIER_COUNT) {
+        uint64_t now = nowMillis();
+        for(tier=TIER_RAW;tier<TIER_COUNT-1;tier++)
+            if(from+(uint64_t)rings[tier].slots*rings[tier].resolution>=now) break;
+    }
+    // Averaged points are collected under the lock and written without it.
+    // Each point is the time followed by set, read and output of all heaters.
+    size_t stride = 1+3*heaters;
+    vector<double> points;
+    {
+        mutex::scoped_lock l(mutex);
+        Ring &r = rings[tier];
+        uint32_t first = lowerBound(r,from),last = lowerBound(r,to+1);
+        uint32_t n = last>first ? last-first : 0;
+        uint32_t step = (n+maxPoints-1)/maxPoints;
+        points.reserve((n+step-1)/max(step,1u)*stride);
+        for(uint32_t i=first;i<last;i+=step) {
+            uint32_t end = min(last,i+step);
+            size_t p = points.size();
+            points.resize(p+stride,0.0);
+            for(uint32_t j=i;j<end;j++) {
+                uint32_t slot = slotOf(r,j);
+                points[p] += (double)recordTime(r,slot);
+                const char *v = record(r,slot)+8;
+                for(int h=0;h<heaters;h++) {
+                    Heater ht;
+                    memcpy(&ht,v+h*sizeof(Heater),sizeof(Heater));
+                    points[p+1+h] += ht.set;
+                    points[p+1+heaters+h] += ht.read;
+                    points[p+1+2*heaters+h] += ht.output;
+                }
+            }
+            for(size_t k=p;k<p+stride;k++)
+                points[k] /= (end-i);
+        }
+    }
+    size_t count = points.size()/stride;
+    // Times are relative to start in seconds, absolute milliseconds do not fit the number format
+    double start = count>0 ? floor(points[0]/1000.0) : 0;
+    w.pair("tier",tierNames[tier]);
+    w.pair("resolution",rings[tier].resolution/1000.0);
+    w.pair("start",start);
+    w.key("heaters");
+    w.startArray();
+    for(int h=0;h<heaters;h++) {
+        if(h==0) w.value("bed");
+        else {
+            char name[12];
+            snprintf(name,sizeof(name),"T%d",h-1);
+            w.value(name);
+        }
+    }
+    w.endArray();
+    w.key("t");
+    w.startArray();
+    for(size_t i=0;i<count;i++)
+        w.value(floor(points[i*stride]+0.5)/1000.0-start);
+    w.endArray();
+    static const char *fields[] = {"set","read","output"};
+    for(int f=0;f<3;f++) {
+        w.key(fields[f]);
+        w.startArray();
+        for(int h=0;h<heaters;h++) {
+            w.startArray();
+            for(size_t i=0;i<count;i++)
+                w.value(floor(points[i*stride+1+f*heaters+h]*10.0+0.5)/10.0);
+            w.endArray();
+        }
+        w.endArray();
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__TemperatureHistory__
+#define __Repetier_Server__TemperatureHistory__
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+
+class JSONWriter;
+
+/** Temperature history of all heaters of one printer.
+
+ Samples are kept in three rings of fixed size:
+ - raw: one sample per second for 10 minutes
+ - 10s: averages of 10 seconds for 24 hours
+ - 1min: averages of one minute for 30 days
+
+ Each record holds the time in milliseconds since 1970 and set, read and
+ output of every heater. Heater 0 is the bed, heater 1+i extruder i.
+
+ The rings are mirrored in a file of fixed size, so the history survives
+ restarts. add only changes memory, flush writes the changed records.
+ The file is in host byte order and recreated if its layout does not
+ match, e.g. after the extruder count changed.
+ The class is thread safe.
+ */
+class TemperatureHistory {
+public:
+    struct Heater {
+        float set;
+        float read;
+        float output;
+    };
+    enum {TIER_RAW,TIER_10S,TIER_1MIN,TIER_COUNT};
+private:
+    struct Ring {
+        uint32_t resolution; ///< Milliseconds per record
+        uint32_t slots;
+        uint32_t head; ///< Slot written next
+        uint32_t count; ///< Used slots
+        std::vector<char> data; ///< slots records of recordSize bytes
+        uint32_t dirtyFirst; ///< First slot not yet flushed
+        uint32_t dirtyCount; ///< Slots changed since the last flush
+        // Running average of the current interval, unused for raw
+        uint64_t bucket; ///< Start of the interval, 0 if empty
+        std::vector<double> sums;
+        int samples;
+    };
+    boost::mutex mutex; ///< Guards the rings
+    boost::mutex fileMutex; ///< Serializes flushes, never held together with mutex while writing
+    std::string filename;
+    std::fstream file;
+    int heaters;
+    size_t recordSize;
+    Ring rings[TIER_COUNT];
+    std::vector<Heater> average; ///< Reused by storeAverage
+    uint64_t nextFlush; ///< LatencyHistogram::now() of the next flush, only used by flushIfDue
+    std::vector<char> flushBuffer; ///< Dirty bytes copied for writing outside the lock
+    std::vector<std::pair<size_t,size_t> > flushRanges; ///< File offset and length in flushBuffer
+
+    inline char *record(Ring &r,uint32_t slot) {return &r.data[(size_t)slot*recordSize];}
+    uint64_t recordTime(Ring &r,uint32_t slot);
+    void markDirty(Ring &r,uint32_t slot);
+    /** Index of the first record with a time not before t. */
+    uint32_t lowerBound(Ring &r,uint64_t t);
+    /** Slot of the i-th oldest record. */
+    inline uint32_t slotOf(Ring &r,uint32_t i) {return (r.head+r.slots-r.count+i)%r.slots;}
+    /** Appends a record. A record not newer than the last one replaces it. */
+    void store(Ring &r,uint64_t time,const Heater *values);
+    void storeAverage(Ring &r);
+    size_t fileOffset(int tier,uint32_t slot);
+    /** Appends the file header to buf. */
+    void writeHeader(std::vector<char> &buf);
+    /** @returns false if the file is missing or has another layout. */
+    bool load();
+    void create();
+public:
+    /** Opens or creates the history file.
+     @param file History file of the printer.
+     @param heaterCount Bed plus extruders. */
+    TemperatureHistory(const std::string &file,int heaterCount);
+    ~TemperatureHistory();
+    inline int heaterCount() const {return heaters;}
+    /** Adds a sample of all heaters. Does no file access.
+     @param time Milliseconds since 1970, see nowMillis.
+     @param values heaterCount values. */
+    void add(uint64_t time,const Heater *values);
+    /** Writes changed records and the ring positions to the file. */
+    void flush();
+    /** Calls flush if the last one is more than 30 seconds ago. */
+    void flushIfDue();
+    /** Stores the averages of the open 10s and 1min intervals, then flushes.
+     Called when the printer thread stops. Later samples of the same interval
+     replace the stored average. */
+    void close();
+    /** Writes the records between from and to as members of the current JSON
+     object. The finest tier that reaches back to from is used, unless tier
+     selects one. Consecutive records are averaged so at most maxPoints are
+     written.
+     @param tier TIER_RAW..TIER_1MIN or -1 for automatic selection. */
+    void writeJSON(JSONWriter &w,uint64_t from,uint64_t to,int maxPoints,int tier);
+    /** Milliseconds since 1970. */
+    static uint64_t nowMillis();
+};
+
+#endif /* defined(__Repetier_Server__TemperatureHistory__) */
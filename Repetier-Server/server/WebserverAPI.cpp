@@ -33,6 +33,14 @@
 #include "PrinterState.h"
 #include "Printjob.h"
 #include "RLog.h"
+#include "JSONWriter.h"
+#include "ServerMetrics.h"
+#include "GzipEncoder.h"
+#include "PageTemplate.h"
+#include "PrometheusWriter.h"
+#include "TemperatureHistory.h"
+#include "PrinterLog.h"
+#include <boost/algorithm/string/predicate.hpp>
 #if defined(_WIN32)
 #include <io.h>
 #endif
@@ -82,10 +90,149 @@ using namespace boost;
 #ifndef O_EXLOCK
 #define O_EXLOCK 0
 #endif
+#define GZIP_MIN_SIZE 1024 // Smaller responses fit in a packet or two anyway
+#define MAX_BATCH_SIZE 262144 // Largest accepted command batch in bytes
 
 namespace repetier {
-    static const char *HTTP_500 = "HTTP/1.0 500 Server Error\r\n\r\n";
+    /** Tells if the client keeps the connection open after this request.
+     Follows the same rules as mongoose, which waits for the next request
+     on the connection in that case. */
+    bool clientKeepsAlive(struct mg_connection *conn) {
+        const struct mg_request_info *ri = mg_get_request_info(conn);
+        const char *header = mg_get_header(conn, "Connection");
+        if(header!=NULL)
+            return boost::algorithm::iequals(header,"keep-alive");
+        return ri->http_version!=NULL && strcmp(ri->http_version,"1.1")==0;
+    }
+    bool clientAcceptsGzip(struct mg_connection *conn) {
+        const char *header = mg_get_header(conn, "Accept-Encoding");
+        if(header==NULL) return false;
+        const char *p = header;
+        while((p = strstr(p,"gzip"))!=NULL) {
+            p+=4;
+            while(*p==' ') p++;
+            if(*p!=';') return true;
+            p++;
+            while(*p==' ') p++;
+            if(*p=='q' && p[1]=='=') return atof(p+2)>0; // gzip;q=0 forbids it
+            return true;
+        }
+        return false;
+    }
+    static boost::thread_specific_ptr<GzipEncoder> threadGzipEncoder;
+    static boost::thread_specific_ptr<string> threadGzipBuffer;
+    /** Sends a dynamic response. Bodies of at least GZIP_MIN_SIZE bytes are
+     compressed with the fastest gzip level if the client accepts it. Each
+     worker thread reuses its own encoder and output buffer. */
+    static void sendResponse(struct mg_connection *conn,const char *contentType,const char *data,size_t len) {
+        bool keepAlive = clientKeepsAlive(conn);
+        const char *encoding = "";
+        if(len>=GZIP_MIN_SIZE && clientAcceptsGzip(conn)) {
+            if(threadGzipEncoder.get()==NULL) {
+                threadGzipEncoder.reset(new GzipEncoder(Z_BEST_SPEED));
+                threadGzipBuffer.reset(new string());
+            }
+            string &zipped = *threadGzipBuffer;
+            posix_time::ptime start = posix_time::microsec_clock::universal_time();
+            if(threadGzipEncoder->compress(data,len,zipped)) {
+                ServerMetrics::countGzipResponse(len,zipped.length(),(posix_time::microsec_clock::universal_time()-start).total_microseconds());
+                data = zipped.c_str();
+                len = zipped.length();
+                encoding = "Content-Encoding: gzip\r\n";
+            }
+        }
+        mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+                  "Cache-Control:public, max-age=0\r\n"
+                  "Server: Repetier-Server\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %d\r\n"
+                  "Vary: Accept-Encoding\r\n"
+                  "%s"
+                  "Connection: %s\r\n\r\n",contentType,(int)len,encoding,keepAlive ? "keep-alive" : "close");
+        mg_write(conn,data,len);
+        if(keepAlive)
+            ServerMetrics::countKeepAliveResponse();
+        else
+            ServerMetrics::countCloseResponse();
+    }
+    /** Sends a server error. The rest of the request body may still be
+     unread, so the connection is closed afterwards instead of parsing the
+     remaining body as next request. */
+    static void sendError(struct mg_connection *conn,const char *msg) {
+        mg_set_must_close(conn);
+        mg_printf(conn, "HTTP/1.1 500 Server Error\r\n"
+                  "Content-Length: %d\r\n"
+                  "Connection: close\r\n\r\n%s",(int)strlen(msg),msg);
+        ServerMetrics::countCloseResponse();
+    }
     
+    /** Reads the complete request body.
+     @returns false if the body is larger than maxLen or the client closed the connection. */
+    static bool readPostBody(struct mg_connection *conn,string &body,size_t maxLen) {
+        body.clear();
+        const char *cl_header = mg_get_header(conn, "Content-Length");
+        if(cl_header==NULL) return true;
+        long long cl = strtoll(cl_header, NULL, 10);
+        if(cl<0 || cl>(long long)maxLen) return false;
+        body.resize((size_t)cl);
+        size_t got = 0;
+        while(got<body.length()) {
+            int n = mg_read(conn,&body[got],body.length()-got);
+            if(n<=0) return false;
+            got += n;
+        }
+        return true;
+    }
+    /** Reads and drops the part of the request body no handler consumed, e.g.
+     a command batch sent to an offline or unknown printer, so it is not
+     parsed as next request. Bodies above MAX_BATCH_SIZE close the connection
+     instead. */
+    static void skipPostBody(struct mg_connection *conn) {
+        char buf[4096];
+        size_t skipped = 0;
+        int n;
+        while((n = mg_read(conn,buf,sizeof(buf)))>0) {
+            skipped += n;
+            if(skipped>MAX_BATCH_SIZE) {
+                mg_set_must_close(conn);
+                return;
+            }
+        }
+    }
+    /** Splits a command batch into commands. The batch is either a JSON
+     array of strings, an object with such an array in "commands", or plain
+     text with one command per line. */
+    static void parseCommandBatch(const string &body,bool json,vector<string> &cmds) {
+        cmds.clear();
+        if(json) {
+            Value v;
+            if(!json_spirit::read(body,v)) return;
+            const Value *list = &v;
+            if(v.type()==obj_type) {
+                const Object &obj = v.get_obj();
+                for(Object::const_iterator it=obj.begin();it!=obj.end();++it)
+                    if(it->name_=="commands") {
+                        list = &it->value_;
+                        break;
+                    }
+            }
+            if(list->type()!=array_type) return;
+            const Array &a = list->get_array();
+            for(Array::const_iterator it=a.begin();it!=a.end();++it)
+                if(it->type()==str_type)
+                    cmds.push_back(it->get_str());
+            return;
+        }
+        size_t pos = 0,len = body.length();
+        while(pos<len) {
+            size_t eol = body.find('\n',pos);
+            if(eol==string::npos) eol = len;
+            size_t end = eol;
+            if(end>pos && body[end-1]=='\r') end--;
+            cmds.push_back(body.substr(pos,end-pos));
+            pos = eol+1;
+        }
+    }
 	char *mystrnstr(const char *s,const char *needle,int len) {
 		int ln = (int)strlen(needle);
 		if(!ln) return (char*)s;
@@ -115,7 +262,7 @@ namespace repetier {
         // Figure out total content length. Return if it is not present or invalid.
         cl_header = mg_get_header(conn, "Content-Length");
         if (cl_header == NULL || (cl = strtoll(cl_header, NULL, 10)) <= 0) {
-            mg_printf(conn, "%s%s", HTTP_500, "Invalid Content-Length");
+            sendError(conn,"Invalid Content-Length");
             return false;
         }
         
@@ -139,7 +286,7 @@ namespace repetier {
             }
         }
         if(strlen(post_data)>100) {
-            mg_printf(conn, "%s%s", HTTP_500, "Boundary too long");
+            sendError(conn,"Boundary too long");
             return false;
         }
         boundary[0] = '\r';
@@ -159,16 +306,16 @@ namespace repetier {
         snprintf(path, sizeof(path), "/tmp/%s", s);*/
         
         if (file_name[0] == '\0') {
-            mg_printf(conn, "%s%s", HTTP_500, "Can't get file name");
+            sendError(conn,"Can't get file name");
         } else if (cl <= 0) {
-            mg_printf(conn, "%s%s", HTTP_500, "Empty file");
+            sendError(conn,"Empty file");
         } else if ((fd = myopen(filename.c_str(), O_CREAT | (append ? O_APPEND : O_TRUNC) |
                               O_RDWR /*| O_WRONLY | O_EXLOCK | O_CLOEXEC*/,0666)) < 0) {
             // We're opening the file with exclusive lock held. This guarantee us that
             // there is no other thread can save into the same file simultaneously.
-            mg_printf(conn, "%s%s", HTTP_500, "Cannot open file");
+            sendError(conn,"Cannot open file");
         } else if ((fp = fdopen(fd,(append ? "a+" : "w"))) == NULL) {
-            mg_printf(conn, "%s%s", HTTP_500, "Cannot reopen file stream");
+            sendError(conn,"Cannot reopen file stream");
             myclose(fd);
         } else {
             bool finished = false;
@@ -215,29 +362,37 @@ namespace repetier {
         }
         return false;
     }
-    void listPrinter(Object &ret) {
-        Array parr;
+    void listPrinter(JSONWriter &w) {
+        w.key("data");
+        w.startArray();
         std::vector<Printer*> *list = &gconfig->getPrinterList();
         for(vector<Printer*>::iterator i=list->begin();i!=list->end();++i) {
-            Object pinfo;
             Printer *p = *i;
-            pinfo.push_back(Pair("name",p->name));
-            pinfo.push_back(Pair("slug",p->slugName));
-            pinfo.push_back(Pair("online",(p->getOnlineStatus())));
-            p->getJobStatus(pinfo);
-            pinfo.push_back(Pair("active",p->getActive()));
-            parr.push_back(pinfo);
+            w.startObject();
+            w.pair("name",p->name);
+            w.pair("slug",p->slugName);
+            w.pair("online",p->getOnlineStatus());
+            p->writeJobStatus(w);
+            w.pair("active",p->getActive());
+            w.endObject();
         }
-        ret.push_back(Pair("data",parr));
-        Array msg;
-        gconfig->fillJSONMessages(msg);
-        ret.push_back(Pair("messages",msg));
+        w.endArray();
+        w.key("messages");
+        gconfig->writeJSONMessages(w);
     }
+    /** Reports the lifetime of the object as request duration of a group,
+     so every return path of a handler is measured. */
+    class RequestTimer {
+        const string &group;
+        posix_time::ptime start;
+    public:
+        RequestTimer(const string &g):group(g),start(posix_time::microsec_clock::universal_time()) {}
+        ~RequestTimer() {
+            ServerMetrics::countCmdgroup(group,(posix_time::microsec_clock::universal_time()-start).total_microseconds());
+        }
+    };
     void HandleWebrequest(struct mg_connection *conn) {
-        mg_printf(conn, "HTTP/1.0 200 OK\r\n"
-                  "Cache-Control:public, max-age=0\r\n"
-                  "Server: Repetier-Server\r\n"
-                  "Content-Type: text/html; charset=utf-8\r\n\r\n");
+        ServerMetrics::countRequest(mg_get_request_count(conn));
         const struct mg_request_info *ri = mg_get_request_info(conn);
         // First check the path for its parts
         int start(9); // /printer/
@@ -247,24 +402,30 @@ namespace repetier {
         const char* uri = ri->uri;
         while(uri[end] && uri[end]!='/') end++;
         string cmdgroup(&uri[start],end-start);
+        RequestTimer timer(cmdgroup);
         if(uri[end]) { // Read printer string
             start = end = end+1;
             while(uri[end] && uri[end]!='/') end++;
             printer = gconfig->findPrinterSlug(string(&uri[start],end-start));        
         }
-        Object ret;
+        JSONWriter ret(JSONWriter::threadBuffer());
+        ret.startObject();
         if(cmdgroup=="list") {
             listPrinter(ret);
+        } else if(cmdgroup=="metrics") {
+            ret.key("data");
+            ret.startObject();
+            ServerMetrics::writeJSON(ret);
+            ret.endObject();
         } else if(printer==NULL) {
             error = "Unknown printer";
         } else if(cmdgroup=="job") {
             string a;
             MG_getVar(ri,"a",a);
             if(a=="list") {
-                printer->getJobManager()->fillSJONObject("data",ret);
-                Array msg;
-                gconfig->fillJSONMessages(msg);
-                ret.push_back(Pair("messages",msg));
+                printer->getJobManager()->writeJSON("data",ret);
+                ret.key("messages");
+                gconfig->writeJSONMessages(ret);
             } else if(a=="upload") {
 #ifdef DEBUG
                 cout << "Upload job" << endl;
@@ -273,9 +434,12 @@ namespace repetier {
                 long size;
                 MG_getVar(ri,"name", jobname);
                 PrintjobPtr job = printer->getJobManager()->createNewPrintjob(jobname);
-                handleFileUpload(conn,job->getFilename(), name,size,false);
+                if(!handleFileUpload(conn,job->getFilename(), name,size,false)) {
+                    printer->getJobManager()->RemovePrintjob(job);
+                    return; // error response already sent
+                }
                 printer->getJobManager()->finishPrintjobCreation(job,name,size);
-                printer->getJobManager()->fillSJONObject("data",ret);
+                printer->getJobManager()->writeJSON("data",ret);
 #ifdef DEBUG
                 cout << "Name:" << name << " Size:" << size << endl;
 #endif
@@ -287,7 +451,7 @@ namespace repetier {
                     if(job.get())
                         printer->getJobManager()->RemovePrintjob(job);
                 }
-                printer->getJobManager()->fillSJONObject("data",ret);
+                printer->getJobManager()->writeJSON("data",ret);
             } else if(a=="start") {
                 string sid;
                 if(MG_getVar(ri,"id",sid)) {
@@ -297,7 +461,7 @@ namespace repetier {
                         printer->getJobManager()->startJob(id);
                     }
                 }
-                printer->getJobManager()->fillSJONObject("data",ret);
+                printer->getJobManager()->writeJSON("data",ret);
             } else if(a=="stop") {
                 string sid;
                 if(MG_getVar(ri,"id",sid)) {
@@ -308,13 +472,13 @@ namespace repetier {
                         printer->getScriptManager()->pushCompleteJob("Kill");
                     }
                 }
-                printer->getJobManager()->fillSJONObject("data",ret);                
+                printer->getJobManager()->writeJSON("data",ret);                
             }
         } else if(cmdgroup=="model") {
             string a;
             MG_getVar(ri,"a",a);
             if(a=="list") {
-                printer->getModelManager()->fillSJONObject("data",ret);
+                printer->getModelManager()->writeJSON("data",ret);
             } else if(a=="upload") {
 #ifdef DEBUG
                 cout << "Upload model" << endl;
@@ -323,9 +487,12 @@ namespace repetier {
                 long size=0;
                 MG_getVar(ri,"name", jobname);
                 PrintjobPtr job = printer->getModelManager()->createNewPrintjob(jobname);
-                handleFileUpload(conn,job->getFilename(), name,size,false);
+                if(!handleFileUpload(conn,job->getFilename(), name,size,false)) {
+                    printer->getModelManager()->RemovePrintjob(job);
+                    return; // error response already sent
+                }
                 printer->getModelManager()->finishPrintjobCreation(job,name,size);
-                printer->getModelManager()->fillSJONObject("data",ret);
+                printer->getModelManager()->writeJSON("data",ret);
 #ifdef DEBUG
                 cout << "Name:" << name << " Size:" << size << endl;
 #endif
@@ -337,7 +504,7 @@ namespace repetier {
                     if(job.get())
                         printer->getModelManager()->RemovePrintjob(job);
                 }	
-                printer->getModelManager()->fillSJONObject("data",ret);
+                printer->getModelManager()->writeJSON("data",ret);
             } else if(a=="copy") {
                 string sid;
                 if(MG_getVar(ri,"id",sid)) {
@@ -359,13 +526,13 @@ namespace repetier {
                     }
                     }
                 }
-                printer->getJobManager()->fillSJONObject("data",ret);
+                printer->getJobManager()->writeJSON("data",ret);
             }
         } else if(cmdgroup=="script") {
             string a;
             MG_getVar(ri,"a",a);
             if(a=="list") {
-                printer->getScriptManager()->fillSJONObject("data",ret);
+                printer->getScriptManager()->writeJSON("data",ret);
             } if(a=="") {
                 const int MAX_VAR_LEN = 256*1024;
                 char buffer[MAX_VAR_LEN+1];
@@ -386,7 +553,7 @@ namespace repetier {
                         RLog::log("Error writing script: @",static_cast<const string>(ex.what()));
                     }
                 } else if(a=="load") {
-                    string name;
+                    string name,content;
                     if(MG_getPostVar(buffer,post_data_len,ri,"f",name)) {
                     PrintjobPtr job = printer->getScriptManager()->findByName(name);
                     if(job.get()) {
@@ -399,7 +566,8 @@ namespace repetier {
                                 size_t l = strlen(buf);
                                 if(buf[l]=='\r')
                                     buf[l] = 0;
-                                    mg_printf(conn,"%s\n",buf);
+                                    content.append(buf);
+                                    content+='\n';
                                 }
                                 in.close();
                             } catch(std::exception &ex) {
@@ -407,6 +575,7 @@ namespace repetier {
                             }
                         }
                     }
+                    sendResponse(conn,"text/html; charset=utf-8",content.c_str(),content.length());
                     return;
                 }
             }
@@ -422,9 +591,8 @@ namespace repetier {
             }
             if(id) {
                 gconfig->removeMessage(id);
-                Array msg;
-                gconfig->fillJSONMessages(msg);
-                ret.push_back(Pair("messages",msg));
+                ret.key("messages");
+                gconfig->writeJSONMessages(ret);
             }
         } else if(cmdgroup == "pconfig") {
             string a;
@@ -443,6 +611,32 @@ namespace repetier {
             string cmd;
             if(MG_getVar(ri,"cmd", cmd)) {
                 printer->injectManualCommand(cmd);
+            } else if(strcmp(ri->request_method,"POST")==0) { // Command batch in body
+                string body;
+                if(!readPostBody(conn,body,MAX_BATCH_SIZE)) {
+                    sendError(conn,"Command batch too large");
+                    return;
+                }
+                const char *ctype = mg_get_header(conn,"Content-Type");
+                bool json = ctype!=NULL && strstr(ctype,"json")!=NULL;
+                vector<string> cmds;
+                parseCommandBatch(body,json,cmds);
+                string ack;
+                bool wantAck = MG_getVar(ri,"ack",ack) && ack=="1";
+                vector<bool> queued;
+                size_t n = printer->injectManualCommands(cmds,wantAck ? &queued : NULL);
+                ret.key("data");
+                ret.startObject();
+                ret.pair("lines",(int)cmds.size());
+                ret.pair("queued",(int)n);
+                if(wantAck) {
+                    ret.key("ack");
+                    ret.startArray();
+                    for(size_t i=0;i<queued.size();i++)
+                        ret.value((bool)queued[i]);
+                    ret.endArray();
+                }
+                ret.endObject();
             }
         } else if(cmdgroup=="response") { // Return log
             string sfilter,sstart;
@@ -453,24 +647,88 @@ namespace repetier {
             if(MG_getVar(ri,"start",sstart))
                 start = (uint32_t)atol(sstart.c_str());
             boost::shared_ptr<list<boost::shared_ptr<PrinterResponse> > > rlist = printer->getResponsesSince(start,filter, start);
-            Object lobj;
-            lobj.push_back(Pair("lastid",(int)start));
-            Array a;
+            ret.key("data");
+            ret.startObject();
+            ret.pair("lastid",(int)start);
+            ret.key("lines");
+            ret.startArray();
             list<boost::shared_ptr<PrinterResponse> >::iterator it = rlist->begin(),end=rlist->end();
             for(;it!=end;++it) {
                 PrinterResponse *resp = (*it).get();
-                Object o;
-                o.push_back(Pair("id",(int)resp->responseId));
-                o.push_back(Pair("time",resp->getTimeString()));
-                o.push_back(Pair("text",resp->message));
-                o.push_back(Pair("type",resp->logtype));
-                a.push_back(o);
+                ret.startObject();
+                ret.pair("id",(int)resp->responseId);
+                ret.pair("time",resp->getTimeString());
+                ret.pair("text",resp->message);
+                ret.pair("type",(int)resp->logtype);
+                ret.endObject();
             }
-            lobj.push_back(Pair("lines",a));
-            Object state;
-            printer->state->fillJSONObject(state);
-            lobj.push_back(Pair("state",state));
-            ret.push_back(Pair("data",lobj));
+            ret.endArray();
+            ret.key("state");
+            printer->state->writeJSON(ret);
+            ret.endObject();
+        } else if(cmdgroup=="latency") {
+            PrinterLatency l;
+            printer->getLatency(l);
+            ret.key("data");
+            ret.startObject();
+            ret.key("ack");
+            ret.startObject();
+            l.ack.writeJSON(ret);
+            ret.endObject();
+            ret.key("queueWait");
+            ret.startObject();
+            l.queueWait.writeJSON(ret);
+            ret.endObject();
+            ret.key("fileToWire");
+            ret.startObject();
+            l.fileToWire.writeJSON(ret);
+            ret.endObject();
+            ret.key("resendRecovery");
+            ret.startObject();
+            l.resendRecovery.writeJSON(ret);
+            ret.endObject();
+            ret.key("connect");
+            ret.startObject();
+            l.connect.writeJSON(ret);
+            ret.endObject();
+            ret.endObject();
+        } else if(cmdgroup=="window") {
+            ret.key("data");
+            ret.startObject();
+            printer->writeSendWindow(ret);
+            ret.endObject();
+        } else if(cmdgroup=="temperatures") { // from and to in seconds since 1970
+            string sfrom,sto,spoints,stier;
+            uint64_t to = TemperatureHistory::nowMillis();
+            if(MG_getVar(ri,"to",sto)) to = (uint64_t)(atof(sto.c_str())*1000.0);
+            uint64_t from = to>600000 ? to-600000 : 0; // Last 10 minutes
+            if(MG_getVar(ri,"from",sfrom)) from = (uint64_t)(atof(sfrom.c_str())*1000.0);
+            int points = 500;
+            if(MG_getVar(ri,"points",spoints)) points = min(5000,atoi(spoints.c_str()));
+            int tier = -1;
+            if(MG_getVar(ri,"tier",stier)) {
+                if(stier=="raw") tier = TemperatureHistory::TIER_RAW;
+                else if(stier=="10s") tier = TemperatureHistory::TIER_10S;
+                else if(stier=="1min") tier = TemperatureHistory::TIER_1MIN;
+            }
+            ret.key("data");
+            ret.startObject();
+            printer->getTemperatureHistory()->writeJSON(ret,from,to,points,tier);
+            ret.endObject();
+        } else if(cmdgroup=="log") { // Persistent log, select by id (start, end) or time (from, to)
+            PrinterLog::Query q;
+            string v;
+            if(MG_getVar(ri,"start",v)) q.startId = (uint32_t)atol(v.c_str());
+            if(MG_getVar(ri,"end",v)) q.endId = (uint32_t)atol(v.c_str());
+            if(MG_getVar(ri,"from",v)) q.fromTime = (uint64_t)(atof(v.c_str())*1000.0);
+            if(MG_getVar(ri,"to",v)) q.toTime = (uint64_t)(atof(v.c_str())*1000.0);
+            if(MG_getVar(ri,"filter",v)) q.filter = atoi(v.c_str());
+            if(MG_getVar(ri,"limit",v)) q.limit = max(1,min(5000,atoi(v.c_str())));
+            MG_getVar(ri,"contains",q.contains);
+            ret.key("data");
+            ret.startObject();
+            printer->getLog()->writeJSON(ret,q);
+            ret.endObject();
         } else if(cmdgroup=="move") {
             string sx,sy,sz,se;
             double x=0,y=0,z=0,e=0;
@@ -480,10 +738,11 @@ namespace repetier {
             if(MG_getVar(ri,"e",se)) e = atof(se.c_str());
             printer->move(x, y, z, e);
         }
-        ret.push_back(Pair("error",error));
-    
+        ret.pair("error",error);
+        ret.endObject();
+        skipPostBody(conn);
         // Print result
-		mg_printf(conn,"%s",write(ret,json_spirit::raw_utf8).c_str());
+        sendResponse(conn,"text/html; charset=utf-8",ret.str().c_str(),ret.str().length());
     }
     bool MG_getVar(const mg_request_info *info,const char *name, std::string &output)
     {
@@ -510,127 +769,14 @@ namespace repetier {
         delete[] buffer;
         return false;        
     }
-    string JSONValueAsString(const Value &v) {
-        switch(v.type()) {
-            case str_type:
-                return v.get_str();
-            case int_type:
-            {
-                char b[40];
-                sprintf(b,"%d",v.get_int());
-                return string(b);
-            }
-            case real_type: {
-                char b[40];
-                sprintf(b,"%f",v.get_real());
-                return string(b);
-            }
-            case bool_type:
-                if(v.get_bool()) return string("true");
-                return string("false");
-            case array_type:
-                return "array";
-            case obj_type:
-                return "object";
-            case null_type:
-                return "null";
-        }
-        return("Unsupported type");
-    }
-    Value* findVariable(list<Value> &vars,const string& name) {
-        list<Value>::iterator istart = vars.begin(),iend = vars.end();
-        bool found = false;
-        for(;istart!=iend && !found;istart++) {
-            Value &v = *istart;
-            if(v.type()==obj_type) {
-                Object &obj = v.get_obj();
-                vector<Pair>::iterator oit = obj.begin(),oend = obj.end();
-                for(;oit!=oend;oit++) {
-                    Pair &p = *oit;
-                    if(p.name_ == name) {
-                        return &p.value_;
-                    }
-                }
-            }
-        }
-        return NULL;
-    }
-    void FillTemplateRecursive(string& text,string& result,list<Value>& vars,size_t start,size_t end) {
-        size_t pos(start),pos2,posclose;
-        while(pos<end) {
-            pos2 = text.find("{{",pos);
-            if(pos2==string::npos || pos2+3>=end) { // Finished, no more vars etc
-                result.append(text,pos,end-pos);
-                return;
-            }
-            pos2+=2;
-            posclose = text.find("}}",pos2);
-            if(posclose==string::npos) { // Finished, no more vars etc
-                result.append(text,pos,end-pos);
-                return;
-            }
-            
-            result.append(text,pos,pos2-pos-2);
-            char tp = text[pos2];
-            
-            if(tp == '#') { // foreach loop
-                string name = text.substr(pos2+1,posclose-pos2-1);
-                size_t spacePos = name.find(' ');
-                string cmd = "";
-                if(spacePos!=string::npos) {
-                    cmd = name.substr(0,spacePos);
-                    name = name.substr(spacePos+1);
-                    pos2+=cmd.length()+1;
-                }
-                string ename = "{{/"+name+"}}";
-                size_t epos = text.find(ename,posclose);
-                pos2+=name.length()+3;
-                posclose = epos+ename.length()-2; // Continue after block
-                Value *v = findVariable(vars,name);
-                if(v!=NULL) {
-                if(cmd.length()==0) {
-                    if(v!=NULL && v->type()==array_type) {
-                        Array &a = v->get_array();
-                        vector<Value>::iterator it = a.begin(),iend = a.end();
-                        for(;it!=iend;++it) {
-                            vars.push_front(*it);
-                            FillTemplateRecursive(text, result, vars, pos2, epos);
-                            vars.pop_front();
-                        }
-                    }
-                } else if(cmd=="if" && v->type()==bool_type) {
-                    if(v->get_bool()) {
-                        FillTemplateRecursive(text, result, vars, pos2, epos);
-                    }
-                } else if(cmd=="ifnot" && v->type()==bool_type) {
-                    if(!v->get_bool()) {
-                        FillTemplateRecursive(text, result, vars, pos2, epos);
-                    }
-                }
-                }
-            } else if(tp=='!') { // Comment, simply ignore it
-            } else { // Variable
-                string name = text.substr(pos2,posclose-pos2);
-                Value *v = findVariable(vars,name);
-                if(v!=NULL)
-                    result.append(JSONValueAsString(*v));
-            }
-            pos = posclose+2;
-        }
-    }
-    void FillTemplate(string &text,string& result,Object& data) {
-        result.clear();
-        size_t start(0),end(text.length());
-        result.reserve(end*2);
-        list<Value> vars;
-        vars.push_front(Value(data));
-        FillTemplateRecursive(text,result,vars,start,end);
-    }
     void* HandlePagerequest(struct mg_connection *conn) {
         const struct mg_request_info *ri = mg_get_request_info(conn);
         string uri(ri->uri);
         if(uri.length()<=1) uri="/index.php";
         if(uri.length()<5 || uri.substr(uri.length()-4,4)!=".php") return NULL;        
+        ServerMetrics::countRequest(mg_get_request_count(conn));
+        static const string pageGroup("page");
+        RequestTimer timer(pageGroup);
         
         // Step 1: Find translation file
         char *alang = (char*)mg_get_header(conn, "Accept-Language");
@@ -662,8 +808,7 @@ namespace repetier {
         }
         if(lang == "")
             lang = gconfig->getDefaultLanguage();
-        string content;
-        TranslateFile(gconfig->getWebsiteRoot()+uri,lang,content);
+        PageTemplatePtr page = PageTemplate::get(gconfig->getWebsiteRoot()+uri,lang);
         // Step 2: Fill template parameter
         Object obj;
         string param;
@@ -673,51 +818,96 @@ namespace repetier {
         }
         obj.push_back(Pair("version",string(REPETIER_SERVER_VERSION)));
         // Step 3: Run template
-        string content2;
-        FillTemplate(content, content2, obj);
-        mg_printf(conn, "HTTP/1.0 200 OK\r\n"
-                  "Cache-Control:public, max-age=0\r\n"
-                  "Server: Repetier-Server\r\n"
-                  "Content-Type: text/html; charset=utf-8\r\n\r\n");
-        mg_write(conn, content2.c_str(), content2.length());
+        string &content = JSONWriter::threadBuffer();
+        if(page) page->render(content,obj);
+        sendResponse(conn,"text/html; charset=utf-8",content.c_str(),content.length());
         return (void*)"";
     }
-    static map<string,boost::shared_ptr<moFileLib::moFileReader> > rmap;
-    static set<string> langNotExist;
-    static boost::mutex langMutex;
-    bool doesLanguageExist(string lang) {
-        moFileLib::moFileReader *r = NULL;
-        if((rmap[lang].get()) == NULL) {
-            boost::mutex::scoped_lock l(langMutex);
-            if(langNotExist.size()>0 && langNotExist.find(lang)==langNotExist.end())
-                return false;
-            string mofile = gconfig->getLanguageDir()+lang+".mo";
-            if(!boost::filesystem::exists(mofile)) {
-                langNotExist.insert(lang);
-                return false;
+    /** Writes one metric for all printers, labeled with the printer slug. */
+    template<typename T> static void writePrinterMetric(PrometheusWriter &w,const char *name,const char *type,const char *help,vector<PrinterMetrics> &metrics,T PrinterMetrics::*field) {
+        w.header(name,type,help);
+        vector<Printer*> &list = gconfig->getPrinterList();
+        for(size_t i=0;i<list.size();i++)
+            w.sample(name,PrometheusWriter::label("printer",list[i]->slugName),(double)(metrics[i].*field));
+    }
+    static void writePrinterHistogram(PrometheusWriter &w,const char *name,const char *help,vector<PrinterLatency> &latency,LatencyHistogram PrinterLatency::*field) {
+        w.header(name,"histogram",help);
+        vector<Printer*> &list = gconfig->getPrinterList();
+        for(size_t i=0;i<list.size();i++)
+            (latency[i].*field).writePrometheus(w,name,PrometheusWriter::label("printer",list[i]->slugName));
+    }
+    void HandleMetricsRequest(struct mg_connection *conn) {
+        ServerMetrics::countRequest(mg_get_request_count(conn));
+        static const string metricsGroup("metrics");
+        RequestTimer timer(metricsGroup);
+        PrometheusWriter w(JSONWriter::threadBuffer());
+        vector<Printer*> &list = gconfig->getPrinterList();
+        vector<PrinterMetrics> m(list.size());
+        for(size_t i=0;i<list.size();i++)
+            list[i]->getMetrics(m[i]);
+        writePrinterMetric(w,"repetier_printer_online","gauge","1 if the printer is connected.",m,&PrinterMetrics::online);
+        writePrinterMetric(w,"repetier_printer_lines_sent_total","counter","Lines sent to the printer.",m,&PrinterMetrics::linesSend);
+        writePrinterMetric(w,"repetier_printer_bytes_sent_total","counter","Bytes sent to the printer.",m,&PrinterMetrics::bytesSend);
+        writePrinterMetric(w,"repetier_printer_resends_total","counter","Resend requests received from the printer.",m,&PrinterMetrics::resends);
+        writePrinterMetric(w,"repetier_printer_errors_total","counter","Communication errors since the connection was opened.",m,&PrinterMetrics::errorsReceived);
+        writePrinterMetric(w,"repetier_printer_recent_resends","gauge","Resend requests not yet compensated by ok responses.",m,&PrinterMetrics::resendError);
+        writePrinterMetric(w,"repetier_printer_manual_queue_depth","gauge","Manual commands waiting to be sent.",m,&PrinterMetrics::manualQueue);
+        writePrinterMetric(w,"repetier_printer_job_queue_depth","gauge","Job commands waiting to be sent.",m,&PrinterMetrics::jobQueue);
+        writePrinterMetric(w,"repetier_printer_receive_cache_fill_bytes","gauge","Bytes sent but not yet acknowledged.",m,&PrinterMetrics::receiveCacheFill);
+        writePrinterMetric(w,"repetier_printer_receive_cache_size_bytes","gauge","Receive buffer size assumed for the firmware.",m,&PrinterMetrics::cacheSize);
+        writePrinterMetric(w,"repetier_printer_send_window_bytes","gauge","Bytes allowed in flight by the adaptive flow control.",m,&PrinterMetrics::sendWindow);
+        writePrinterMetric(w,"repetier_printer_firmware_buffer_free","gauge","Free command slots reported by ADVANCED_OK, -1 if not reported.",m,&PrinterMetrics::firmwareBufferFree);
+        writePrinterMetric(w,"repetier_printer_firmware_planner_free","gauge","Free planner slots reported by ADVANCED_OK, -1 if not reported.",m,&PrinterMetrics::firmwarePlannerFree);
+        writePrinterMetric(w,"repetier_printer_history_size","gauge","Sent lines kept for resends.",m,&PrinterMetrics::historySize);
+        writePrinterMetric(w,"repetier_printer_response_backlog","gauge","Responses kept for the log view.",m,&PrinterMetrics::responseBacklog);
+        writePrinterMetric(w,"repetier_printer_job_running","gauge","1 if a job is printing.",m,&PrinterMetrics::jobRunning);
+        writePrinterMetric(w,"repetier_printer_job_progress_percent","gauge","Progress of the running job.",m,&PrinterMetrics::jobDone);
+        writePrinterMetric(w,"repetier_printer_serial_stalls_total","counter","Times the serial thread waited for the printer state lock.",m,&PrinterMetrics::serialStalls);
+        writePrinterMetric(w,"repetier_printer_serial_stall_seconds_total","counter","Time the serial thread waited for the printer state lock.",m,&PrinterMetrics::serialStallSeconds);
+        vector<PrinterLatency> lat(list.size());
+        for(size_t i=0;i<list.size();i++)
+            list[i]->getLatency(lat[i]);
+        writePrinterHistogram(w,"repetier_printer_ack_latency_seconds","Time from writing a line until its ok.",lat,&PrinterLatency::ack);
+        writePrinterHistogram(w,"repetier_printer_queue_wait_seconds","Time manual commands wait in the queue.",lat,&PrinterLatency::queueWait);
+        writePrinterHistogram(w,"repetier_printer_file_to_wire_seconds","Time from reading a job line until it is written.",lat,&PrinterLatency::fileToWire);
+        writePrinterHistogram(w,"repetier_printer_resend_recovery_seconds","Time from a resend request until the requested lines are sent again.",lat,&PrinterLatency::resendRecovery);
+        writePrinterHistogram(w,"repetier_printer_connect_seconds","Time from requesting or losing the connection until the firmware answered the handshake.",lat,&PrinterLatency::connect);
+        ServerMetrics::writePrometheus(w);
+        sendResponse(conn,"text/plain; version=0.0.4",w.str().c_str(),w.str().length());
+    }
+    typedef map<string,boost::shared_ptr<moFileLib::moFileReader> > LanguageMap;
+    /** Translations by language code. Filled by LoadLanguages before the
+     web server starts and only read afterwards, so lookups need no lock. */
+    static LanguageMap languages;
+    void LoadLanguages() {
+        languages.clear();
+        const string &dir = gconfig->getLanguageDir();
+        if(!boost::filesystem::exists(dir)) return;
+        boost::filesystem::directory_iterator end_itr;
+        for(boost::filesystem::directory_iterator itr(dir);itr != end_itr;++itr) {
+            if(!boost::filesystem::is_regular(itr->status()) || itr->path().extension()!=".mo") continue;
+            boost::shared_ptr<moFileLib::moFileReader> r(new moFileLib::moFileReader());
+            if(r->ReadFile(itr->path().string().c_str())!=moFileLib::moFileReader::EC_SUCCESS) {
+                RLog::log("Skipping language file @: "+r->GetErrorDescription(),itr->path().string(),true);
+                continue;
             }
-            r = new moFileLib::moFileReader();
-            r->ReadFile(mofile.c_str());
-            rmap[lang].reset(r);
-            return true;
-        } else return true;
-        
+            languages[itr->path().stem().string()] = r;
+        }
+    }
+    static moFileLib::moFileReader *findLanguage(const string &lang) {
+        LanguageMap::const_iterator it = languages.find(lang);
+        if(it==languages.end()) return NULL;
+        return it->second.get();
+    }
+    bool doesLanguageExist(string lang) {
+        return findLanguage(lang)!=NULL;
     }
     void TranslateFile(const std::string &filename,const std::string &lang,std::string& result) {
         result.clear();
-        
-        // read mo file if not cached
-        moFileLib::moFileReader *r = NULL;
-        if((rmap[lang].get()) == NULL) {
-            boost::mutex::scoped_lock l(langMutex);
-            string mofile = gconfig->getLanguageDir()+lang+".mo";
-            if(!boost::filesystem::exists(mofile))
-                mofile = gconfig->getLanguageDir()+gconfig->getDefaultLanguage()+".mo";
-            if(!boost::filesystem::exists(mofile)) return;
-            r = new moFileLib::moFileReader();
-            r->ReadFile(mofile.c_str());
-            rmap[lang].reset(r);
-        } else r = rmap[lang].get();
+        moFileLib::moFileReader *r = findLanguage(lang);
+        if(r==NULL)
+            r = findLanguage(gconfig->getDefaultLanguage());
+        if(r==NULL) return;
         // Read file contents
         string contents;
 		std::ifstream in(filename.c_str(), ios::in | ios::binary);
@@ -751,8 +941,12 @@ namespace repetier {
             tstart = contents.find("_(\"",pos);
             tend = contents.rfind("\")",pos2);
             if(tstart<tend && tend!=string::npos) {
-                string key = contents.substr(tstart+3,tend-tstart-3);
-                result.append(r->Lookup(key.c_str()));
+                const char *tr;
+                size_t trLength;
+                if(r->Find(&contents[tstart+3],tend-tstart-3,tr,trLength))
+                    result.append(tr,trLength);
+                else
+                    result.append(contents,tstart+3,tend-tstart-3);
             }
         }
     }
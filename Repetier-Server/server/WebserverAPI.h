@@ -23,6 +23,9 @@
 namespace repetier {
     extern void HandleWebrequest(struct mg_connection *conn);
     extern void* HandlePagerequest(struct mg_connection *conn);
+    /** Answers /metrics with server and printer counters in the Prometheus
+     text exposition format. */
+    extern void HandleMetricsRequest(struct mg_connection *conn);
     /** Load the given file and translate contents. Store the translated file
      in a string. Function is thread safe.
      @param filename File to load and translate.
@@ -32,7 +35,14 @@ namespace repetier {
     extern void TranslateFile(const std::string &filename,const std::string &lang,std::string& result);
     extern bool MG_getVar(const mg_request_info *info,const char *name, std::string &output);
     extern bool MG_getPostVar(char *buf,int buflen,const mg_request_info *info,const char *name, std::string &output);
+    /** Loads all translations from the language directory. Must be called
+     once before the web server starts. */
+    extern void LoadLanguages();
     extern bool doesLanguageExist(std::string lang);
+    /** Returns true if the response may keep the connection open. */
+    extern bool clientKeepsAlive(struct mg_connection *conn);
+    /** Returns true if the client accepts gzip content encoding. */
+    extern bool clientAcceptsGzip(struct mg_connection *conn);
 }
 
 #endif /* defined(__Repetier_Server__WebserverAPI__) */
@@ -16,6 +16,8 @@
  */
 
 #include "global_config.h"
+#include "JSONWriter.h"
+#include "RLog.h"
 #include <boost/filesystem.hpp>
 
 using namespace std;
@@ -42,6 +44,17 @@ GlobalConfig::GlobalConfig(string filename) {
     ok &= config.lookupValue("ports",ports);
     backlogSize = 1000;
     config.lookupValue("backlogSize", backlogSize);
+    webThreads = 20;
+    config.lookupValue("web_threads", webThreads);
+    webQueueSize = 20;
+    config.lookupValue("web_queue_size", webQueueSize);
+    webListenBacklog = 0;
+    config.lookupValue("web_listen_backlog", webListenBacklog);
+    webKeepAliveTimeout = 5000;
+    config.lookupValue("web_keep_alive_timeout", webKeepAliveTimeout);
+    int logLevel = RLog::LEVEL_INFO;
+    config.lookupValue("log_level", logLevel);
+    RLog::setLevel(logLevel);
     if(!ok) {
         cerr << "error: Global configuration is missing options!" << endl;
         exit(3);
@@ -90,17 +103,18 @@ Printer *GlobalConfig::findPrinterSlug(const std::string& slug) {
     return NULL;
 }
 
-void GlobalConfig::fillJSONMessages(json_spirit::Array &arr) {
+void GlobalConfig::writeJSONMessages(JSONWriter &w) {
     mutex::scoped_lock l(msgMutex);
+    w.startArray();
     list<RepetierMsgPtr>::iterator it = msgList.begin(),ie = msgList.end();
     for(;it!=ie;++it) {
-        using namespace json_spirit;
-        Object obj;
-        obj.push_back(Pair("id",(*it)->mesgId));
-        obj.push_back(Pair("msg",(*it)->message));
-        obj.push_back(Pair("link",(*it)->finishLink));
-        arr.push_back(obj);
+        w.startObject();
+        w.pair("id",(*it)->mesgId);
+        w.pair("msg",(*it)->message);
+        w.pair("link",(*it)->finishLink);
+        w.endObject();
     }
+    w.endArray();
 }
 
 void GlobalConfig::createMessage(std::string &msg,std::string &link) {
@@ -26,6 +26,7 @@
 #include <vector>
 #include <list>
 
+class JSONWriter;
 class RepetierMessage {
 public:
     std::string message; ///< The message itself.
@@ -47,6 +48,10 @@ class GlobalConfig {
     std::string defaultLanguage; ///< Default language if no language is detected
     std::vector<Printer*> printers;
     int backlogSize;
+    int webThreads; ///< Number of web worker threads.
+    int webQueueSize; ///< Accepted connections waiting for a worker.
+    int webListenBacklog; ///< Pending connections in the kernel, 0 = system default.
+    int webKeepAliveTimeout; ///< Milliseconds an idle keep-alive connection is kept open.
     mutex msgMutex; ///< Mutex for thread safety of message system.
     int msgCounter; ///< Last used message id.
     std::list<RepetierMsgPtr> msgList; ///< List with active messages.
@@ -57,6 +62,10 @@ public:
     inline const std::string& getStorageDirectory() {return storageDir;}
     inline const int getBacklogSize() {return backlogSize;}
     inline const std::string& getPorts() {return ports;}
+    inline int getWebThreads() {return webThreads;}
+    inline int getWebQueueSize() {return webQueueSize;}
+    inline int getWebListenBacklog() {return webListenBacklog;}
+    inline int getWebKeepAliveTimeout() {return webKeepAliveTimeout;}
     inline const std::string& getLanguageDir() {return languageDir;}
     inline const std::string& getDefaultLanguage() {return defaultLanguage;}
     /** Load the global configuration file ans set variables accordingly. */
@@ -73,9 +82,9 @@ public:
      */
     Printer *findPrinterSlug(const std::string& slug);
     inline std::vector<Printer*> &getPrinterList() {return printers;}
-    /** Fill the array with all open messages.
-     @param obj Array to fill. */ 
-    void fillJSONMessages(json_spirit::Array &obj);
+    /** Write all open messages as JSON array.
+     @param w Writer receiving the array. */
+    void writeJSONMessages(JSONWriter &w);
     /** Create a new message to show. Threadsafe!
      @param msg Message to show.
      @param link Link to remove the message. */
@@ -24,6 +24,10 @@
 #include "GCode.h"
 #include "PrinterSerial.h"
 #include "PrinterState.h"
+#include "SendWindow.h"
+#include "JSONWriter.h"
+#include "TemperatureHistory.h"
+#include "PrinterLog.h"
 #include "global_config.h"
 #include <boost/filesystem.hpp>
 #include "json_spirit.h"
@@ -35,11 +39,18 @@ using namespace boost::posix_time;
 using namespace boost::gregorian;
 using namespace boost;
 
+#define MIN_SEND_WINDOW 63 // Smallest receive buffer of supported firmwares
+
 PrinterResponse::PrinterResponse(const string& mes,uint32_t id,uint8_t tp):message(mes) {
     responseId = id;
     logtype = tp;
     time = boost::posix_time::microsec_clock::local_time();
 }
+PrinterResponse::PrinterResponse(const char *mes,size_t length,uint32_t id,uint8_t tp):message(mes,length) {
+    responseId = id;
+    logtype = tp;
+    time = boost::posix_time::microsec_clock::local_time();
+}
 
 std::string PrinterResponse::getTimeString() {
     tm tm = boost::posix_time::to_tm(time);
@@ -85,10 +96,27 @@ Printer::Printer(string conf) {
             exit(4);
         }
         lastResponseId = 0;
+        temperatureHistory = NULL;
+        printerLog = NULL;
         state = new PrinterState(this);
         serial = new PrinterSerial(*this);
+        sendWindow = new SendWindow(cacheSize,MIN_SEND_WINDOW);
+        firmwareBufferFree = firmwarePlannerFree = -1;
+        historyLast = -1;
+        historyCount = 0;
+        resendNext = resendEnd = 0;
+        resendHoldUntil = 0;
+        resendFlushPending = false;
+        resendFlushPacket.reset(new GCodeDataPacket(32,new uint8_t[32]()));
+        garbageCleared = false;
+        readyForNextSend = true;
+        ignoreNextOk = false;
+        receiveCacheFill = 0;
         resendError = 0;
         errorsReceived = 0;
+        resendCount = 0;
+        pingpongSent = 0;
+        resendStart = 0;
         linesSend = 0;
         bytesSend = 0;
         paused = false;
@@ -109,14 +137,19 @@ Printer::Printer(string conf) {
     jobManager = new PrintjobManager(gconfig->getStorageDirectory()+slugName+"/"+"jobs",this);
     modelManager = new PrintjobManager(gconfig->getStorageDirectory()+slugName+"/"+"models",this);
     scriptManager = new PrintjobManager(gconfig->getStorageDirectory()+slugName+"/"+"scripts",this,true);
+    temperatureHistory = new TemperatureHistory(gconfig->getStorageDirectory()+slugName+"/"+"temperatures.bin",extruderCount+1);
+    printerLog = new PrinterLog(gconfig->getStorageDirectory()+slugName+"/"+"log");
 }
 Printer::~Printer() {
-    serial->close();
-    delete state;
+    // ~PrinterSerial joins the io thread, its handlers use everything below
     delete serial;
+    delete state;
+    delete sendWindow;
     delete modelManager;
     delete jobManager;
     delete scriptManager;
+    delete temperatureHistory;
+    delete printerLog;
 }
 void Printer::startThread() {
     assert(!thread);
@@ -133,16 +166,15 @@ void Printer::run() {
     {
         try {
             boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            temperatureHistory->flushIfDue(); // File writes stay off the serial thread
+            printerLog->flushIfDue();
             if(!active) {
-                if(serial->isConnected())
-                    serial->close();
+                serial->close();
                 boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
                 continue; // skip normal usage
             }
-            if(!serial->isConnected()) {
-                boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
-                serial->tryConnect();
-            } else {
+            serial->connect(); // Returns at once, reconnects in the background
+            if(serial->isConnected()) {
                 {
                     time_duration td;
                     {
@@ -167,6 +199,8 @@ void Printer::run() {
 void Printer::stopThread() {
     thread->interrupt();
     thread->join();
+    temperatureHistory->close(); // No Printer is deleted on shutdown
+    printerLog->flush();
 #ifdef DEBUG
     cout << "Thread for printer " << name << " finished" << endl;
 #endif
@@ -175,15 +209,27 @@ void Printer::connectionClosed() {
     jobManager->undoCurrentJob();
     mutex::scoped_lock l(sendMutex);
     manualCommands.clear();
+    garbageCleared = false; // Nothing is sent before the next handshake
 }
 
 void Printer::addResponse(const std::string& msg,uint8_t rtype) {
     mutex::scoped_lock l(responseMutex);
     shared_ptr<PrinterResponse> newres(new PrinterResponse(msg,++lastResponseId,rtype));
     responses.push_back(newres);
+    printerLog->append(newres);
     if(responses.size()>(size_t)gconfig->getBacklogSize())
         responses.pop_front();
 }
+void Printer::addResponses(const ResponseLine *lines,size_t count) {
+    mutex::scoped_lock l(responseMutex);
+    for(size_t i=0;i<count;i++) {
+        shared_ptr<PrinterResponse> newres(new PrinterResponse(lines[i].text,lines[i].length,++lastResponseId,lines[i].rtype));
+        responses.push_back(newres);
+        printerLog->append(newres);
+    }
+    while(responses.size()>(size_t)gconfig->getBacklogSize())
+        responses.pop_front();
+}
 bool Printer::shouldInjectCommand(const std::string& cmd) {
     if(cmd=="@kill") {
         serial->resetPrinter();
@@ -198,14 +244,32 @@ void Printer::injectManualCommand(const std::string& cmd) {
     if(!shouldInjectCommand(cmd)) return;
     {
         mutex::scoped_lock l(sendMutex);
-        manualCommands.push_back(cmd);
+        manualCommands.push_back(QueuedCommand(cmd,LatencyHistogram::now()));
     } // need parantheses to prevent deadlock with trySendNextLine
     trySendNextLine(); // Check if we need to send the command immediately
 }
+size_t Printer::injectManualCommands(const std::vector<std::string>& cmds,std::vector<bool> *queued) {
+    // Filter outside the lock, @kill resets the printer which takes a while
+    std::vector<bool> ok(cmds.size());
+    size_t n = 0;
+    for(size_t i=0;i<cmds.size();i++) {
+        ok[i] = shouldInjectCommand(cmds[i]);
+        if(ok[i]) n++;
+    }
+    if(n) {
+        uint64_t now = LatencyHistogram::now();
+        mutex::scoped_lock l(sendMutex);
+        for(size_t i=0;i<cmds.size();i++)
+            if(ok[i]) manualCommands.push_back(QueuedCommand(cmds[i],now));
+    }
+    if(queued!=NULL) queued->swap(ok);
+    if(n) trySendNextLine();
+    return n;
+}
 void Printer::injectJobCommand(const std::string& cmd) {
     if(!shouldInjectCommand(cmd)) return;
     mutex::scoped_lock l(sendMutex);
-    jobCommands.push_back(cmd);
+    jobCommands.push_back(QueuedCommand(cmd,LatencyHistogram::now()));
     // No need to trigger job commands early. There will most probably follow more very soon
     // and the job should already run.
 }
@@ -249,13 +313,12 @@ void Printer::resendLine(size_t line)
         mutex::scoped_lock l(sendMutex);
         ignoreNextOk = okAfterResend;
         resendError++;
+        resendCount++;
         errorsReceived++;
-        if(!pingpong && errorsReceived==3 && cacheSize>63) {
-            cacheSize = 63;
-        }
         if (pingpong)
             readyForNextSend = true;
         else  {
+            sendWindow->resend(LatencyHistogram::now());
             nackLines.clear();
             receiveCacheFill = 0;
         }
@@ -266,26 +329,40 @@ void Printer::resendLine(size_t line)
             gconfig->createMessage(msg, url);
             serial->resetPrinter();
         }
-        line &=65535;
-        resendLines.clear();
-        bool addLines = false;
-        for(deque<shared_ptr<GCode> >::iterator it=history.begin();it!=history.end();++it) {
-            GCode &gc = **it;
-            if (gc.hasN() && (gc.getN() & 65535) == line)
-                addLines = true;
-            if(addLines) resendLines.push_back(*it);
-        }
-        if (binaryProtocol != 0) {
-            boost::this_thread::sleep(boost::posix_time::milliseconds(320000/baudrate));
-            uint8_t  buf[32];
-            for (int i = 0; i < 32; i++) buf[i] = 0;
-            serial->writeBytes(buf,32);
-            boost::this_thread::sleep(boost::posix_time::milliseconds(320000/baudrate));
-        } else {
-            boost::this_thread::sleep(boost::posix_time::milliseconds(cacheSize*10000/baudrate)); // Wait for buffer to empty
+        // Firmwares may send only the lower 16 bits, take the latest line matching them
+        resendNext = resendEnd = historyLast+1;
+        if(historyCount>0) {
+            int32_t first = historyLast-(int32_t)((uint32_t)(historyLast-(int32_t)line) & 65535);
+            if(historyLast-first<historyCount)
+                resendNext = first;
         }
-    } // unlock mutex or we get deadlock!
-    trySendNextLine();
+        uint64_t now = LatencyHistogram::now();
+        if(resendNext==resendEnd)
+            resendStart = 0; // Line is not in the history, nothing to recover
+        else if(resendStart==0)
+            resendStart = now;
+        // Give the firmware time to drain its buffer. Binary firmware also
+        // gets zero bytes after the first pause to resync its parser.
+        resendHoldUntil = now+resendDrainMicros();
+        resendFlushPending = binaryProtocol != 0;
+        serial->callAfter(resendDrainMicros(),boost::bind(&Printer::trySendNextLine,this));
+    }
+}
+uint64_t Printer::resendDrainMicros() {
+    if (binaryProtocol != 0)
+        return 320000000ULL/baudrate;
+    return (uint64_t)cacheSize*10000000ULL/baudrate;
+}
+void Printer::storeHistory(shared_ptr<GCode> &gc) {
+    if(!gc->hasN()) return;
+    int32_t n = gc->getN();
+    shared_ptr<GCode> &slot = history[n & (HISTORY_SIZE-1)];
+    if(slot==gc) return; // Resent line
+    if(historyCount==0 || n!=historyLast+1)
+        historyCount = 0; // Numbering restarted with M110
+    slot = gc;
+    historyLast = n;
+    if(historyCount<HISTORY_SIZE) historyCount++;
 }
 // manageHOstCmmands is called with sendMutex locked!
 void Printer::manageHostCommand(boost::shared_ptr<GCode> &cmd) {
@@ -309,15 +386,20 @@ void Printer::stopPause() {
     paused = false;
 }
 bool Printer::trySendPacket(GCodeDataPacketPtr &dp,shared_ptr<GCode> &gc) {
-    if((pingpong && readyForNextSend) || (!pingpong && cacheSize>receiveCacheFill+dp->length)) {
-        serial->writeBytes(dp->data,dp->length);
+    // Firmware reporting its free command slots gets at most that many
+    // lines in flight, one line is always allowed so the next ok can come.
+    if((pingpong && readyForNextSend) || (!pingpong && sendWindow->size()>receiveCacheFill+dp->length &&
+        (firmwareBufferFree<0 || nackLines.empty() || (int)nackLines.size()<firmwareBufferFree))) {
+        serial->writePacket(dp);
+        uint64_t now = LatencyHistogram::now();
         if(!pingpong) {
             receiveCacheFill += dp->length;
-            nackLines.push_back(dp->length);
-        } else readyForNextSend = false;
-        history.push_back(gc);
-        if(history.size()>MAX_HISTORY_SIZE)
-            history.pop_front();
+            nackLines.push_back(SentLine(dp->length,gc->hasN() ? gc->getN() : -1,now));
+        } else {
+            readyForNextSend = false;
+            pingpongSent = now;
+        }
+        storeHistory(gc);
         lastCommandSend = boost::posix_time::microsec_clock::local_time();
         bytesSend+=dp->length;
         linesSend++;
@@ -326,24 +408,26 @@ bool Printer::trySendPacket(GCodeDataPacketPtr &dp,shared_ptr<GCode> &gc) {
     }
     return false;
 }
-// Extract the value following a identifier ident until the next space or line end.
-bool Printer::extract(const string& source,const string& ident,string &result)
-{
-    size_t pos = 0; //source.find(ident);
-    size_t len = source.length();
-    do
-    {
-        if(pos>0) pos++;
-        pos = source.find(ident, pos);
-        if (pos == string::npos) return false;
-        if(pos==0) break;
-    } while (source[pos-1]!=' ');
-    size_t start = pos + ident.length();
-    while(start<len && source[pos]==' ') start++;
-    size_t end = start;
-    while (end < len && source[end] != ' ') end++;
-    result = source.substr(start,end-start);
-    return true;
+void Printer::acknowledgeLine(int32_t line) {
+    uint64_t now = LatencyHistogram::now();
+    if(pingpong) {
+        if(pingpongSent) latency.ack.record(now-pingpongSent);
+        pingpongSent = 0;
+        return;
+    }
+    size_t count = nackLines.empty() ? 0 : 1;
+    if(line>=0)
+        for(size_t i=0;i<nackLines.size();i++)
+            if(nackLines[i].line==line) {
+                count = i+1;
+                break;
+            }
+    while(count-->0) {
+        latency.ack.record(now-nackLines.front().sent);
+        sendWindow->acknowledged(now-nackLines.front().sent,now);
+        receiveCacheFill-= nackLines.front().length;
+        nackLines.pop_front();
+    }
 }
 void Printer::trySendNextLine() {
     if (!garbageCleared) return;
@@ -352,23 +436,39 @@ void Printer::trySendNextLine() {
     if (!serial->isConnected()) {return;} // Not ready yet
     shared_ptr<GCode> gc;
     GCodeDataPacketPtr dp;
+    if (resendHoldUntil) {
+        uint64_t now = LatencyHistogram::now();
+        if(now<resendHoldUntil) return; // The timer calls again
+        if(resendFlushPending) {
+            serial->writePacket(resendFlushPacket);
+            resendFlushPending = false;
+            resendHoldUntil = now+resendDrainMicros();
+            serial->callAfter(resendDrainMicros(),boost::bind(&Printer::trySendNextLine,this));
+            return;
+        }
+        resendHoldUntil = 0;
+    }
     // first resolve old communication problems
-    if (resendLines.size()>0) {
-        gc = resendLines.front();
+    if (resendNext!=resendEnd) {
+        gc = history[resendNext & (HISTORY_SIZE-1)];
         if (binaryProtocol == 0 || gc->forceASCII)
             dp = gc->getAscii(true,true);
         else
             dp = gc->getBinary();
         if(trySendPacket(dp,gc))
         {
-            //[rhlog addText:[@"Resend: " stringByAppendingString:[gc getAsciiWithLine:YES withChecksum:YES]]];
+            resendNext++;
+            if(resendNext==resendEnd && resendStart) {
+                latency.resendRecovery.record(LatencyHistogram::now()-resendStart);
+                resendStart = 0;
+            }
         }
         return;
     }
     if (resendError > 0) resendError--; // Drop error counter
                                         // then check for manual commands
     if (manualCommands.size() > 0)  {
-        gc = shared_ptr<GCode>(new GCode(*this,manualCommands.front()));
+        gc = shared_ptr<GCode>(new GCode(*this,manualCommands.front().command));
         if (gc->hostCommand)
         {
             manageHostCommand(gc);
@@ -382,6 +482,7 @@ void Printer::trySendNextLine() {
         else
             dp = gc->getBinary();
         if(trySendPacket(dp,gc)) {
+            latency.queueWait.record(LatencyHistogram::now()-manualCommands.front().queued);
             manualCommands.pop_front();
             state->analyze(*gc);
         } else if(gc->hasN() && !(gc->hasM() && gc->getM()==110)) state->decreaseLastline();
@@ -389,7 +490,7 @@ void Printer::trySendNextLine() {
     }
     // do we have a printing job?
     if (jobCommands.size()>0 && !paused)  {
-        gc = shared_ptr<GCode>(new GCode(*this,jobCommands.front()));
+        gc = shared_ptr<GCode>(new GCode(*this,jobCommands.front().command));
         if (gc->hostCommand)
         {
             manageHostCommand(gc);
@@ -403,71 +504,98 @@ void Printer::trySendNextLine() {
         else
             dp = gc->getBinary();
         if(trySendPacket(dp,gc)) {
+            latency.fileToWire.record(LatencyHistogram::now()-jobCommands.front().queued);
             jobCommands.pop_front();
             state->analyze(*gc);
         } else if(gc->hasN() && !(gc->hasM() && gc->getM()==110)) state->decreaseLastline();
         return;
     }
 }
-void Printer::analyseResponse(string &res) {
+void Printer::beginHandshake() {
+    {
+        mutex::scoped_lock l(sendMutex);
+        state->reset();
+        // [job killJob]; // continuing the old job makes no sense, better save the plastic
+        for(int i=0;i<HISTORY_SIZE;i++)
+            history[i].reset();
+        historyCount = 0;
+        resendNext = resendEnd = 0;
+        resendHoldUntil = 0;
+        resendFlushPending = false;
+        readyForNextSend = true;
+        ignoreNextOk = false;
+        nackLines.clear();
+        receiveCacheFill = 0;
+        firmwareBufferFree = firmwarePlannerFree = -1;
+        garbageCleared = true;
+        manualCommands.clear();
+        jobManager->undoCurrentJob();
+    }
+    injectManualCommand("M110 N0");
+    injectManualCommand("M115");
+}
+void Printer::analyseResponses(ResponseLine *lines,size_t count) {
+    size_t i = 0;
+    while(i<count) {
+        // Lines up to a start share one state lock, the start resets the state
+        size_t n = state->analyseResponses(lines+i,count-i);
+        for(size_t j=i;j<i+n;j++)
+            if(lines[j].info.ok || lines[j].info.wait) lines[j].rtype = 2;
+        addResponses(lines+i,n);
+        for(size_t j=i;j<i+n;j++)
+            handleResponse(lines[j]);
+        i += n;
+    }
+}
+/** Returns true if text contains "start". */
+static bool containsStart(const char *text,size_t length) {
+    for(size_t i=0;i+5<=length;i++)
+        if(text[i]=='s' && memcmp(text+i,"start",5)==0) return true;
+    return false;
+}
+void Printer::handleResponse(ResponseLine &r) {
 #ifdef DEBUG
-    //   cout << "Response:" << res << endl;
+    //   cout << "Response:" << string(r.text,r.length) << endl;
 #endif
-    uint8_t rtype = 4;
-    while(res.length()>0 && res[0]<32)
-        res = res.substr(1);
-    string h;
-    
-    state->analyseResponse(res,rtype); // Update state variables
-    size_t fpos = res.find("start");
-    if (fpos==0 ||
-        (garbageCleared==false && fpos!=string::npos))
+    ResponseInfo &info = r.info;
+    if (info.start ||
+        (garbageCleared==false && containsStart(r.text,r.length)))
     {
-        {
-            mutex::scoped_lock l(sendMutex);
-            state->reset();
-            // [job killJob]; // continuing the old job makes no sense, better save the plastic
-            history.clear();
-            readyForNextSend = true;
-            nackLines.clear();
-            receiveCacheFill = 0;
-            garbageCleared = true;
-            manualCommands.clear();
-            jobManager->undoCurrentJob();
-        }
-        injectManualCommand("M110 N0");
-        injectManualCommand("M115");
-   }
-    if (extract(res,"Resend:",h))
+        serial->startReceived();
+        beginHandshake();
+    }
+    if (info.resend>=0)
     {
-        size_t line = atoi(h.c_str());
-        resendLine(line);
+        resendLine(info.resend);
     }
-    else if (res.find("ok")==0)
+    else if (info.ok)
     {
-        rtype = 2;
         garbageCleared = true;
+        if(serial->getLinkState()==PrinterSerial::LINK_HANDSHAKE) {
+            uint64_t t = serial->handshakeDone();
+            mutex::scoped_lock l(sendMutex);
+            if(t) latency.connect.record(t);
+        }
         //if(Main.main.logView.toolACK.Checked)
         //    log(res, true, level);
         if (!ignoreNextOk)  // ok in response of resend?
         {
-            if (pingpong) readyForNextSend = true;
-            else
             {
                 mutex::scoped_lock l(sendMutex);
-                if (nackLines.size() > 0) {
-                    receiveCacheFill-= nackLines.front();
-                    nackLines.pop_front();
+                acknowledgeLine(info.okLine);
+                if(info.bufferFree>=0) {
+                    firmwareBufferFree = info.bufferFree;
+                    firmwarePlannerFree = info.plannerFree;
                 }
             }
+            if (pingpong) readyForNextSend = true;
             resendError = 0;
             trySendNextLine();
         } else
             ignoreNextOk = false;
     }
-    else if (res=="wait") 
+    else if (info.wait)
     {
-        rtype = 2;
         mutex::scoped_lock l(sendMutex);
         boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
         time_duration td(now-lastCommandSend);
@@ -481,7 +609,6 @@ void Printer::analyseResponse(string &res) {
         }
         resendError = 0;
     }
-    addResponse(res,rtype);
     trySendNextLine();
 }
 
@@ -495,8 +622,48 @@ bool Printer::getActive() {
 void Printer::setActive(bool v) {
     active = v;
 }
-void Printer::getJobStatus(json_spirit::Object &obj) {
-    jobManager->getJobStatus(obj);
+void Printer::writeJobStatus(JSONWriter &w) {
+    jobManager->writeJobStatus(w);
+}
+void Printer::getMetrics(PrinterMetrics &m) {
+    m.online = serial->isConnected();
+    {
+        mutex::scoped_lock l(sendMutex);
+        m.linesSend = linesSend;
+        m.bytesSend = bytesSend;
+        m.resends = resendCount;
+        m.errorsReceived = errorsReceived;
+        m.resendError = resendError;
+        m.manualQueue = manualCommands.size();
+        m.jobQueue = jobCommands.size();
+        m.receiveCacheFill = receiveCacheFill;
+        m.cacheSize = cacheSize;
+        m.sendWindow = sendWindow->size();
+        m.firmwareBufferFree = firmwareBufferFree;
+        m.firmwarePlannerFree = firmwarePlannerFree;
+        m.historySize = historyCount;
+    }
+    {
+        mutex::scoped_lock l(responseMutex);
+        m.responseBacklog = responses.size();
+    }
+    m.jobDone = 0;
+    m.jobRunning = jobManager->getJobProgress(m.jobDone);
+    PrinterStateSnapshot s;
+    state->getSnapshot(s);
+    m.serialStalls = s.serialStalls;
+    m.serialStallSeconds = s.serialStallMicros/1000000.0;
+}
+void Printer::getLatency(PrinterLatency &l) {
+    mutex::scoped_lock lock(sendMutex);
+    l = latency;
+}
+void Printer::writeSendWindow(JSONWriter &w) {
+    mutex::scoped_lock lock(sendMutex);
+    sendWindow->writeJSON(w,LatencyHistogram::now());
+    w.pair("linesInFlight",(int)nackLines.size());
+    w.pair("firmwareBufferFree",firmwareBufferFree);
+    w.pair("firmwarePlannerFree",firmwarePlannerFree);
 }
 void Printer::fillJSONObject(json_spirit::Object &obj) {
     using namespace json_spirit;
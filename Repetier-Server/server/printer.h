@@ -22,6 +22,7 @@
 #include <iostream>
 #include "libconfig.h++"
 #include <deque>
+#include <vector>
 #include <list>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
@@ -29,10 +30,11 @@
 #include "json_spirit_value.h"
 #include <boost/cstdint.hpp>
 #include "GCode.h"
+#include "LatencyHistogram.h"
 
 using namespace boost;
 
-#define MAX_HISTORY_SIZE 50
+#define HISTORY_SIZE 64 ///< Sent lines kept for resends, must be a power of 2
 
 class PrinterSerial;
 class PrinterState;
@@ -40,6 +42,11 @@ class PrintjobManager;
 class Printjob;
 class GCode;
 class GCodeDataPacket;
+class JSONWriter;
+class SendWindow;
+class TemperatureHistory;
+class PrinterLog;
+struct ResponseLine;
 
 class PrinterResponse {
 public:
@@ -54,8 +61,31 @@ public:
      */
     uint8_t logtype;
     PrinterResponse(const std::string& message,uint32_t id,uint8_t tp);
+    PrinterResponse(const char *message,size_t length,uint32_t id,uint8_t tp);
     std::string getTimeString();
 };
+/** A command waiting in a send queue. */
+class QueuedCommand {
+public:
+    std::string command;
+    uint64_t queued; ///< LatencyHistogram::now() when it was queued
+    QueuedCommand(const std::string& com,uint64_t t):command(com),queued(t) {}
+};
+/** A line sent to the printer and not yet acknowledged. */
+struct SentLine {
+    int length;
+    int32_t line; ///< Line number or -1
+    uint64_t sent; ///< LatencyHistogram::now() when it was written
+    SentLine(int l,int32_t n,uint64_t t):length(l),line(n),sent(t) {}
+};
+/** Copies of the communication timing histograms of a printer. */
+struct PrinterLatency {
+    LatencyHistogram ack; ///< From writing a line to its ok
+    LatencyHistogram queueWait; ///< Manual commands from queueing to writing
+    LatencyHistogram fileToWire; ///< Job commands from reading the file to writing
+    LatencyHistogram resendRecovery; ///< From a resend request until all requested lines are sent again
+    LatencyHistogram connect; ///< From losing or requesting the connection until the handshake is answered
+};
 class PrinterHistoryLine {
 public:
     uint32_t line;
@@ -63,12 +93,37 @@ public:
     PrinterHistoryLine(const std::string& com,int l):command(com),line(l) {}
 };
 
+/** Snapshot of the communication counters of a printer. */
+struct PrinterMetrics {
+    bool online;
+    uint64_t linesSend;
+    uint64_t bytesSend;
+    uint64_t resends; ///< Resend requests received
+    uint64_t errorsReceived;
+    int resendError; ///< Recent resend requests, drops with each ok
+    size_t manualQueue;
+    size_t jobQueue;
+    int receiveCacheFill;
+    int cacheSize;
+    int sendWindow; ///< Bytes currently allowed in flight
+    int firmwareBufferFree; ///< Last reported free command slots, -1 without ADVANCED_OK
+    int firmwarePlannerFree; ///< Last reported free planner slots, -1 without ADVANCED_OK
+    size_t historySize;
+    size_t responseBacklog;
+    bool jobRunning;
+    double jobDone; ///< Percent done of the running job
+    uint32_t serialStalls; ///< Times the serial thread waited for the state lock
+    double serialStallSeconds; ///< Total time the serial thread waited for the state lock
+};
+
 class Printer {
     friend class PrintjobManager;
     libconfig::Config config;
     PrintjobManager *jobManager;
     PrintjobManager *modelManager;
     PrintjobManager *scriptManager;
+    TemperatureHistory *temperatureHistory;
+    PrinterLog *printerLog; ///< Persistent copy of all responses
     volatile bool stopRequested;
     boost::shared_ptr<boost::thread> thread;
     boost::mutex mutex;
@@ -80,12 +135,23 @@ class Printer {
     boost::posix_time::ptime lastTemp; ///< Last temp read. Always access with lastTempMutex
     boost::mutex lastTempMutex;
     void run();
-    bool extract(const std::string& source,const std::string& ident,std::string &result);
-	std::deque<std::string> manualCommands; ///< Buffer of manual commands to send.
-	std::deque<std::string> jobCommands; ///< Buffer of commands comming from a job. Not necessaryly the complete job! Job may refill the buffer if it gets empty.
-	std::deque<boost::shared_ptr<GCode> > history; ///< Buffer of the last commands send.
-	std::deque<boost::shared_ptr<GCode> > resendLines; ///< Lines for which a resend was requested.
-	std::deque<int> nackLines; ///< Length of unacknowledged lines send.
+	std::deque<QueuedCommand> manualCommands; ///< Buffer of manual commands to send.
+	std::deque<QueuedCommand> jobCommands; ///< Buffer of commands comming from a job. Not necessaryly the complete job! Job may refill the buffer if it gets empty.
+	boost::shared_ptr<GCode> history[HISTORY_SIZE]; ///< Last numbered lines send, indexed by line number
+    int32_t historyLast; ///< Number of the newest line in history
+    int historyCount; ///< Consecutive lines in history ending with historyLast
+    int32_t resendNext; ///< Next line to send again, equals resendEnd if no resend is pending
+    int32_t resendEnd; ///< Line after the last one to send again
+    uint64_t resendHoldUntil; ///< No lines are sent before this time, 0 if not holding
+    bool resendFlushPending; ///< Zero bytes for the binary parser are due when the hold ends
+    GCodeDataPacketPtr resendFlushPacket; ///< 32 zero bytes that end a broken binary command
+	std::deque<SentLine> nackLines; ///< Unacknowledged lines send.
+    uint64_t pingpongSent; ///< Send time of the unacknowledged line in pingpong mode
+    uint64_t resendStart; ///< Time of the first unfinished resend request, 0 if none
+    PrinterLatency latency; ///< Guarded by sendMutex
+    SendWindow *sendWindow; ///< Flow control without pingpong, guarded by sendMutex
+    int firmwareBufferFree; ///< Free command slots reported with the last ok, -1 if unknown
+    int firmwarePlannerFree; ///< Free planner slots reported with the last ok, -1 if unknown
     // Communication handline
     bool readyForNextSend; ///< In pingpong mode indicates that ok was received for the last line.
     bool garbageCleared;
@@ -93,18 +159,25 @@ class Printer {
     int receiveCacheFill; ///< Bytes send to the printer that are not acknowledged.
     int resendError;
     int errorsReceived;
+    uint64_t resendCount; ///< Resend requests since start, only grows
     boost::posix_time::ptime lastCommandSend;
     int linesSend;
     std::size_t bytesSend;
     bool paused;
     int updateTempEvery;
     
-    /** Resend all lines starting with line. Removes all commands stored in
-     history until the given line and moves them instead into the resendLines buffer.
+    /** Resend all lines starting with line. The lines stay in history,
+     sending continues there after the firmware had time to drain its
+     buffer. Does not wait, a timer of the serial connection resumes sending.
      
      @param line first line to resend.
      */
     void resendLine(size_t line);
+    /** Stores a numbered line in history. Caller must hold sendMutex. */
+    void storeHistory(boost::shared_ptr<GCode> &gc);
+    /** Time the firmware needs to drain its receive buffer after a resend
+     request. */
+    uint64_t resendDrainMicros();
     /** Trys to send a GCodeDataPacket. Returns true if the cache rules
      allowed sending. If it was successfull, the line is send and also stored 
      in the history.
@@ -112,6 +185,12 @@ class Printer {
      @params gc gcode to save in history.
      @returns true on success. */
     bool trySendPacket(GCodeDataPacketPtr &dp,boost::shared_ptr<GCode> &gc);
+    /** Records the ack latency of the oldest unacknowledged line and removes
+     it. If the ok named its line and that line is unacknowledged, all lines
+     up to it are removed, so a lost ok does not leave a byte count behind.
+     Caller must hold sendMutex.
+     @param line Line number from the ok or -1. */
+    void acknowledgeLine(int32_t line);
     void trySendNextLine(); // Send another line if possible
     void close();
     /** If a line contains a host command starting with @ it is handled in
@@ -119,6 +198,8 @@ class Printer {
      for the running host. Others like @pause are executed.
      */
     void manageHostCommand(boost::shared_ptr<GCode> &cmd);
+    /** Reacts on start, resend, ok and wait in an analysed response. */
+    void handleResponse(ResponseLine &r);
 public:
     double xmin,xmax;
     double ymin,ymax;
@@ -146,12 +227,18 @@ public:
     
     void updateLastTempMutex();
 
-    /** The serial reader calls this for each line received. */
-    void analyseResponse(std::string &resp);
+    /** Resets the communication state and queues M110 and M115. Called when
+     the firmware sent start or did not send it in time after a reset. */
+    void beginHandshake();
+    /** The serial reader calls this with all lines of one read. The lines
+     point into its receive buffer and are only valid during the call. */
+    void analyseResponses(ResponseLine *lines,size_t count);
     
     /** Add response string to list of responses. Removes oldest response if the
      list gets too long. Thread safe. */
     void addResponse(const std::string& msg,uint8_t rtype);
+    /** Adds several response lines with one lock. Thread safe. */
+    void addResponses(const ResponseLine *lines,size_t count);
     /** Returns a list with responses, where id is greater as the given response id.
      That way a client can keep track of all responses return from the printer.
      Thread safe. 
@@ -164,6 +251,14 @@ public:
     bool shouldInjectCommand(const std::string& cmd);
     /** Push a new manual command into the command queue. Thread safe. */
     void injectManualCommand(const std::string& cmd);
+    /** Push several manual commands into the command queue in one locked
+     operation, so they can not interleave with other manual commands.
+     Thread safe.
+     @param cmds Commands in send order.
+     @param queued If not NULL, receives for each command if it was queued.
+     @returns Number of queued commands.
+     */
+    size_t injectManualCommands(const std::vector<std::string>& cmds,std::vector<bool> *queued);
     /** Push a new command into the job queue. Thread safe. */
     void injectJobCommand(const std::string& cmd);
     /** Number of job commands stored */
@@ -173,11 +268,20 @@ public:
     int getOnlineStatus();
     bool getActive();
     void setActive(bool v);
-    void getJobStatus(json_spirit::Object &obj);
+    void writeJobStatus(JSONWriter &w);
+    /** Copies the communication counters into m. Thread safe. */
+    void getMetrics(PrinterMetrics &m);
+    /** Copies the timing histograms into l. Thread safe. */
+    void getLatency(PrinterLatency &l);
+    /** Writes the state of the send window as members of the current
+     JSON object. Thread safe. */
+    void writeSendWindow(JSONWriter &w);
     void connectionClosed();
     inline PrintjobManager *getJobManager() {return jobManager;}
     inline PrintjobManager *getModelManager() {return modelManager;}
     inline PrintjobManager *getScriptManager() {return scriptManager;}
+    inline TemperatureHistory *getTemperatureHistory() {return temperatureHistory;}
+    inline PrinterLog *getLog() {return printerLog;}
     /** Stop previous pause command */
     void stopPause();
     // Public interthread communication methods
@@ -0,0 +1,116 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <fstream>
+#include "BenchmarkSupport.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+uint64_t bench::cpuMicros() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return (uint64_t)(ru.ru_utime.tv_sec+ru.ru_stime.tv_sec)*1000000+ru.ru_utime.tv_usec+ru.ru_stime.tv_usec;
+}
+void bench::generateJob(const string &filename,int lines) {
+    ofstream out(filename.c_str());
+    out << "; generated benchmark job" << endl << "G21" << endl << "G90" << endl << "G92 E0" << endl;
+    double e = 0,z = 0.3;
+    int n = 4;
+    out << "G1 Z0.300 F3000" << endl;
+    char b[100];
+    for(int layer=0;n<lines;layer++) {
+        for(int i=0;i<400 && n<lines;i++,n++) {
+            double a = i*0.0157;
+            double x = 100+40*cos(a)*(1+layer%3*0.1);
+            double y = 100+40*sin(a)*(1+layer%5*0.07);
+            e += 0.03117;
+            if(i==0)
+                snprintf(b,sizeof(b),"G1 X%.3f Y%.3f E%.5f F1800",x,y,e);
+            else
+                snprintf(b,sizeof(b),"G1 X%.3f Y%.3f E%.5f",x,y,e);
+            out << b << endl;
+        }
+        z += 0.2;
+        snprintf(b,sizeof(b),"G1 E%.5f F2400\nG1 Z%.3f F3000\nG1 E%.5f F2400",e-1.0,z,e);
+        out << b << endl;
+        n += 3;
+    }
+    out << "M104 S0" << endl;
+}
+void bench::writeServerConfig(const fs::path &dir,const string &ports,const string &website,const string &languages) {
+    fs::create_directories(dir/"storage");
+    fs::create_directories(dir/"printers");
+    ofstream conf((dir/"server.conf").string().c_str());
+    conf << "printer_config_directory=\"" << (dir/"printers").string() << "/\";" << endl
+    << "data_storage_directory=\"" << (dir/"storage").string() << "/\";" << endl
+    << "website_directory=\"" << website << "/\";" << endl
+    << "languages_directory=\"" << languages << "/\";" << endl
+    << "default_language=\"en\";" << endl
+    << "ports=\"" << ports << "\";" << endl;
+}
+void bench::writePrinterConfig(const fs::path &dir,const string &slug,const string &device,int baudrate,int protocol,int cacheSize,bool pingpong) {
+    fs::create_directories(dir/"printers");
+    ofstream pconf((dir/"printers"/(slug+".cfg")).string().c_str());
+    pconf << "version=\"1.0\";" << endl << "active=true;" << endl
+    << "printer:{ name=\"Benchmark " << slug << "\"; slugName=\"" << slug << "\";" << endl
+    << " connection:{ device=\"" << device << "\"; baudrate=" << baudrate << "; pingPong=" << (pingpong ? "true" : "false")
+    << "; readCacheSize=" << cacheSize << "; protocol=" << protocol << "; okAfterResend=true; };" << endl
+    << " dimension:{ xmin=0.0; ymin=0.0; zmin=0.0; xmax=200.0; ymax=200.0; zmax=200.0; };" << endl
+    << " homing:{ xhome=0.0; yhome=0.0; zhome=0.0; };" << endl
+    << " speed:{ xaxis=50.0; yaxis=50.0; zaxis=2.0; eaxisExtrude=2.0; eaxisRetract=20.0; };" << endl
+    << " extruder:{ count=1; tempUpdateEvery=1; };" << endl << "};" << endl;
+}
+void bench::writeConfigs(const fs::path &dir,const string &device,int baudrate,int protocol,int cacheSize,bool pingpong) {
+    writeServerConfig(dir,"0",dir.string(),dir.string());
+    writePrinterConfig(dir,"bench",device,baudrate,protocol,cacheSize,pingpong);
+}
+void bench::generateResponses(const string &filename,int lines) {
+    ofstream out(filename.c_str());
+    out << "start" << endl
+    << "FIRMWARE_NAME:Repetier_0.80 FIRMWARE_URL:https://github.com/repetier/Repetier-Firmware/ PROTOCOL_VERSION:1.0 MACHINE_TYPE:Mendel EXTRUDER_COUNT:1 REPETIER_PROTOCOL:2" << endl;
+    char b[120];
+    for(int i=2;i<lines;i++) {
+        if(i%50==0) {
+            snprintf(b,sizeof(b),"T:%.2f /%.0f B:%.2f /%.0f B@:%d @:%d",205.3+(i%7)*0.1,205.0,60.1-(i%3)*0.1,60.0,i%255,(i*7)%255);
+            out << b << endl;
+        } else if(i%997==0) {
+            out << "Resend:" << i << endl;
+        } else if(i%1499==0) {
+            out << "wait" << endl;
+        } else if(i%311==0) {
+            out << "X:100.00 Y:112.50 Z:0.30 E:1234.5678" << endl;
+        } else
+            out << "ok" << endl;
+    }
+}
+const char *bench::architecture() {
+#if defined(__x86_64__) || defined(_M_X64)
+    return "x86_64";
+#elif defined(__i386__) || defined(_M_IX86)
+    return "x86";
+#elif defined(__aarch64__)
+    return "aarch64";
+#elif defined(__arm__)
+    return "arm";
+#else
+    return "unknown";
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__BenchmarkSupport__
+#define __Repetier_Server__BenchmarkSupport__
+
+#include <iostream>
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+
+/** Helpers shared by the benchmark tools. */
+namespace bench {
+    /** User plus system CPU time of this process in microseconds. */
+    extern uint64_t cpuMicros();
+    /** Writes a job that looks like slicer output: perimeters and infill
+     with extrusion, layer changes and retracts. */
+    extern void generateJob(const std::string &filename,int lines);
+    /** Writes a response log like a Repetier firmware produces while
+     printing: mostly ok, temperatures, some wait and resend lines. */
+    extern void generateResponses(const std::string &filename,int lines);
+    /** Writes dir/server.conf with storage and printer configurations
+     below dir. ports is the mongoose listening_ports value, website and
+     languages are directories. */
+    extern void writeServerConfig(const boost::filesystem::path &dir,const std::string &ports,const std::string &website,const std::string &languages);
+    /** Writes dir/printers/<slug>.cfg for a printer connected to device. */
+    extern void writePrinterConfig(const boost::filesystem::path &dir,const std::string &slug,const std::string &device,int baudrate,int protocol,int cacheSize,bool pingpong);
+    /** Writes server.conf and printers/bench.cfg into dir for a printer
+     with slug "bench" connected to device. */
+    extern void writeConfigs(const boost::filesystem::path &dir,const std::string &device,int baudrate,int protocol,int cacheSize,bool pingpong);
+    /** Name of the CPU architecture the tool was compiled for. */
+    extern const char *architecture();
+}
+
+#endif /* defined(__Repetier_Server__BenchmarkSupport__) */
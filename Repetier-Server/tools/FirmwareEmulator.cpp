@@ -0,0 +1,650 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "FirmwareEmulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/bind.hpp>
+
+using namespace std;
+
+#define BOOT_MICROS 200000 // Time between opening the port and "start"
+#define BURST_BYTES 64 // Bytes that may pass the pacing at once, like a USB packet
+#define MAX_LINE 256 // Longer ASCII lines are cut
+#define IDLE_MICROS 1000000 // Gaps longer than this count as idle host, not as starving
+#define RESEND_SKIP 30 // Lines Repetier firmware ignores while it waits for a resend
+#define AMBIENT 20.0
+
+FirmwareEmulatorConfig::FirmwareEmulatorConfig() {
+    flavor = REPETIER;
+    baudrate = 115200;
+    receiveBuffer = 127;
+    commandQueue = 4;
+    moveMicros = 0;
+    commandMicros = 0;
+    corruptRate = 0;
+    protocol = 2;
+    advancedOk = false;
+    extruderCount = 1;
+    heatSeconds = 1.0;
+    seed = 1;
+}
+void FirmwareEmulatorStats::writeJSON(ostream &out) const {
+    out << "{\"connects\":" << connects
+    << ",\"bytesReceived\":" << bytesReceived
+    << ",\"bytesSent\":" << bytesSent
+    << ",\"asciiLines\":" << asciiLines
+    << ",\"binaryLines\":" << binaryLines
+    << ",\"commandsExecuted\":" << commandsExecuted
+    << ",\"checksumErrors\":" << checksumErrors
+    << ",\"lineNumberErrors\":" << lineNumberErrors
+    << ",\"corruptedLines\":" << corruptedLines
+    << ",\"overflowBytes\":" << overflowBytes
+    << ",\"resendsRequested\":" << resendsRequested
+    << ",\"okSent\":" << okSent
+    << ",\"starveCount\":" << starveCount
+    << ",\"starveP50Micros\":" << starveP50Micros
+    << ",\"starveP99Micros\":" << starveP99Micros
+    << ",\"starveMaxMicros\":" << starveMaxMicros
+    << "}";
+}
+FirmwareEmulator::Command::Command() {
+    n = m = g = t = -1;
+    hasS = hasX = hasY = hasZ = hasE = hasF = false;
+    s = x = y = z = e = f = 0;
+}
+FirmwareEmulator::FirmwareEmulator(const FirmwareEmulatorConfig &c):config(c) {
+    master = -1;
+    stopRequested = false;
+    memset(&stats,0,sizeof(stats));
+    randomState = c.seed ? c.seed : 1;
+    connected = false;
+    reset();
+}
+FirmwareEmulator::~FirmwareEmulator() {
+    stop();
+    if(master>=0) ::close(master);
+}
+uint64_t FirmwareEmulator::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+double FirmwareEmulator::random() {
+    // xorshift32, own generator so runs are reproducible on all platforms
+    randomState ^= randomState<<13;
+    randomState ^= randomState>>17;
+    randomState ^= randomState<<5;
+    return (double)randomState/4294967296.0;
+}
+void FirmwareEmulator::reset() {
+    booted = false;
+    inTokens = outTokens = BURST_BYTES;
+    lastPace = lastInput = lastWait = lastHeatUpdate = lastHeatReport = now();
+    rxBuffer.clear();
+    output.clear();
+    starveStart = 0;
+    line.clear();
+    binary = false;
+    binarySize = 0;
+    lastN = 0;
+    waitingForResend = -1;
+    queue.clear();
+    running = false;
+    busyUntil = 0;
+    heating = false;
+    temp.assign(config.extruderCount,AMBIENT);
+    target.assign(config.extruderCount,0);
+    bedTemp = AMBIENT;
+    bedTarget = 0;
+    activeExtruder = 0;
+    posX = posY = posZ = posE = 0;
+}
+const string &FirmwareEmulator::open() {
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master<0 || grantpt(master)!=0 || unlockpt(master)!=0)
+        throw runtime_error(string("Could not create pseudo terminal: ")+strerror(errno));
+    slaveName = ptsname(master);
+    // Raw mode is a property of the terminal and survives until the host
+    // opens the slave, so nothing gets echoed back before it configures it.
+    int slave = ::open(slaveName.c_str(),O_RDWR | O_NOCTTY);
+    if(slave>=0) {
+        struct termios ios;
+        if(tcgetattr(slave,&ios)==0) {
+            cfmakeraw(&ios);
+            tcsetattr(slave,TCSANOW,&ios);
+        }
+        ::close(slave);
+    }
+    fcntl(master,F_SETFL,fcntl(master,F_GETFL) | O_NONBLOCK);
+    return slaveName;
+}
+void FirmwareEmulator::start() {
+    stopRequested = false;
+    thread.reset(new boost::thread(boost::bind(&FirmwareEmulator::run,this)));
+}
+void FirmwareEmulator::stop() {
+    stopRequested = true;
+    if(thread.get()) {
+        thread->join();
+        thread.reset();
+    }
+}
+void FirmwareEmulator::getStats(FirmwareEmulatorStats &s) {
+    boost::mutex::scoped_lock l(statsMutex);
+    s = stats;
+    s.starveCount = starveTimes.size();
+    s.starveP50Micros = s.starveP99Micros = s.starveMaxMicros = 0;
+    if(starveTimes.empty()) return;
+    vector<uint32_t> sorted(starveTimes);
+    sort(sorted.begin(),sorted.end());
+    s.starveP50Micros = sorted[sorted.size()/2];
+    s.starveP99Micros = sorted[min(sorted.size()-1,(size_t)(sorted.size()*0.99))];
+    s.starveMaxMicros = sorted.back();
+}
+void FirmwareEmulator::recordStarve(uint64_t micros) {
+    if(micros<IDLE_MICROS && starveTimes.size()<(1<<22))
+        starveTimes.push_back((uint32_t)micros);
+}
+void FirmwareEmulator::send(const string &s) {
+    output += s;
+    output += '\n';
+}
+void FirmwareEmulator::sendOk(const string &s) {
+    send("ok"+s);
+    stats.okSent++;
+    // The host now knows that the firmware has room again
+    if(rxBuffer.empty() && starveStart==0)
+        starveStart = now();
+}
+void FirmwareEmulator::requestResend(const char *reason) {
+    char b[120];
+    stats.resendsRequested++;
+    if(config.flavor==FirmwareEmulatorConfig::MARLIN) {
+        snprintf(b,sizeof(b),"Error:%s, Last Line: %d",reason,lastN);
+        send(b);
+        snprintf(b,sizeof(b),"Resend: %d",lastN+1);
+        send(b);
+    } else {
+        snprintf(b,sizeof(b),"Error:%s",reason);
+        send(b);
+        snprintf(b,sizeof(b),"Resend:%d",lastN+1);
+        send(b);
+        waitingForResend = RESEND_SKIP;
+    }
+    sendOk();
+}
+void FirmwareEmulator::pace(uint64_t t) {
+    if(config.baudrate<=0) {
+        inTokens = outTokens = 1e9;
+        return;
+    }
+    double add = (double)(t-lastPace)*config.baudrate/10.0/1000000.0;
+    lastPace = t;
+    inTokens = min(inTokens+add,(double)BURST_BYTES);
+    outTokens = min(outTokens+add,(double)BURST_BYTES);
+}
+bool FirmwareEmulator::readInput(uint64_t t) {
+    uint8_t buf[4096];
+    size_t want = (size_t)min(inTokens,(double)sizeof(buf));
+    if(want==0) return true;
+    ssize_t r = ::read(master,buf,want);
+    if(r<0)
+        return errno==EAGAIN || errno==EINTR; // EIO: host closed the port
+    if(r==0) return true;
+    inTokens -= r;
+    stats.bytesReceived += r;
+    lastInput = t;
+    if(starveStart) {
+        recordStarve(t-starveStart);
+        starveStart = 0;
+    }
+    if(!booted) return true; // Bootloader ignores everything
+    for(ssize_t i=0;i<r;i++) {
+        if(rxBuffer.size()<(size_t)config.receiveBuffer)
+            rxBuffer.push_back(buf[i]);
+        else
+            stats.overflowBytes++;
+    }
+    return true;
+}
+void FirmwareEmulator::writeOutput() {
+    if(output.empty()) return;
+    size_t n = (size_t)min(outTokens,(double)output.size());
+    if(n==0) return;
+    ssize_t w = ::write(master,output.data(),n);
+    if(w<=0) return;
+    outTokens -= w;
+    stats.bytesSent += w;
+    output.erase(0,w);
+}
+size_t FirmwareEmulator::binaryPacketSize(const vector<uint8_t> &p) {
+    if(p.size()<2) return 0;
+    uint16_t fields = p[0] | (p[1]<<8);
+    bool text = (fields & 32768)!=0;
+    size_t size = 2; // checksum
+    if(fields & 4096) { // V2
+        if(p.size()<4 || (text && p.size()<5)) return 0;
+        uint16_t fields2 = p[2] | (p[3]<<8);
+        size += 4;
+        if(text) size += 1+p[4];
+        if(fields & 1) size += 2;
+        if(fields & 2) size += 2;
+        if(fields & 4) size += 2;
+        if(fields2 & 1) size += 4;
+        if(fields2 & 2) size += 4;
+        if(fields2 & 4) size += 4;
+    } else {
+        size += 2;
+        if(text) size += 16;
+        if(fields & 1) size += 2;
+        if(fields & 2) size += 1;
+        if(fields & 4) size += 1;
+    }
+    if(fields & 8) size += 4;
+    if(fields & 16) size += 4;
+    if(fields & 32) size += 4;
+    if(fields & 64) size += 4;
+    if(fields & 256) size += 4;
+    if(fields & 512) size += 1;
+    if(fields & 1024) size += 4;
+    if(fields & 2048) size += 4;
+    return size;
+}
+void FirmwareEmulator::parseInput(uint64_t t) {
+    while(queue.size()<(size_t)config.commandQueue && !rxBuffer.empty()) {
+        uint8_t c = rxBuffer.front();
+        rxBuffer.pop_front();
+        if(line.empty() && (c & 128) && config.flavor==FirmwareEmulatorConfig::REPETIER)
+            binary = true;
+        if(binary) {
+            line.push_back(c);
+            if(binarySize==0)
+                binarySize = binaryPacketSize(line);
+            if(binarySize && line.size()>=binarySize)
+                lineComplete();
+        } else if(c=='\n' || c=='\r' || c==0) { // Zeros sent after a resend end a broken line
+            if(!line.empty()) lineComplete();
+        } else if(line.size()<MAX_LINE)
+            line.push_back(c);
+    }
+}
+void FirmwareEmulator::lineComplete() {
+    if(config.corruptRate>0 && random()<config.corruptRate) {
+        line[(size_t)(random()*line.size())] ^= (uint8_t)(1<<(int)(random()*7));
+        stats.corruptedLines++;
+    }
+    Command c;
+    bool valid;
+    if(binary) {
+        stats.binaryLines++;
+        valid = decodeBinary(c);
+    } else {
+        stats.asciiLines++;
+        valid = decodeAscii(c);
+    }
+    bool empty = !binary && c.n<0 && c.m<0 && c.g<0 && c.t<0 && valid;
+    line.clear();
+    binary = false;
+    binarySize = 0;
+    if(empty) return; // Comments and blank lines get no answer
+    if(!valid) {
+        stats.checksumErrors++;
+        if(waitingForResend>=0) { // Still flushing lines sent before the resend request
+            if(--waitingForResend<0) requestResend("Wrong checksum");
+            return;
+        }
+        requestResend(config.flavor==FirmwareEmulatorConfig::MARLIN ? "checksum mismatch" : "Wrong checksum");
+        return;
+    }
+    accept(c);
+}
+template<typename T> static T readValue(const vector<uint8_t> &p,size_t &pos) {
+    T v;
+    memcpy(&v,&p[pos],sizeof(T));
+    pos += sizeof(T);
+    return v;
+}
+bool FirmwareEmulator::decodeBinary(Command &c) {
+    size_t len = line.size()-2;
+    uint16_t sum1 = 0,sum2 = 0;
+    for(size_t i=0;i<len;i++) {
+        sum1 = (sum1+line[i]) % 255;
+        sum2 = (sum2+sum1) % 255;
+    }
+    if(line[len]!=(sum1 & 255) || line[len+1]!=(sum2 & 255)) return false;
+    size_t pos = 0;
+    uint16_t fields = readValue<uint16_t>(line,pos);
+    uint16_t fields2 = 0;
+    bool v2 = (fields & 4096)!=0;
+    if(v2) {
+        fields2 = readValue<uint16_t>(line,pos);
+        if(fields & 32768) pos++; // text length
+    }
+    if(fields & 1) c.n = readValue<uint16_t>(line,pos);
+    if(v2) {
+        if(fields & 2) c.m = readValue<uint16_t>(line,pos);
+        if(fields & 4) c.g = readValue<uint16_t>(line,pos);
+    } else {
+        if(fields & 2) c.m = readValue<uint8_t>(line,pos);
+        if(fields & 4) c.g = readValue<uint8_t>(line,pos);
+    }
+    if(fields & 8) {c.hasX = true;c.x = readValue<float>(line,pos);}
+    if(fields & 16) {c.hasY = true;c.y = readValue<float>(line,pos);}
+    if(fields & 32) {c.hasZ = true;c.z = readValue<float>(line,pos);}
+    if(fields & 64) {c.hasE = true;c.e = readValue<float>(line,pos);}
+    if(fields & 256) {c.hasF = true;c.f = readValue<float>(line,pos);}
+    if(fields & 512) c.t = readValue<uint8_t>(line,pos);
+    if(fields & 1024) {c.hasS = true;c.s = readValue<int32_t>(line,pos);}
+    // P, I, J, R and text are not used by the emulation
+    (void)fields2;
+    return true;
+}
+bool FirmwareEmulator::decodeAscii(Command &c) {
+    string s(line.begin(),line.end());
+    size_t star = s.find('*');
+    if(star!=string::npos) {
+        int check = 0;
+        for(size_t i=0;i<star;i++) check ^= (uint8_t)s[i];
+        if(atoi(s.c_str()+star+1)!=check) return false;
+        s.erase(star);
+    }
+    size_t comment = s.find(';');
+    if(comment!=string::npos) s.erase(comment);
+    const char *p = s.c_str();
+    while(*p) {
+        char letter = *p++;
+        if(letter<'A' || letter>'Z') continue;
+        char *end;
+        double v = strtod(p,&end);
+        if(end==p) continue;
+        p = end;
+        switch(letter) {
+            case 'N': c.n = (int)v;break;
+            case 'M': c.m = (int)v;break;
+            case 'G': c.g = (int)v;break;
+            case 'T': c.t = (int)v;break;
+            case 'S': c.hasS = true;c.s = v;break;
+            case 'X': c.hasX = true;c.x = v;break;
+            case 'Y': c.hasY = true;c.y = v;break;
+            case 'Z': c.hasZ = true;c.z = v;break;
+            case 'E': c.hasE = true;c.e = v;break;
+            case 'F': c.hasF = true;c.f = v;break;
+        }
+        if(c.m==117) break; // Rest is message text
+    }
+    if(c.n>=0 && star==string::npos && c.m!=117) return false; // Numbered lines need a checksum
+    return true;
+}
+void FirmwareEmulator::accept(Command &c) {
+    if(c.n>=0) {
+        if(c.m==110) {
+            lastN = c.n;
+            waitingForResend = -1;
+        } else if(c.n!=lastN+1) {
+            if(waitingForResend>=0) {
+                if(--waitingForResend<0) requestResend("expected line");
+                return;
+            }
+            stats.lineNumberErrors++;
+            requestResend(config.flavor==FirmwareEmulatorConfig::MARLIN ? "Line Number is not Last Line Number+1" : "expected line");
+            return;
+        } else {
+            lastN = c.n;
+            waitingForResend = -1;
+        }
+    }
+    queue.push_back(c);
+    // Repetier acknowledges when a command is queued, Marlin after executing it
+    if(config.flavor==FirmwareEmulatorConfig::REPETIER) sendOk();
+}
+void FirmwareEmulator::updateHeaters(uint64_t t) {
+    double dt = (double)(t-lastHeatUpdate)/1000000.0;
+    lastHeatUpdate = t;
+    double f = config.heatSeconds>0 ? 1.0-exp(-dt/config.heatSeconds) : 1.0;
+    for(size_t i=0;i<temp.size();i++)
+        temp[i] += ((target[i]>0 ? target[i] : AMBIENT)-temp[i])*f;
+    bedTemp += ((bedTarget>0 ? bedTarget : AMBIENT)-bedTemp)*f;
+}
+string FirmwareEmulator::temperatureLine() {
+    char b[80];
+    string s;
+    snprintf(b,sizeof(b),"T:%.2f /%.0f B:%.2f /%.0f",temp[activeExtruder],target[activeExtruder],bedTemp,bedTarget);
+    s += b;
+    if(temp.size()>1)
+        for(size_t i=0;i<temp.size();i++) {
+            snprintf(b,sizeof(b)," T%d:%.2f /%.0f",(int)i,temp[i],target[i]);
+            s += b;
+        }
+    s += " B@:0 @:0";
+    return s;
+}
+void FirmwareEmulator::execute(uint64_t t) {
+    while(!queue.empty()) {
+        Command &c = queue.front();
+        if(!running) {
+            running = true;
+            busyUntil = t+(c.g==0 || c.g==1 ? config.moveMicros : config.commandMicros);
+            int ext = c.t>=0 && c.t<(int)temp.size() ? c.t : activeExtruder;
+            if(c.m==104 || c.m==109) {
+                if(c.hasS) target[ext] = c.s;
+                heating = c.m==109 && target[ext]>0;
+                heatTarget = ext;
+            } else if(c.m==140 || c.m==190) {
+                if(c.hasS) bedTarget = c.s;
+                heating = c.m==190 && bedTarget>0;
+                heatTarget = -1;
+            }
+            lastHeatReport = t;
+        }
+        if(heating) {
+            double diff = heatTarget<0 ? bedTarget-bedTemp : target[heatTarget]-temp[heatTarget];
+            if(diff>1.0) {
+                if(t-lastHeatReport>=1000000) {
+                    char b[60];
+                    snprintf(b,sizeof(b),"T:%.1f E:%d W:?",heatTarget<0 ? bedTemp : temp[heatTarget],heatTarget<0 ? 0 : heatTarget);
+                    send(b);
+                    lastHeatReport = t;
+                }
+                return;
+            }
+            heating = false;
+        }
+        if(t<busyUntil) return;
+        finish(c);
+        queue.pop_front();
+        running = false;
+    }
+}
+void FirmwareEmulator::finish(Command &c) {
+    stats.commandsExecuted++;
+    bool marlin = config.flavor==FirmwareEmulatorConfig::MARLIN;
+    char b[200];
+    if(c.g==0 || c.g==1 || c.g==92) {
+        if(c.hasX) posX = c.x;
+        if(c.hasY) posY = c.y;
+        if(c.hasZ) posZ = c.z;
+        if(c.hasE) posE = c.e;
+    } else if(c.g==28) {
+        posX = posY = posZ = 0;
+    } else if(c.m==105) {
+        if(marlin) { // Marlin sends the temperatures with the ok
+            sendOk(" "+temperatureLine());
+            return;
+        }
+        send(temperatureLine());
+    } else if(c.m==114) {
+        snprintf(b,sizeof(b),"X:%.2f Y:%.2f Z:%.2f E:%.2f",posX,posY,posZ,posE);
+        send(b);
+    } else if(c.m==115) {
+        if(marlin)
+            snprintf(b,sizeof(b),"FIRMWARE_NAME:Marlin V1; Sprinter/grbl mashup for gen6 FIRMWARE_URL:https://github.com/MarlinFirmware/Marlin PROTOCOL_VERSION:1.0 MACHINE_TYPE:Emulator EXTRUDER_COUNT:%d",config.extruderCount);
+        else
+            snprintf(b,sizeof(b),"FIRMWARE_NAME:Repetier_0.80 FIRMWARE_URL:https://github.com/repetier/Repetier-Firmware/ PROTOCOL_VERSION:1.0 MACHINE_TYPE:Emulator EXTRUDER_COUNT:%d REPETIER_PROTOCOL:%d",config.extruderCount,config.protocol);
+        send(b);
+    } else if(c.t>=0 && c.m<0 && c.g<0 && c.t<(int)temp.size()) {
+        activeExtruder = c.t;
+    }
+    if(marlin && config.advancedOk) {
+        // Planner and command buffer are the same queue here. The finished
+        // command is still in it but its slot is free.
+        int free = config.commandQueue-(int)queue.size()+1;
+        snprintf(b,sizeof(b)," N%d P%d B%d",lastN,free,free);
+        sendOk(b);
+    } else if(marlin) sendOk();
+}
+void FirmwareEmulator::run() {
+    if(master<0) open();
+    while(!stopRequested) {
+        if(!connected) {
+            // Without an open slave the master reports a hangup
+            struct pollfd p;
+            p.fd = master;
+            p.events = POLLIN;
+            p.revents = 0;
+            poll(&p,1,20);
+            if(p.revents & POLLHUP) {
+                usleep(20000);
+                continue;
+            }
+            boost::mutex::scoped_lock l(statsMutex);
+            connected = true;
+            connectTime = now();
+            reset();
+            stats.connects++;
+        }
+        uint64_t t = now();
+        bool pacedIn,outPending;
+        {
+            boost::mutex::scoped_lock l(statsMutex);
+            if(!booted && t-connectTime>=BOOT_MICROS) {
+                booted = true;
+                send("start");
+            }
+            pace(t);
+            if(!readInput(t)) {
+                connected = false;
+                continue;
+            }
+            parseInput(t);
+            updateHeaters(t);
+            execute(t);
+            if(config.flavor==FirmwareEmulatorConfig::REPETIER && booted && queue.empty() && rxBuffer.empty()
+               && line.empty() && t-lastInput>=1000000 && t-lastWait>=1000000) {
+                send("wait");
+                lastWait = t;
+            }
+            writeOutput();
+            pacedIn = inTokens<1;
+            outPending = !output.empty();
+        }
+        // Sleep until input arrives or the next timed event is due
+        uint64_t wait = 50000;
+        if(!booted) wait = BOOT_MICROS;
+        if(running && busyUntil>t) wait = min(wait,busyUntil-t);
+        if(heating) wait = min(wait,(uint64_t)10000);
+        uint64_t byteMicros = config.baudrate>0 ? 10000000/config.baudrate+1 : 0;
+        if(pacedIn || (outPending && outTokens<1)) wait = min(wait,byteMicros);
+        fd_set rfds,wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        if(!pacedIn) FD_SET(master,&rfds);
+        if(outPending && outTokens>=1) FD_SET(master,&wfds);
+        struct timeval tv;
+        tv.tv_sec = wait/1000000;
+        tv.tv_usec = wait%1000000;
+        select(master+1,&rfds,&wfds,NULL,&tv);
+    }
+}
+
+static FirmwareEmulator *childEmulator = NULL;
+
+static void stopChildEmulator(int sig) {
+    if(childEmulator) childEmulator->stop();
+}
+FirmwareEmulatorProcess::FirmwareEmulatorProcess() {
+    pid = -1;
+    statsPipe = -1;
+}
+FirmwareEmulatorProcess::~FirmwareEmulatorProcess() {
+    if(pid>0) {
+        FirmwareEmulatorStats s;
+        stop(s);
+    }
+}
+string FirmwareEmulatorProcess::start(const FirmwareEmulatorConfig &c) {
+    FirmwareEmulator *fw = new FirmwareEmulator(c);
+    string device;
+    try {
+        device = fw->open();
+    } catch(...) {
+        delete fw;
+        throw;
+    }
+    int p[2];
+    if(pipe(p)!=0) {
+        delete fw;
+        throw runtime_error(string("Could not create pipe: ")+strerror(errno));
+    }
+    pid = fork();
+    if(pid<0) {
+        delete fw;
+        ::close(p[0]);
+        ::close(p[1]);
+        throw runtime_error(string("Could not start emulator: ")+strerror(errno));
+    }
+    if(pid==0) {
+        ::close(p[0]);
+        childEmulator = fw;
+        signal(SIGTERM,stopChildEmulator);
+        fw->run();
+        FirmwareEmulatorStats stats;
+        fw->getStats(stats);
+        ssize_t w = write(p[1],&stats,sizeof(stats));
+        _exit(w==sizeof(stats) ? 0 : 1);
+    }
+    // Only the child keeps the pseudo terminal and the write end open
+    delete fw;
+    ::close(p[1]);
+    statsPipe = p[0];
+    fcntl(statsPipe,F_SETFD,FD_CLOEXEC);
+    return device;
+}
+bool FirmwareEmulatorProcess::stop(FirmwareEmulatorStats &s) {
+    memset(&s,0,sizeof(s));
+    if(pid<=0) return false;
+    kill(pid,SIGTERM);
+    bool ok = read(statsPipe,&s,sizeof(s))==sizeof(s);
+    waitpid(pid,NULL,0);
+    ::close(statsPipe);
+    pid = -1;
+    statsPipe = -1;
+    return ok;
+}
@@ -0,0 +1,191 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef __Repetier_Server__FirmwareEmulator__
+#define __Repetier_Server__FirmwareEmulator__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <sys/types.h>
+
+/** Settings of an emulated printer. */
+struct FirmwareEmulatorConfig {
+    enum Flavor {REPETIER,MARLIN};
+    Flavor flavor;
+    int baudrate; ///< Limits bytes per second in both directions to baudrate/10, 0 for no limit
+    int receiveBuffer; ///< Size of the serial receive buffer. Bytes arriving while it is full are lost.
+    int commandQueue; ///< Parsed commands waiting for execution
+    int moveMicros; ///< Execution time of G0 and G1
+    int commandMicros; ///< Execution time of all other commands
+    double corruptRate; ///< Probability that a received line gets a flipped bit
+    int protocol; ///< Binary protocol version announced by Repetier firmware, 0 for ASCII only
+    bool advancedOk; ///< Marlin adds " N<line> P<planner> B<buffer>" to ok
+    int extruderCount;
+    double heatSeconds; ///< Time constant of the simulated heaters
+    unsigned seed;
+    FirmwareEmulatorConfig();
+};
+
+/** Counters of an emulator run. */
+struct FirmwareEmulatorStats {
+    uint64_t connects;
+    uint64_t bytesReceived;
+    uint64_t bytesSent;
+    uint64_t asciiLines;
+    uint64_t binaryLines;
+    uint64_t commandsExecuted;
+    uint64_t checksumErrors;
+    uint64_t lineNumberErrors;
+    uint64_t corruptedLines; ///< Lines damaged on purpose
+    uint64_t overflowBytes; ///< Bytes lost because the receive buffer was full
+    uint64_t resendsRequested;
+    uint64_t okSent;
+    /** Time between the firmware running out of input while it had room
+     for more and the next byte arriving. Measures how fast the host
+     refills the buffer. */
+    uint64_t starveCount;
+    uint64_t starveP50Micros;
+    uint64_t starveP99Micros;
+    uint64_t starveMaxMicros;
+    void writeJSON(std::ostream &out) const;
+};
+
+/** Emulates Repetier or Marlin firmware on the master side of a pseudo
+ terminal. The slave side behaves like the serial device of a printer, so
+ PrinterSerial connects to it without changes.
+
+ The emulator parses ASCII and binary (V1 and V2) commands, checks line
+ numbers and checksums and answers with ok, wait, Resend: and temperature
+ lines. Incoming bytes pass a receive buffer of limited size that is only
+ drained while the command queue has room, so a host sending more than
+ the buffer holds loses bytes exactly like a real printer. Both directions
+ are paced to the configured baud rate.
+
+ A new connection is detected when the slave gets opened. The emulator
+ then resets its state and sends "start", like a board rebooting on DTR.
+ Only available on POSIX systems.
+ */
+class FirmwareEmulator {
+    struct Command {
+        int n; ///< Line number or -1
+        int m,g,t; ///< -1 if missing
+        bool hasS;
+        double s;
+        bool hasX,hasY,hasZ,hasE,hasF;
+        double x,y,z,e,f;
+        Command();
+    };
+    FirmwareEmulatorConfig config;
+    int master;
+    std::string slaveName;
+    volatile bool stopRequested;
+    boost::shared_ptr<boost::thread> thread;
+    boost::mutex statsMutex;
+    FirmwareEmulatorStats stats;
+    std::vector<uint32_t> starveTimes;
+    // Link state
+    bool connected;
+    uint64_t connectTime; ///< Time of slave open, start is sent after a short boot delay
+    bool booted;
+    double inTokens,outTokens; ///< Bytes allowed to pass each direction
+    uint64_t lastPace;
+    std::deque<uint8_t> rxBuffer;
+    std::string output; ///< Bytes waiting to be sent to the host
+    uint64_t starveStart; ///< 0 while the firmware is not waiting for input
+    uint64_t lastInput;
+    uint64_t lastWait;
+    // Parser state
+    std::vector<uint8_t> line;
+    bool binary;
+    size_t binarySize;
+    int lastN;
+    int waitingForResend; ///< Lines to skip silently after a resend request, -1 if none
+    // Execution state
+    std::deque<Command> queue;
+    uint64_t busyUntil; ///< End of the running command
+    bool running; ///< Front of the queue is executing
+    bool heating; ///< Running command waits for a temperature
+    int heatTarget; ///< -1 for bed, otherwise extruder
+    uint64_t lastHeatReport;
+    std::vector<double> temp,target;
+    double bedTemp,bedTarget;
+    int activeExtruder;
+    double posX,posY,posZ,posE;
+    uint64_t lastHeatUpdate;
+    unsigned randomState;
+
+    static uint64_t now();
+    double random();
+    void reset();
+    void send(const std::string &s);
+    void sendOk(const std::string &s = "");
+    void requestResend(const char *reason);
+    void pace(uint64_t t);
+    /** Returns false if the host closed the port. */
+    bool readInput(uint64_t t);
+    void writeOutput();
+    void parseInput(uint64_t t);
+    void lineComplete();
+    bool decodeBinary(Command &c);
+    bool decodeAscii(Command &c);
+    void accept(Command &c);
+    void execute(uint64_t t);
+    void finish(Command &c);
+    void updateHeaters(uint64_t t);
+    std::string temperatureLine();
+    static size_t binaryPacketSize(const std::vector<uint8_t> &p);
+    void recordStarve(uint64_t micros);
+public:
+    FirmwareEmulator(const FirmwareEmulatorConfig &c);
+    ~FirmwareEmulator();
+    /** Creates the pseudo terminal. Throws std::runtime_error on failure.
+     @returns Device name of the slave side, to be used as printer device. */
+    const std::string &open();
+    /** Runs the emulation in the calling thread until stop() is called. */
+    void run();
+    /** Runs the emulation in a background thread. */
+    void start();
+    void stop();
+    /** Copies the counters. Thread safe. */
+    void getStats(FirmwareEmulatorStats &s);
+};
+
+/** Runs an emulator in a child process, so its CPU time does not count
+ for the process under test. start() forks, so call it before the caller
+ creates any thread. */
+class FirmwareEmulatorProcess {
+    pid_t pid;
+    int statsPipe; ///< Read end, the child writes its counters on exit
+public:
+    FirmwareEmulatorProcess();
+    ~FirmwareEmulatorProcess();
+    /** Creates the pseudo terminal and starts the child. Throws
+     std::runtime_error on failure.
+     @returns Device name of the slave side. */
+    std::string start(const FirmwareEmulatorConfig &c);
+    /** Stops the child and waits for it.
+     @returns false if the counters could not be read. */
+    bool stop(FirmwareEmulatorStats &s);
+};
+
+#endif /* defined(__Repetier_Server__FirmwareEmulator__) */
@@ -0,0 +1,104 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "FirmwareEmulator.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+static FirmwareEmulator *emulator = NULL;
+
+static void handleSignal(int sig) {
+    if(emulator) emulator->stop();
+}
+
+int main(int argc, const char * argv[])
+{
+    FirmwareEmulatorConfig config;
+    string flavor,link;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("firmware",po::value<string>(&flavor)->default_value("repetier"),"repetier or marlin")
+		("baudrate",po::value<int>(&config.baudrate)->default_value(config.baudrate),"Pace both directions to this baud rate, 0 for no limit")
+		("rx-buffer",po::value<int>(&config.receiveBuffer)->default_value(config.receiveBuffer),"Receive buffer size in bytes")
+		("queue",po::value<int>(&config.commandQueue)->default_value(config.commandQueue),"Commands buffered for execution")
+		("move-us",po::value<int>(&config.moveMicros)->default_value(config.moveMicros),"Execution time of G0/G1 in microseconds")
+		("command-us",po::value<int>(&config.commandMicros)->default_value(config.commandMicros),"Execution time of other commands in microseconds")
+		("corrupt",po::value<double>(&config.corruptRate)->default_value(config.corruptRate),"Probability that a received line is damaged")
+		("protocol",po::value<int>(&config.protocol)->default_value(config.protocol),"Binary protocol announced by Repetier firmware, 0 for ASCII only")
+		("advanced-ok",po::value<bool>(&config.advancedOk)->default_value(config.advancedOk),"Marlin reports line, planner and buffer slots with each ok")
+		("extruder",po::value<int>(&config.extruderCount)->default_value(config.extruderCount),"Number of extruders")
+		("heat-seconds",po::value<double>(&config.heatSeconds)->default_value(config.heatSeconds),"Time constant of the heaters, 0 for instant")
+		("seed",po::value<unsigned>(&config.seed)->default_value(config.seed),"Seed for line corruption")
+		("link",po::value<string>(&link),"Create a symbolic link with this name to the device")
+		;
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(std::exception &ex) {
+		cerr << "error: Error parsing command line: " << ex.what() << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << "Emulates printer firmware on a pseudo terminal. Prints the device" << endl;
+		cout << "name, runs until interrupted and prints the counters as JSON." << endl;
+		cout << desc << "\n";
+		return 1;
+	}
+    if(flavor=="marlin")
+        config.flavor = FirmwareEmulatorConfig::MARLIN;
+    else if(flavor!="repetier") {
+        cerr << "error: Unknown firmware " << flavor << endl;
+        return 1;
+    }
+    if(config.extruderCount<1 || config.receiveBuffer<1 || config.commandQueue<1) {
+        cerr << "error: extruder, rx-buffer and queue must be positive" << endl;
+        return 1;
+    }
+    FirmwareEmulator fw(config);
+    string device;
+    try {
+        device = fw.open();
+        cout << device << endl;
+    } catch(std::exception &ex) {
+        cerr << "error: " << ex.what() << endl;
+        return 1;
+    }
+    if(link.length()) {
+        unlink(link.c_str());
+        if(symlink(device.c_str(),link.c_str())!=0) {
+            cerr << "error: Could not create link " << link << endl;
+            return 1;
+        }
+    }
+    emulator = &fw;
+    signal(SIGINT,handleSignal);
+    signal(SIGTERM,handleSignal);
+    fw.run();
+    FirmwareEmulatorStats stats;
+    fw.getStats(stats);
+    stats.writeJSON(cout);
+    cout << endl;
+    if(link.length()) unlink(link.c_str());
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/* Measures the per line cost of the G-code and response kernels:
+ parsing (GCode constructor with parse and addCode), getAscii with
+ checksum, getBinary with the Fletcher-16 checksum, PrinterState::analyze,
+ PrinterState::analyseResponse and the batched PrinterState::analyseResponses
+ the serial reader uses. Reports ns/line and heap allocations
+ per line as one line of JSON, so runs on different hosts can be compared. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "BenchmarkSupport.h"
+#include "global_config.h"
+#include "printer.h"
+#include "PrinterState.h"
+#include "GCode.h"
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+// Counts heap allocations of the whole process. Only the main thread runs
+// while kernels are measured.
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if(p==NULL) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) throw(std::bad_alloc) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if(p==NULL) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) throw() {
+    free(p);
+}
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+/** Runs a kernel over all lines until minMicros passed and records the cost. */
+class Kernel {
+public:
+    virtual ~Kernel() {}
+    virtual void run() = 0;
+};
+static void measure(ostream &out,const char *name,Kernel &k,size_t lines,uint64_t minMicros,bool &first) {
+    k.run(); // warm up caches and lazily allocated buffers
+    uint64_t start = LatencyHistogram::now(),elapsed;
+    uint64_t allocStart = allocations;
+    int rounds = 0;
+    do {
+        k.run();
+        rounds++;
+        elapsed = LatencyHistogram::now()-start;
+    } while(elapsed<minMicros);
+    double perLine = (double)rounds*lines;
+    out << (first ? "" : ",") << "{\"name\":\"" << name << "\",\"nsPerLine\":" << elapsed*1000.0/perLine
+    << ",\"allocsPerLine\":" << (allocations-allocStart)/perLine << "}";
+    first = false;
+}
+class ParseKernel : public Kernel {
+    Printer &printer;
+    vector<string> &lines;
+public:
+    ParseKernel(Printer &p,vector<string> &l):printer(p),lines(l) {}
+    void run() {
+        for(size_t i=0;i<lines.size();i++) {
+            GCode gc(printer,lines[i]);
+        }
+    }
+};
+class AsciiKernel : public Kernel {
+    vector<boost::shared_ptr<GCode> > &codes;
+public:
+    AsciiKernel(vector<boost::shared_ptr<GCode> > &c):codes(c) {}
+    void run() {
+        for(size_t i=0;i<codes.size();i++)
+            codes[i]->getAscii(true,true);
+    }
+};
+class BinaryKernel : public Kernel {
+    vector<boost::shared_ptr<GCode> > &codes;
+public:
+    BinaryKernel(vector<boost::shared_ptr<GCode> > &c):codes(c) {}
+    void run() {
+        for(size_t i=0;i<codes.size();i++)
+            if(!codes[i]->forceASCII) codes[i]->getBinary();
+    }
+};
+class AnalyzeKernel : public Kernel {
+    PrinterState &state;
+    vector<boost::shared_ptr<GCode> > &codes;
+public:
+    AnalyzeKernel(PrinterState &s,vector<boost::shared_ptr<GCode> > &c):state(s),codes(c) {}
+    void run() {
+        for(size_t i=0;i<codes.size();i++)
+            state.analyze(*codes[i]);
+    }
+};
+class ResponseKernel : public Kernel {
+    PrinterState &state;
+    vector<string> &lines;
+public:
+    ResponseKernel(PrinterState &s,vector<string> &l):state(s),lines(l) {}
+    void run() {
+        uint8_t rtype;
+        ResponseInfo info;
+        for(size_t i=0;i<lines.size();i++) {
+            rtype = 4;
+            state.analyseResponse(lines[i],rtype,info);
+        }
+    }
+};
+/** Analyses the lines in batches of READ_LINES views, like the serial
+ reader does with the lines of one read. */
+class ResponseBatchKernel : public Kernel {
+    enum {READ_LINES = 8};
+    PrinterState &state;
+    vector<string> &lines;
+    vector<ResponseLine> batch;
+public:
+    ResponseBatchKernel(PrinterState &s,vector<string> &l):state(s),lines(l) {}
+    void run() {
+        for(size_t i=0;i<lines.size();i+=READ_LINES) {
+            batch.clear();
+            for(size_t j=i;j<lines.size() && j<i+READ_LINES;j++)
+                batch.push_back(ResponseLine(lines[j].c_str(),lines[j].length()));
+            size_t done = 0;
+            while(done<batch.size())
+                done += state.analyseResponses(&batch[done],batch.size()-done);
+        }
+    }
+};
+static void readLines(const vector<string> &files,vector<string> &lines) {
+    for(size_t f=0;f<files.size();f++) {
+        ifstream in(files[f].c_str());
+        if(!in.good()) {
+            cerr << "error: Could not read " << files[f] << endl;
+            exit(1);
+        }
+        string line;
+        while(getline(in,line)) {
+            if(line.length() && line[line.length()-1]=='\r')
+                line.erase(line.length()-1);
+            if(line.length()) lines.push_back(line);
+        }
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    vector<string> gcodeFiles,responseFiles;
+    int protocol,minMillis;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("gcode",po::value<vector<string> >(&gcodeFiles),"G-code file of the corpus, may be repeated")
+		("responses",po::value<vector<string> >(&responseFiles),"Firmware response log of the corpus, may be repeated")
+		("protocol",po::value<int>(&protocol)->default_value(2),"Protocol of the printer, 2 encodes large values in binary V2")
+		("min-ms",po::value<int>(&minMillis)->default_value(300),"Minimum measuring time per kernel")
+		;
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(std::exception &ex) {
+		cerr << "error: Error parsing command line: " << ex.what() << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << desc << "\n";
+		return 1;
+	}
+    fs::path dir = fs::temp_directory_path()/fs::unique_path("repetier-gcode-bench-%%%%%%%%");
+    fs::create_directories(dir);
+    if(gcodeFiles.empty()) {
+        gcodeFiles.push_back((dir/"generated.gcode").string());
+        bench::generateJob(gcodeFiles[0],20000);
+    }
+    if(responseFiles.empty()) {
+        responseFiles.push_back((dir/"responses.log").string());
+        bench::generateResponses(responseFiles[0],20000);
+    }
+    vector<string> gcodes,responses;
+    readLines(gcodeFiles,gcodes);
+    readLines(responseFiles,responses);
+
+    bench::writeConfigs(dir,"/dev/null",250000,protocol,127,false);
+    gconfig = new GlobalConfig((dir/"server.conf").string());
+    gconfig->daemon = true;
+    Printer printer((dir/"printers"/"bench.cfg").string());
+
+    vector<boost::shared_ptr<GCode> > codes;
+    for(size_t i=0;i<gcodes.size();i++) {
+        boost::shared_ptr<GCode> gc(new GCode(printer,gcodes[i]));
+        gc->setN((int32_t)i+1);
+        codes.push_back(gc);
+    }
+    ostringstream out;
+    bool first = true;
+    uint64_t minMicros = (uint64_t)minMillis*1000;
+    out << "{\"architecture\":\"" << bench::architecture() << "\",\"protocol\":" << protocol
+    << ",\"gcodeLines\":" << gcodes.size() << ",\"responseLines\":" << responses.size() << ",\"kernels\":[";
+    ParseKernel parse(printer,gcodes);
+    measure(out,"parse",parse,gcodes.size(),minMicros,first);
+    AsciiKernel ascii(codes);
+    measure(out,"getAscii",ascii,codes.size(),minMicros,first);
+    BinaryKernel binary(codes);
+    measure(out,"getBinary",binary,codes.size(),minMicros,first);
+    AnalyzeKernel analyze(*printer.state,codes);
+    measure(out,"analyze",analyze,codes.size(),minMicros,first);
+    ResponseKernel response(*printer.state,responses);
+    measure(out,"analyseResponse",response,responses.size(),minMicros,first);
+    ResponseBatchKernel responseBatch(*printer.state,responses);
+    measure(out,"analyseResponses",responseBatch,responses.size(),minMicros,first);
+    out << "]}";
+    cout << out.str() << endl;
+    boost::system::error_code ec;
+    fs::remove_all(dir,ec);
+    _exit(0); // Printer destructor would close a port that was never opened
+}
@@ -0,0 +1,671 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+/* Drives simulated dashboards against the server binary on loopback while
+ emulated printers print a job, and reports one line of JSON on stdout.
+
+ Every run starts fresh firmware emulators and a fresh server. The job is
+ printed once without web load as baseline and once while the dashboards
+ poll, so the difference shows how much the web tier disturbs streaming.
+ A dashboard behaves like the printer page of the web interface with one
+ keep-alive connection: it polls the printer list and the response log
+ and now and then loads the job list, renders a page or uploads a model. */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <zlib.h>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include "FirmwareEmulator.h"
+#include "BenchmarkSupport.h"
+#include "LatencyHistogram.h"
+#include "json_spirit.h"
+
+#ifndef SERVER_BINARY
+#define SERVER_BINARY "RepetierServer"
+#endif
+#ifndef SOURCE_ROOT
+#define SOURCE_ROOT "."
+#endif
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+namespace asio = boost::asio;
+
+#define BOUNDARY "----RepetierLoadHarness"
+#define MULTIPART_TYPE "multipart/form-data; boundary=" BOUNDARY
+#define LOG_FILTER 12 // Response filter of the printer page
+#define POLL_MILLIS 50
+
+/** HTTP/1.1 client with one keep-alive connection, like a browser tab. */
+class HttpClient {
+    asio::io_service io;
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::endpoint endpoint;
+    asio::streambuf input;
+    bool connected;
+    void disconnect();
+    static bool gunzip(const string &in,string &out);
+public:
+    size_t lastBytes; ///< Size of the last response on the wire
+    HttpClient(int port);
+    /** Sends a request and reads the complete answer. Compressed bodies
+     are inflated. Reconnects on the next call if the connection broke.
+     @returns HTTP status, 0 if the connection failed. */
+    int request(const char *method,const string &path,const string &contentType,const string &body,string &response);
+    inline int get(const string &path,string &response) {return request("GET",path,"","",response);}
+};
+
+HttpClient::HttpClient(int port):socket(io),endpoint(asio::ip::address_v4::loopback(),(unsigned short)port) {
+    connected = false;
+    lastBytes = 0;
+}
+void HttpClient::disconnect() {
+    boost::system::error_code ec;
+    socket.close(ec);
+    input.consume(input.size());
+    connected = false;
+}
+bool HttpClient::gunzip(const string &in,string &out) {
+    z_stream z;
+    memset(&z,0,sizeof(z));
+    if(inflateInit2(&z,16+MAX_WBITS)!=Z_OK) return false;
+    z.next_in = (Bytef*)in.data();
+    z.avail_in = (uInt)in.length();
+    char buf[16384];
+    int ret;
+    do {
+        z.next_out = (Bytef*)buf;
+        z.avail_out = sizeof(buf);
+        ret = inflate(&z,Z_NO_FLUSH);
+        if(ret!=Z_OK && ret!=Z_STREAM_END) break;
+        out.append(buf,sizeof(buf)-z.avail_out);
+    } while(ret!=Z_STREAM_END);
+    inflateEnd(&z);
+    return ret==Z_STREAM_END;
+}
+int HttpClient::request(const char *method,const string &path,const string &contentType,const string &body,string &response) {
+    response.clear();
+    lastBytes = 0;
+    boost::system::error_code ec;
+    if(!connected) {
+        socket.connect(endpoint,ec);
+        if(ec) {
+            disconnect();
+            return 0;
+        }
+        connected = true;
+    }
+    ostringstream req;
+    req << method << " " << path << " HTTP/1.1\r\nHost: 127.0.0.1\r\nAccept-Encoding: gzip\r\nAccept-Language: en\r\n";
+    if(strcmp(method,"POST")==0)
+        req << "Content-Type: " << contentType << "\r\nContent-Length: " << body.length() << "\r\n";
+    req << "\r\n";
+    string head = req.str();
+    vector<asio::const_buffer> out;
+    out.push_back(asio::buffer(head));
+    out.push_back(asio::buffer(body));
+    asio::write(socket,out,ec);
+    if(ec) {
+        disconnect();
+        return 0;
+    }
+    size_t headerLength = asio::read_until(socket,input,"\r\n\r\n",ec);
+    if(ec) {
+        disconnect();
+        return 0;
+    }
+    string header(asio::buffers_begin(input.data()),asio::buffers_begin(input.data())+headerLength);
+    input.consume(headerLength);
+    int status = 0;
+    sscanf(header.c_str(),"HTTP/%*s %d",&status);
+    long long length = -1;
+    bool close = false,gzip = false;
+    size_t pos = header.find("\r\n");
+    while(pos!=string::npos && pos+2<header.length()) {
+        size_t eol = header.find("\r\n",pos+2);
+        string line = header.substr(pos+2,eol-pos-2);
+        pos = eol;
+        size_t colon = line.find(':');
+        if(colon==string::npos) continue;
+        string name = line.substr(0,colon);
+        for(size_t i=0;i<name.length();i++) name[i] = tolower(name[i]);
+        const char *value = line.c_str()+colon+1;
+        while(*value==' ') value++;
+        if(name=="content-length")
+            length = atoll(value);
+        else if(name=="connection")
+            close = strncasecmp(value,"close",5)==0;
+        else if(name=="content-encoding")
+            gzip = strncasecmp(value,"gzip",4)==0;
+    }
+    if(length<0) { // Body ends with the connection
+        asio::read(socket,input,asio::transfer_all(),ec);
+        length = input.size();
+        close = true;
+    } else if(input.size()<(size_t)length)
+        asio::read(socket,input,asio::transfer_exactly((size_t)length-input.size()),ec);
+    if(ec && ec!=asio::error::eof) {
+        disconnect();
+        return 0;
+    }
+    string content(asio::buffers_begin(input.data()),asio::buffers_begin(input.data())+(size_t)length);
+    input.consume((size_t)length);
+    lastBytes = headerLength+(size_t)length;
+    if(!gzip || !gunzip(content,response))
+        response.swap(content);
+    if(close) disconnect();
+    return status;
+}
+
+enum RequestKind {LIST,RESPONSE,JOB_LIST,PAGE,UPLOAD,REQUEST_KINDS};
+/** Request mix of a dashboard, each kind is sent every "every" cycles.
+ Follows the polling of the printer page: list and log once per cycle,
+ the job list about every fifth. */
+static const struct {const char *name;int every;} requestMix[REQUEST_KINDS] = {
+    {"list",1},{"response",1},{"jobList",5},{"page",20},{"upload",200}};
+
+/** Results of all dashboards. */
+struct WebLoad {
+    int port;
+    int printers;
+    int thinkMillis;
+    string upload; ///< Multipart body of the model upload
+    volatile bool stopRequested;
+    boost::mutex mutex;
+    LatencyHistogram times[REQUEST_KINDS];
+    uint64_t errors[REQUEST_KINDS];
+    uint64_t bytes;
+    WebLoad() {
+        stopRequested = false;
+        bytes = 0;
+        for(int i=0;i<REQUEST_KINDS;i++) errors[i] = 0;
+    }
+    void record(int kind,uint64_t micros,bool ok,size_t n) {
+        boost::mutex::scoped_lock l(mutex);
+        times[kind].record(micros);
+        if(!ok) errors[kind]++;
+        bytes += n;
+    }
+};
+
+static string printerSlug(int i) {
+    return "p"+boost::lexical_cast<string>(i+1);
+}
+static string multipartBody(const string &filename,const string &content) {
+    return "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\""+filename+
+    "\"\r\nContent-Type: application/octet-stream\r\n\r\n"+content+"\r\n--" BOUNDARY "--\r\n";
+}
+static void runDashboard(WebLoad *load,int index) {
+    HttpClient http(load->port);
+    string slug = printerSlug(index%load->printers);
+    string response;
+    unsigned long lastId = 0;
+    for(int cycle=index;!load->stopRequested;cycle++) {
+        for(int kind=0;kind<REQUEST_KINDS && !load->stopRequested;kind++) {
+            if(cycle%requestMix[kind].every) continue;
+            uint64_t start = LatencyHistogram::now();
+            int status;
+            switch(kind) {
+                case LIST:
+                    status = http.get("/printer/list",response);
+                    break;
+                case RESPONSE:
+                    status = http.get("/printer/response/"+slug+"?filter="+boost::lexical_cast<string>(LOG_FILTER)+
+                                      "&start="+boost::lexical_cast<string>(lastId),response);
+                    break;
+                case JOB_LIST:
+                    status = http.get("/printer/job/"+slug+"?a=list",response);
+                    break;
+                case PAGE:
+                    status = http.get("/printer.php?pn="+slug,response);
+                    break;
+                default:
+                    status = http.request("POST","/printer/model/"+slug+"?a=upload&name=load",MULTIPART_TYPE,load->upload,response);
+                    break;
+            }
+            load->record(kind,LatencyHistogram::now()-start,status==200,http.lastBytes);
+            if(kind==RESPONSE && status==200) {
+                size_t p = response.find("\"lastid\":");
+                if(p!=string::npos) lastId = strtoul(response.c_str()+p+9,NULL,10);
+            }
+        }
+        if(load->thinkMillis>0)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(load->thinkMillis));
+    }
+}
+
+/** The server binary, started with a configuration of the harness. */
+class ServerProcess {
+    pid_t pid;
+    int console; ///< Write end of the stdin of the server
+public:
+    ServerProcess():pid(-1),console(-1) {}
+    bool start(const string &binary,const fs::path &config,const fs::path &log) {
+        int p[2];
+        if(pipe(p)!=0) return false;
+        pid = fork();
+        if(pid<0) return false;
+        if(pid==0) {
+            dup2(p[0],STDIN_FILENO);
+            int fd = open(log.string().c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+            if(fd>=0) {
+                dup2(fd,STDOUT_FILENO);
+                dup2(fd,STDERR_FILENO);
+            }
+            execl(binary.c_str(),binary.c_str(),"-c",config.string().c_str(),(char*)NULL);
+            _exit(127);
+        }
+        close(p[0]);
+        console = p[1];
+        fcntl(console,F_SETFD,FD_CLOEXEC);
+        return true;
+    }
+    /** Quits the server like a user at the console would.
+     @returns CPU seconds the server used. */
+    double stop() {
+        if(pid<=0) return 0;
+        if(write(console,"x\n",2)!=2) kill(pid,SIGTERM);
+        close(console);
+        struct rusage ru;
+        memset(&ru,0,sizeof(ru));
+        pid_t r = 0;
+        for(int waited=0;waited<15000 && (r = wait4(pid,NULL,WNOHANG,&ru))==0;waited+=POLL_MILLIS)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(POLL_MILLIS));
+        if(r==0) {
+            cerr << "error: Server did not stop, killing it" << endl;
+            kill(pid,SIGKILL);
+            wait4(pid,NULL,0,&ru);
+        }
+        pid = -1;
+        return ru.ru_utime.tv_sec+ru.ru_stime.tv_sec+(ru.ru_utime.tv_usec+ru.ru_stime.tv_usec)/1000000.0;
+    }
+};
+
+/** Parses the Prometheus text format into series -> value. */
+static void parseMetrics(const string &text,map<string,double> &values) {
+    values.clear();
+    istringstream in(text);
+    string line;
+    while(getline(in,line)) {
+        if(line.empty() || line[0]=='#') continue;
+        size_t sp = line.rfind(' ');
+        if(sp!=string::npos)
+            values[line.substr(0,sp)] = atof(line.c_str()+sp+1);
+    }
+}
+static double printerValue(const map<string,double> &values,const char *name,const string &slug) {
+    map<string,double>::const_iterator it = values.find(string(name)+"{printer=\""+slug+"\"}");
+    return it==values.end() ? -1 : it->second;
+}
+/** Follows a path of object members like "data.ack.p99Micros".
+ @returns -1 if the path does not exist. */
+static double jsonNumber(const string &text,const char *path) {
+    json_spirit::Value v;
+    if(!json_spirit::read(text,v)) return -1;
+    const json_spirit::Value *act = &v;
+    string rest(path);
+    while(!rest.empty()) {
+        size_t dot = rest.find('.');
+        string name = rest.substr(0,dot);
+        rest = dot==string::npos ? "" : rest.substr(dot+1);
+        if(act->type()!=json_spirit::obj_type) return -1;
+        const json_spirit::Object &obj = act->get_obj();
+        const json_spirit::Value *next = NULL;
+        for(json_spirit::Object::const_iterator it=obj.begin();it!=obj.end();++it)
+            if(it->name_==name) next = &it->value_;
+        if(next==NULL) return -1;
+        act = next;
+    }
+    if(act->type()==json_spirit::int_type) return (double)act->get_int64();
+    if(act->type()==json_spirit::real_type) return act->get_real();
+    return -1;
+}
+/** Highest job id in the job list returned by an upload. */
+static int lastJobId(const string &text) {
+    json_spirit::Value v;
+    if(!json_spirit::read(text,v) || v.type()!=json_spirit::obj_type) return -1;
+    int id = -1;
+    const json_spirit::Object &obj = v.get_obj();
+    for(json_spirit::Object::const_iterator it=obj.begin();it!=obj.end();++it) {
+        if(it->name_!="data" || it->value_.type()!=json_spirit::array_type) continue;
+        const json_spirit::Array &jobs = it->value_.get_array();
+        for(json_spirit::Array::const_iterator j=jobs.begin();j!=jobs.end();++j) {
+            if(j->type()!=json_spirit::obj_type) continue;
+            const json_spirit::Object &job = j->get_obj();
+            for(json_spirit::Object::const_iterator f=job.begin();f!=job.end();++f)
+                if(f->name_=="id" && f->value_.type()==json_spirit::int_type)
+                    id = max(id,f->value_.get_int());
+        }
+    }
+    return id;
+}
+
+struct HarnessConfig {
+    string server;
+    string website;
+    string languages;
+    string job; ///< Content of the job file
+    int port;
+    int printers;
+    int cacheSize;
+    int timeout;
+    FirmwareEmulatorConfig firmware;
+    fs::path dir;
+};
+struct PrinterResult {
+    string slug;
+    bool finished;
+    uint64_t lines;
+    double seconds;
+    uint64_t resends;
+    double ackP99Micros;
+    double fileToWireP99Micros;
+    FirmwareEmulatorStats emulator;
+};
+struct RunResult {
+    double serverCpuSeconds;
+    double webSeconds;
+    vector<PrinterResult> printers;
+    RunResult():serverCpuSeconds(0),webSeconds(0) {}
+    double linesPerSecond() const {
+        double sum = 0;
+        for(size_t i=0;i<printers.size();i++)
+            if(printers[i].seconds>0) sum += printers[i].lines/printers[i].seconds;
+        return sum;
+    }
+    uint64_t worstStarveP99Micros() const {
+        uint64_t worst = 0;
+        for(size_t i=0;i<printers.size();i++)
+            worst = max(worst,printers[i].emulator.starveP99Micros);
+        return worst;
+    }
+};
+
+/** Prints the job on all printers while dashboards poll the server.
+ Forks emulators and the server, so no thread may exist when called. */
+static bool runPrint(const HarnessConfig &c,const char *name,int dashboards,WebLoad &load,RunResult &r) {
+    fs::path dir = c.dir/name;
+    fs::create_directories(dir);
+    bench::writeServerConfig(dir,boost::lexical_cast<string>(c.port),c.website,c.languages);
+    vector<boost::shared_ptr<FirmwareEmulatorProcess> > emulators;
+    r.printers.resize(c.printers);
+    for(int i=0;i<c.printers;i++) {
+        r.printers[i].slug = printerSlug(i);
+        emulators.push_back(boost::shared_ptr<FirmwareEmulatorProcess>(new FirmwareEmulatorProcess()));
+        try {
+            string device = emulators.back()->start(c.firmware);
+            bench::writePrinterConfig(dir,r.printers[i].slug,device,c.firmware.baudrate,c.firmware.protocol,c.cacheSize,false);
+        } catch(std::exception &ex) {
+            cerr << "error: " << ex.what() << endl;
+            return false;
+        }
+    }
+    ServerProcess server;
+    if(!server.start(c.server,dir/"server.conf",dir/"server.log")) {
+        cerr << "error: Could not start " << c.server << endl;
+        return false;
+    }
+    // Wait for the web server and the handshake of all printers
+    HttpClient monitor(c.port);
+    string text;
+    map<string,double> values;
+    bool ready = false;
+    for(int waited=0;!ready && waited<30000;waited+=POLL_MILLIS) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(POLL_MILLIS));
+        if(monitor.get("/metrics",text)!=200) continue;
+        parseMetrics(text,values);
+        ready = true;
+        for(int i=0;i<c.printers;i++) {
+            const string &slug = r.printers[i].slug;
+            ready &= printerValue(values,"repetier_printer_online",slug)==1 &&
+                printerValue(values,"repetier_printer_lines_sent_total",slug)>=2 &&
+                printerValue(values,"repetier_printer_manual_queue_depth",slug)==0 &&
+                printerValue(values,"repetier_printer_receive_cache_fill_bytes",slug)==0;
+        }
+    }
+    vector<int> jobIds;
+    string jobUpload = multipartBody("bench.gcode",c.job);
+    for(int i=0;ready && i<c.printers;i++) {
+        int status = monitor.request("POST","/printer/job/"+r.printers[i].slug+"?a=upload&name=bench",MULTIPART_TYPE,jobUpload,text);
+        jobIds.push_back(lastJobId(text));
+        ready = status==200 && jobIds.back()>=0;
+    }
+    if(!ready) {
+        cerr << "error: Server or printers did not get ready, see " << (dir/"server.log").string() << endl;
+        server.stop();
+        return false;
+    }
+    monitor.get("/metrics",text);
+    parseMetrics(text,values);
+    vector<double> linesBefore(c.printers);
+    for(int i=0;i<c.printers;i++)
+        linesBefore[i] = printerValue(values,"repetier_printer_lines_sent_total",r.printers[i].slug);
+
+    boost::thread_group threads;
+    load.stopRequested = false;
+    for(int d=0;d<dashboards;d++)
+        threads.create_thread(boost::bind(&runDashboard,&load,d));
+    uint64_t start = LatencyHistogram::now();
+    for(int i=0;i<c.printers;i++)
+        monitor.get("/printer/job/"+r.printers[i].slug+"?a=start&id="+boost::lexical_cast<string>(jobIds[i]),text);
+    int running = c.printers;
+    for(int i=0;i<c.printers;i++) {
+        r.printers[i].finished = false;
+        r.printers[i].seconds = 0;
+        r.printers[i].lines = 0;
+    }
+    while(running>0 && LatencyHistogram::now()-start<(uint64_t)c.timeout*1000000) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(POLL_MILLIS));
+        if(monitor.get("/metrics",text)!=200) continue;
+        parseMetrics(text,values);
+        for(int i=0;i<c.printers;i++) {
+            PrinterResult &p = r.printers[i];
+            if(p.finished) continue;
+            double lines = printerValue(values,"repetier_printer_lines_sent_total",p.slug)-linesBefore[i];
+            if(lines>0 && printerValue(values,"repetier_printer_job_running",p.slug)==0 &&
+               printerValue(values,"repetier_printer_job_queue_depth",p.slug)==0 &&
+               printerValue(values,"repetier_printer_receive_cache_fill_bytes",p.slug)==0) {
+                p.finished = true;
+                p.lines = (uint64_t)lines;
+                p.seconds = (LatencyHistogram::now()-start)/1000000.0;
+                p.resends = (uint64_t)printerValue(values,"repetier_printer_resends_total",p.slug);
+                running--;
+            }
+        }
+    }
+    load.stopRequested = true;
+    threads.join_all();
+    r.webSeconds = (LatencyHistogram::now()-start)/1000000.0;
+    for(int i=0;i<c.printers;i++) {
+        PrinterResult &p = r.printers[i];
+        monitor.get("/printer/latency/"+p.slug,text);
+        p.ackP99Micros = jsonNumber(text,"data.ack.p99Micros");
+        p.fileToWireP99Micros = jsonNumber(text,"data.fileToWire.p99Micros");
+    }
+    r.serverCpuSeconds = server.stop();
+    for(int i=0;i<c.printers;i++)
+        emulators[i]->stop(r.printers[i].emulator);
+    return running==0;
+}
+
+static void writeRun(ostream &out,const RunResult &r) {
+    out << "{\"serverCpuSeconds\":" << r.serverCpuSeconds
+    << ",\"linesPerSecond\":" << r.linesPerSecond()
+    << ",\"worstStarveP99Micros\":" << r.worstStarveP99Micros()
+    << ",\"printers\":[";
+    for(size_t i=0;i<r.printers.size();i++) {
+        const PrinterResult &p = r.printers[i];
+        if(i) out << ",";
+        out << "{\"slug\":\"" << p.slug << "\",\"finished\":" << (p.finished ? "true" : "false")
+        << ",\"lines\":" << p.lines << ",\"seconds\":" << p.seconds
+        << ",\"linesPerSecond\":" << (p.seconds>0 ? p.lines/p.seconds : 0)
+        << ",\"resends\":" << p.resends
+        << ",\"ackP99Micros\":" << p.ackP99Micros
+        << ",\"fileToWireP99Micros\":" << p.fileToWireP99Micros
+        << ",\"starveP50Micros\":" << p.emulator.starveP50Micros
+        << ",\"starveP99Micros\":" << p.emulator.starveP99Micros
+        << ",\"starveMaxMicros\":" << p.emulator.starveMaxMicros
+        << ",\"overflowBytes\":" << p.emulator.overflowBytes << "}";
+    }
+    out << "]";
+}
+static void writeWeb(ostream &out,WebLoad &load,double seconds) {
+    boost::mutex::scoped_lock l(load.mutex);
+    uint64_t requests = 0,errors = 0;
+    for(int k=0;k<REQUEST_KINDS;k++) {
+        requests += load.times[k].count();
+        errors += load.errors[k];
+    }
+    out << "{\"seconds\":" << seconds << ",\"requests\":" << requests
+    << ",\"requestsPerSecond\":" << (seconds>0 ? requests/seconds : 0)
+    << ",\"errors\":" << errors
+    << ",\"bytesPerSecond\":" << (seconds>0 ? load.bytes/seconds : 0) << ",\"kinds\":[";
+    for(int k=0;k<REQUEST_KINDS;k++) {
+        const LatencyHistogram &h = load.times[k];
+        if(k) out << ",";
+        out << "{\"name\":\"" << requestMix[k].name << "\",\"count\":" << h.count()
+        << ",\"errors\":" << load.errors[k]
+        << ",\"p50Micros\":" << h.percentile(0.5) << ",\"p99Micros\":" << h.percentile(0.99)
+        << ",\"p999Micros\":" << h.percentile(0.999) << ",\"maxMicros\":" << h.max() << "}";
+    }
+    out << "]}";
+}
+
+int main(int argc, const char * argv[])
+{
+    HarnessConfig c;
+    WebLoad load;
+    string flavor,tmp,job;
+    int dashboards,generate,uploadKB;
+    bool baseline;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("server",po::value<string>(&c.server)->default_value(SERVER_BINARY),"Server binary to test")
+		("www",po::value<string>(&c.website)->default_value(string(SOURCE_ROOT)+"/www"),"Website directory")
+		("languages",po::value<string>(&c.languages)->default_value(string(SOURCE_ROOT)+"/languages"),"Languages directory")
+		("port",po::value<int>(&c.port)->default_value(18089),"Loopback port for the server")
+		("printers",po::value<int>(&c.printers)->default_value(2),"Emulated printers")
+		("dashboards",po::value<int>(&dashboards)->default_value(16),"Simulated dashboards")
+		("think-ms",po::value<int>(&load.thinkMillis)->default_value(100),"Pause of a dashboard after each polling cycle")
+		("upload-kb",po::value<int>(&uploadKB)->default_value(256),"Size of the uploaded model")
+		("job",po::value<string>(&job),"G-code file to print")
+		("generate",po::value<int>(&generate)->default_value(10000),"Lines of the generated job if no job is given")
+		("firmware",po::value<string>(&flavor)->default_value("repetier"),"repetier or marlin")
+		("baudrate",po::value<int>(&c.firmware.baudrate)->default_value(250000),"Baud rate of the emulated links")
+		("protocol",po::value<int>(&c.firmware.protocol)->default_value(2),"0 = ASCII, 1 and 2 = Repetier binary protocol")
+		("cache",po::value<int>(&c.cacheSize)->default_value(127),"Receive buffer of the firmware and readCacheSize of the host")
+		("queue",po::value<int>(&c.firmware.commandQueue)->default_value(16),"Commands buffered by the firmware")
+		("move-us",po::value<int>(&c.firmware.moveMicros)->default_value(0),"Execution time of G0/G1 in microseconds")
+		("baseline",po::value<bool>(&baseline)->default_value(true),"Print once without web load for comparison")
+		("timeout",po::value<int>(&c.timeout)->default_value(300),"Abort a print after this many seconds")
+		("tmp",po::value<string>(&tmp),"Working directory, a temporary one is created otherwise")
+		;
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(std::exception &ex) {
+		cerr << "error: Error parsing command line: " << ex.what() << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << desc << "\n";
+		return 1;
+	}
+    if(c.printers<1 || dashboards<0) {
+        cerr << "error: Need at least one printer" << endl;
+        return 1;
+    }
+    if(flavor=="marlin") {
+        c.firmware.flavor = FirmwareEmulatorConfig::MARLIN;
+        c.firmware.protocol = 0;
+    }
+    c.firmware.receiveBuffer = c.cacheSize;
+    c.firmware.heatSeconds = 0;
+    signal(SIGPIPE,SIG_IGN);
+    c.dir = tmp.length() ? fs::path(tmp) : fs::temp_directory_path()/fs::unique_path("repetier-load-%%%%%%%%");
+    fs::create_directories(c.dir);
+    c.website = fs::absolute(c.website).string();
+    c.languages = fs::absolute(c.languages).string();
+    if(job.empty()) {
+        job = (c.dir/"generated.gcode").string();
+        bench::generateJob(job,generate);
+    }
+    ifstream jobIn(job.c_str(),ios::binary);
+    if(!jobIn) {
+        cerr << "error: Job " << job << " not found" << endl;
+        return 1;
+    }
+    c.job.assign(istreambuf_iterator<char>(jobIn),istreambuf_iterator<char>());
+    string model = (c.dir/"upload.gcode").string();
+    bench::generateJob(model,uploadKB*1024/25); // Generated lines have about 25 bytes
+    ifstream modelIn(model.c_str(),ios::binary);
+    load.upload = multipartBody("upload.gcode",string(istreambuf_iterator<char>(modelIn),istreambuf_iterator<char>()));
+    load.port = c.port;
+    load.printers = c.printers;
+
+    RunResult idle,loaded;
+    bool ok = true;
+    if(baseline) {
+        WebLoad none;
+        ok = runPrint(c,"baseline",0,none,idle);
+    }
+    if(ok)
+        ok = runPrint(c,"loaded",dashboards,load,loaded);
+
+    ostringstream out;
+    out << "{\"architecture\":\"" << bench::architecture() << "\",\"finished\":" << (ok ? "true" : "false")
+    << ",\"printers\":" << c.printers << ",\"dashboards\":" << dashboards
+    << ",\"thinkMillis\":" << load.thinkMillis << ",\"firmware\":\"" << flavor << "\""
+    << ",\"baudrate\":" << c.firmware.baudrate << ",\"protocol\":" << c.firmware.protocol;
+    if(baseline) {
+        out << ",\"baseline\":";
+        writeRun(out,idle);
+        out << "}";
+    }
+    out << ",\"loaded\":";
+    writeRun(out,loaded);
+    out << ",\"web\":";
+    writeWeb(out,load,loaded.webSeconds);
+    out << "}";
+    if(baseline && idle.linesPerSecond()>0)
+        out << ",\"degradation\":{\"throughputRatio\":" << loaded.linesPerSecond()/idle.linesPerSecond()
+        << ",\"addedStarveP99Micros\":" << (double)loaded.worstStarveP99Micros()-(double)idle.worstStarveP99Micros()
+        << ",\"serverCpuRatio\":" << (idle.serverCpuSeconds>0 ? loaded.serverCpuSeconds/idle.serverCpuSeconds : 0) << "}";
+    out << "}";
+    cout << out.str() << endl;
+    if(tmp.empty()) {
+        boost::system::error_code ec;
+        fs::remove_all(c.dir,ec);
+    }
+    return ok ? 0 : 3;
+}
@@ -0,0 +1,186 @@
+/*
+ Copyright 2012 Roland Littwin (repetier) repetierdev@gmail.com
+ Homepage: http://www.repetier.com
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/* Prints a job through Printer, PrintjobManager and PrinterSerial against
+ the firmware emulator and reports the streaming performance as one line
+ of JSON on stdout.
+
+ The emulator runs in a child process, so the CPU time measured for the
+ parent is the cost of the server stack alone. */
+
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "FirmwareEmulator.h"
+#include "BenchmarkSupport.h"
+#include "global_config.h"
+#include "printer.h"
+#include "Printjob.h"
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+static void writeHistogram(ostream &out,const char *name,const LatencyHistogram &h) {
+    out << ",\"" << name << "\":{\"count\":" << h.count() << ",\"p50Micros\":" << h.percentile(0.5)
+    << ",\"p99Micros\":" << h.percentile(0.99) << ",\"maxMicros\":" << h.max() << "}";
+}
+
+int main(int argc, const char * argv[])
+{
+    FirmwareEmulatorConfig fwConfig;
+    string job,flavor,tmp;
+    int generate,timeout,cacheSize;
+    bool pingpong;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("job",po::value<string>(&job),"G-code file to print")
+		("generate",po::value<int>(&generate)->default_value(20000),"Lines of the generated job if no job is given")
+		("firmware",po::value<string>(&flavor)->default_value("repetier"),"repetier or marlin")
+		("baudrate",po::value<int>(&fwConfig.baudrate)->default_value(250000),"Baud rate of the emulated link")
+		("protocol",po::value<int>(&fwConfig.protocol)->default_value(2),"0 = ASCII, 1 and 2 = Repetier binary protocol")
+		("cache",po::value<int>(&cacheSize)->default_value(127),"Receive buffer of the firmware and readCacheSize of the host")
+		("pingpong",po::value<bool>(&pingpong)->default_value(false),"Wait for ok after each line")
+		("queue",po::value<int>(&fwConfig.commandQueue)->default_value(16),"Commands buffered by the firmware")
+		("advanced-ok",po::value<bool>(&fwConfig.advancedOk)->default_value(false),"Marlin reports free buffer slots with each ok")
+		("move-us",po::value<int>(&fwConfig.moveMicros)->default_value(0),"Execution time of G0/G1 in microseconds")
+		("command-us",po::value<int>(&fwConfig.commandMicros)->default_value(0),"Execution time of other commands in microseconds")
+		("corrupt",po::value<double>(&fwConfig.corruptRate)->default_value(0),"Probability that a received line is damaged")
+		("seed",po::value<unsigned>(&fwConfig.seed)->default_value(1),"Seed for line corruption")
+		("timeout",po::value<int>(&timeout)->default_value(600),"Abort after this many seconds")
+		("tmp",po::value<string>(&tmp),"Working directory, a temporary one is created otherwise")
+		;
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(std::exception &ex) {
+		cerr << "error: Error parsing command line: " << ex.what() << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << desc << "\n";
+		return 1;
+	}
+    if(flavor=="marlin") {
+        fwConfig.flavor = FirmwareEmulatorConfig::MARLIN;
+        fwConfig.protocol = 0;
+    }
+    fwConfig.receiveBuffer = cacheSize;
+    fwConfig.heatSeconds = 0;
+    fs::path dir = tmp.length() ? fs::path(tmp) : fs::temp_directory_path()/fs::unique_path("repetier-bench-%%%%%%%%");
+    fs::create_directories(dir);
+    if(job.empty()) {
+        job = (dir/"generated.gcode").string();
+        bench::generateJob(job,generate);
+    }
+    if(!fs::exists(job)) {
+        cerr << "error: Job " << job << " not found" << endl;
+        return 1;
+    }
+    // Start the firmware before any thread exists, fork and threads do not mix
+    FirmwareEmulatorProcess fw;
+    string device;
+    try {
+        device = fw.start(fwConfig);
+    } catch(std::exception &ex) {
+        cerr << "error: " << ex.what() << endl;
+        return 1;
+    }
+
+    bench::writeConfigs(dir,device,fwConfig.baudrate,fwConfig.protocol,cacheSize,pingpong);
+    gconfig = new GlobalConfig((dir/"server.conf").string());
+    gconfig->daemon = true; // Log to syslog, stdout is for the result
+    Printer *printer = new Printer((dir/"printers"/"bench.cfg").string());
+    gconfig->getPrinterList().push_back(printer);
+    printer->startThread();
+
+    // Wait for the handshake after "start" to finish
+    PrinterMetrics m;
+    int waited = 0;
+    for(;;waited+=20) {
+        printer->getMetrics(m);
+        if(m.online && m.linesSend>=2 && m.manualQueue==0 && m.receiveCacheFill==0) break;
+        if(waited>20000) {
+            cerr << "error: Printer did not connect to " << device << endl;
+            FirmwareEmulatorStats ignored;
+            fw.stop(ignored);
+            _exit(2);
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+
+    PrintjobManager *jobs = printer->getJobManager();
+    PrintjobPtr pj = jobs->createNewPrintjob("benchmark");
+    fs::copy_file(job,pj->getFilename(),fs::copy_option::overwrite_if_exists);
+    jobs->finishPrintjobCreation(pj,"benchmark",(size_t)fs::file_size(job));
+    PrinterMetrics before;
+    printer->getMetrics(before);
+    uint64_t cpuStart = bench::cpuMicros();
+    uint64_t start = LatencyHistogram::now();
+    jobs->startJob(pj->getId());
+    bool finished = false;
+    while(!finished) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+        printer->getMetrics(m);
+        finished = !m.jobRunning && m.jobQueue==0 && m.receiveCacheFill==0;
+        if(LatencyHistogram::now()-start>(uint64_t)timeout*1000000) break;
+    }
+    uint64_t elapsed = LatencyHistogram::now()-start;
+    uint64_t cpu = bench::cpuMicros()-cpuStart;
+    PrinterLatency latency;
+    printer->getLatency(latency);
+
+    FirmwareEmulatorStats fwStats;
+    if(!fw.stop(fwStats))
+        cerr << "error: No statistics from the firmware emulator" << endl;
+
+    uint64_t lines = m.linesSend-before.linesSend;
+    uint64_t bytes = m.bytesSend-before.bytesSend;
+    double seconds = elapsed/1000000.0;
+    double capacity = fwConfig.baudrate/10.0;
+    ostringstream out;
+    out << "{\"job\":\"" << fs::path(job).filename().string() << "\""
+    << ",\"finished\":" << (finished ? "true" : "false")
+    << ",\"firmware\":\"" << flavor << "\",\"baudrate\":" << fwConfig.baudrate
+    << ",\"protocol\":" << fwConfig.protocol << ",\"advancedOk\":" << (fwConfig.advancedOk ? "true" : "false") << ",\"cache\":" << cacheSize
+    << ",\"pingpong\":" << (pingpong ? "true" : "false")
+    << ",\"lines\":" << lines << ",\"bytes\":" << bytes << ",\"seconds\":" << seconds
+    << ",\"linesPerSecond\":" << lines/seconds << ",\"bytesPerSecond\":" << bytes/seconds
+    << ",\"baudCapacityBytesPerSecond\":" << capacity
+    << ",\"linkUtilization\":" << (capacity>0 ? bytes/seconds/capacity : 0)
+    << ",\"cpuMicrosPerLine\":" << (lines ? (double)cpu/lines : 0)
+    << ",\"resends\":" << m.resends-before.resends
+    << ",\"refillP50Micros\":" << fwStats.starveP50Micros
+    << ",\"refillP99Micros\":" << fwStats.starveP99Micros;
+    writeHistogram(out,"resendRecovery",latency.resendRecovery);
+    writeHistogram(out,"ack",latency.ack);
+    writeHistogram(out,"fileToWire",latency.fileToWire);
+    out << ",\"emulator\":";
+    fwStats.writeJSON(out);
+    out << "}";
+    cout << out.str() << endl;
+    if(tmp.empty()) {
+        boost::system::error_code ec;
+        fs::remove_all(dir,ec);
+    }
+    _exit(finished ? 0 : 3); // Printer threads are still running
+}